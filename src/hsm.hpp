@@ -10,6 +10,17 @@
 #include <iostream>
 #include <algorithm>
 #include <random>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <type_traits>
+#include <utility>
 
 //#define USE_DOUBLE
 #ifdef USE_DOUBLE
@@ -18,6 +29,44 @@
 	typedef float Float;
 #endif
 
+//SIMD kernels are chosen at compile time, define HSM_NO_SIMD to force the scalar code.
+#if !defined(HSM_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HSM_SSE
+#endif
+#if defined(__AVX__)
+#define HSM_AVX
+#endif
+#if defined(__AVX2__)
+#define HSM_AVX2
+#endif
+#endif
+
+#if defined(HSM_SSE) || defined(HSM_AVX)
+#include <immintrin.h>
+#endif
+
+//constexpr functions with a SIMD fast path take it only outside of constant evaluation,
+//compilers without the builtin always run the scalar path.
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+#define HSM_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+#endif
+#if !defined(HSM_IS_CONSTANT_EVALUATED) && ((defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 9) || (defined(_MSC_VER) && _MSC_VER >= 1925))
+#define HSM_IS_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#endif
+
+//HSM_INLINE forces a kernel into the loop that calls it, where its Pack arguments stay in registers, whatever the
+//inlining limits of the compiler. HSM_NOINLINE keeps rarely taken paths out of such kernels.
+#if defined(_MSC_VER)
+#define HSM_INLINE __forceinline
+#define HSM_NOINLINE __declspec(noinline)
+#else
+#define HSM_INLINE inline __attribute__((always_inline))
+#define HSM_NOINLINE __attribute__((noinline))
+#endif
+
 #if defined(_MSC_VER)
 #pragma warning(disable : 4305)
 #pragma warning(disable : 4244)
@@ -32,25 +81,690 @@ static constexpr Float Infinity = std::numeric_limits<Float>::infinity();
 static constexpr Float Sqrt2    = 1.41421356237309504880;
 static constexpr Float Pi       = 3.14159265358979323846;
 static constexpr Float InvPi    = 0.31830988618379067154;
+static constexpr Float Inv2Pi   = 0.15915494309189533577;
+static constexpr Float Inv4Pi   = 0.07957747154594766788;
+static constexpr Float PiOver2  = 1.57079632679489661923;
+static constexpr Float PiOver4  = 0.78539816339744830961;
+#ifdef USE_DOUBLE
+static constexpr Float OneMinusEpsilon = 0.99999999999999989;
+#else
+static constexpr Float OneMinusEpsilon = 0.99999994f;
+#endif
+//Bound on the relative error of one rounding to nearest, half the distance from 1 to the next Float
+static constexpr Float MachineEpsilon = std::numeric_limits<Float>::epsilon() * 0.5;
+//Shadow rays stop this fraction of the distance before their target
+static constexpr Float ShadowEpsilon = 0.0001f;
+
+//SIMD primitives
+namespace simd {
+
+//Pack holds as many Floats as the widest enabled register, scalar code uses Float directly.
+//Kernels written against both through Load/Store and the overloads below stay bit-compatible.
+#if !defined(USE_DOUBLE) && defined(HSM_AVX)
+struct Pack {
+	typedef __m256 Native;
+	static const int Width = 8;
+	Pack() {}
+	Pack(Native n) : v(n) {}
+	Pack(Float f) : v(_mm256_set1_ps(f)) {}
+	static Pack Load(const Float* p) { return _mm256_loadu_ps(p); }
+	template <typename F> static Pack FromLanes(F lane) {
+		return _mm256_setr_ps(lane(0), lane(1), lane(2), lane(3), lane(4), lane(5), lane(6), lane(7));
+	}
+	void Store(Float* p) const { _mm256_storeu_ps(p, v); }
+	Native v;
+};
+inline Pack operator + (Pack a, Pack b) { return _mm256_add_ps(a.v, b.v); }
+inline Pack operator - (Pack a, Pack b) { return _mm256_sub_ps(a.v, b.v); }
+inline Pack operator * (Pack a, Pack b) { return _mm256_mul_ps(a.v, b.v); }
+inline Pack operator / (Pack a, Pack b) { return _mm256_div_ps(a.v, b.v); }
+inline Pack Min(Pack a, Pack b) { return _mm256_min_ps(a.v, b.v); }
+inline Pack Max(Pack a, Pack b) { return _mm256_max_ps(a.v, b.v); }
+inline Pack Sqrt(Pack a) { return _mm256_sqrt_ps(a.v); }
+inline Pack Abs(Pack a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline Pack operator < (Pack a, Pack b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline Pack operator <= (Pack a, Pack b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline Pack operator > (Pack a, Pack b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline Pack operator >= (Pack a, Pack b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline int MoveMask(Pack mask) { return _mm256_movemask_ps(mask.v); }
+inline Pack Select(Pack mask, Pack a, Pack b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+//Lanes with the sign bit set, including -0. Select and MoveMask only read the sign bit of a mask.
+inline Pack SignBit(Pack a) { return _mm256_and_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline Pack Floor(Pack a) { return _mm256_floor_ps(a.v); }
+inline Pack Ceil(Pack a) { return _mm256_ceil_ps(a.v); }
+//2^n for integral n in [-126, 127]: (n + 127) << 23 is exact as a float, converting it gives the bits
+inline Pack Pow2(Pack n) { return _mm256_castsi256_ps(_mm256_cvttps_epi32(((n + Pack(127)) * Pack(8388608.0f)).v)); }
+//floor(log2(a)) for normal a > 0
+inline Pack Exponent(Pack a) {
+	__m256 bits = _mm256_and_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7f800000)));
+	return Pack(_mm256_cvtepi32_ps(_mm256_castps_si256(bits))) * Pack(1.0f / 8388608.0f) - Pack(127);
+}
+//rsqrtps estimate (12 bits) refined by one Newton step
+inline Pack RSqrtFast(Pack a) {
+	Pack r = _mm256_rsqrt_ps(a.v);
+	return r * (Pack(1.5f) - Pack(0.5f) * a * r * r);
+}
+#elif defined(USE_DOUBLE) && defined(HSM_AVX)
+struct Pack {
+	typedef __m256d Native;
+	static const int Width = 4;
+	Pack() {}
+	Pack(Native n) : v(n) {}
+	Pack(Float f) : v(_mm256_set1_pd(f)) {}
+	static Pack Load(const Float* p) { return _mm256_loadu_pd(p); }
+	template <typename F> static Pack FromLanes(F lane) { return _mm256_setr_pd(lane(0), lane(1), lane(2), lane(3)); }
+	void Store(Float* p) const { _mm256_storeu_pd(p, v); }
+	Native v;
+};
+inline Pack operator + (Pack a, Pack b) { return _mm256_add_pd(a.v, b.v); }
+inline Pack operator - (Pack a, Pack b) { return _mm256_sub_pd(a.v, b.v); }
+inline Pack operator * (Pack a, Pack b) { return _mm256_mul_pd(a.v, b.v); }
+inline Pack operator / (Pack a, Pack b) { return _mm256_div_pd(a.v, b.v); }
+inline Pack Min(Pack a, Pack b) { return _mm256_min_pd(a.v, b.v); }
+inline Pack Max(Pack a, Pack b) { return _mm256_max_pd(a.v, b.v); }
+inline Pack Sqrt(Pack a) { return _mm256_sqrt_pd(a.v); }
+inline Pack Abs(Pack a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+inline Pack operator < (Pack a, Pack b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+inline Pack operator <= (Pack a, Pack b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+inline Pack operator > (Pack a, Pack b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+inline Pack operator >= (Pack a, Pack b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ); }
+inline int MoveMask(Pack mask) { return _mm256_movemask_pd(mask.v); }
+inline Pack Select(Pack mask, Pack a, Pack b) { return _mm256_blendv_pd(b.v, a.v, mask.v); }
+//Lanes with the sign bit set, including -0. Select and MoveMask only read the sign bit of a mask.
+inline Pack SignBit(Pack a) { return _mm256_and_pd(a.v, _mm256_set1_pd(-0.0)); }
+inline Pack Floor(Pack a) { return _mm256_floor_pd(a.v); }
+inline Pack Ceil(Pack a) { return _mm256_ceil_pd(a.v); }
+//2^n for integral n in [-1022, 1023], (n + 1023) << 20 goes into the high half of every double
+inline Pack Pow2(Pack n) {
+	__m128i e = _mm_slli_epi32(_mm256_cvtpd_epi32((n + Pack(1023)).v), 20);
+	__m128i lo = _mm_unpacklo_epi32(_mm_setzero_si128(), e), hi = _mm_unpackhi_epi32(_mm_setzero_si128(), e);
+	return _mm256_castsi256_pd(_mm256_insertf128_si256(_mm256_castsi128_si256(lo), hi, 1));
+}
+//floor(log2(a)) for normal a > 0, read from the high halves
+inline Pack Exponent(Pack a) {
+	__m256d bits = _mm256_and_pd(a.v, _mm256_castsi256_pd(_mm256_set1_epi64x(0x7ff0000000000000ll)));
+	__m128 lo = _mm_castpd_ps(_mm256_castpd256_pd128(bits)), hi = _mm_castpd_ps(_mm256_extractf128_pd(bits, 1));
+	__m128i high = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+	return Pack(_mm256_cvtepi32_pd(high)) * Pack(1.0 / 1048576.0) - Pack(1023);
+}
+//No double estimate below AVX-512
+inline Pack RSqrtFast(Pack a) { return Pack(1) / Sqrt(a); }
+#elif !defined(USE_DOUBLE) && defined(HSM_SSE)
+struct Pack {
+	typedef __m128 Native;
+	static const int Width = 4;
+	Pack() {}
+	Pack(Native n) : v(n) {}
+	Pack(Float f) : v(_mm_set1_ps(f)) {}
+	static Pack Load(const Float* p) { return _mm_loadu_ps(p); }
+	template <typename F> static Pack FromLanes(F lane) { return _mm_setr_ps(lane(0), lane(1), lane(2), lane(3)); }
+	void Store(Float* p) const { _mm_storeu_ps(p, v); }
+	Native v;
+};
+inline Pack operator + (Pack a, Pack b) { return _mm_add_ps(a.v, b.v); }
+inline Pack operator - (Pack a, Pack b) { return _mm_sub_ps(a.v, b.v); }
+inline Pack operator * (Pack a, Pack b) { return _mm_mul_ps(a.v, b.v); }
+inline Pack operator / (Pack a, Pack b) { return _mm_div_ps(a.v, b.v); }
+inline Pack Min(Pack a, Pack b) { return _mm_min_ps(a.v, b.v); }
+inline Pack Max(Pack a, Pack b) { return _mm_max_ps(a.v, b.v); }
+inline Pack Sqrt(Pack a) { return _mm_sqrt_ps(a.v); }
+inline Pack Abs(Pack a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline Pack operator < (Pack a, Pack b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Pack operator <= (Pack a, Pack b) { return _mm_cmple_ps(a.v, b.v); }
+inline Pack operator > (Pack a, Pack b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Pack operator >= (Pack a, Pack b) { return _mm_cmpge_ps(a.v, b.v); }
+inline int MoveMask(Pack mask) { return _mm_movemask_ps(mask.v); }
+inline Pack Select(Pack mask, Pack a, Pack b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+//Lanes with the sign bit set, including -0
+inline Pack SignBit(Pack a) { return _mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(a.v), 31)); }
+//2^n for integral n in [-126, 127]: (n + 127) << 23 is exact as a float, converting it gives the bits
+inline Pack Pow2(Pack n) { return _mm_castsi128_ps(_mm_cvttps_epi32(((n + Pack(127)) * Pack(8388608.0f)).v)); }
+//floor(log2(a)) for normal a > 0
+inline Pack Exponent(Pack a) {
+	__m128 bits = _mm_and_ps(a.v, _mm_castsi128_ps(_mm_set1_epi32(0x7f800000)));
+	return Pack(_mm_cvtepi32_ps(_mm_castps_si128(bits))) * Pack(1.0f / 8388608.0f) - Pack(127);
+}
+//rsqrtps estimate (12 bits) refined by one Newton step
+inline Pack RSqrtFast(Pack a) {
+	Pack r = _mm_rsqrt_ps(a.v);
+	return r * (Pack(1.5f) - Pack(0.5f) * a * r * r);
+}
+#elif defined(USE_DOUBLE) && defined(HSM_SSE)
+struct Pack {
+	typedef __m128d Native;
+	static const int Width = 2;
+	Pack() {}
+	Pack(Native n) : v(n) {}
+	Pack(Float f) : v(_mm_set1_pd(f)) {}
+	static Pack Load(const Float* p) { return _mm_loadu_pd(p); }
+	template <typename F> static Pack FromLanes(F lane) { return _mm_setr_pd(lane(0), lane(1)); }
+	void Store(Float* p) const { _mm_storeu_pd(p, v); }
+	Native v;
+};
+inline Pack operator + (Pack a, Pack b) { return _mm_add_pd(a.v, b.v); }
+inline Pack operator - (Pack a, Pack b) { return _mm_sub_pd(a.v, b.v); }
+inline Pack operator * (Pack a, Pack b) { return _mm_mul_pd(a.v, b.v); }
+inline Pack operator / (Pack a, Pack b) { return _mm_div_pd(a.v, b.v); }
+inline Pack Min(Pack a, Pack b) { return _mm_min_pd(a.v, b.v); }
+inline Pack Max(Pack a, Pack b) { return _mm_max_pd(a.v, b.v); }
+inline Pack Sqrt(Pack a) { return _mm_sqrt_pd(a.v); }
+inline Pack Abs(Pack a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a.v); }
+inline Pack operator < (Pack a, Pack b) { return _mm_cmplt_pd(a.v, b.v); }
+inline Pack operator <= (Pack a, Pack b) { return _mm_cmple_pd(a.v, b.v); }
+inline Pack operator > (Pack a, Pack b) { return _mm_cmpgt_pd(a.v, b.v); }
+inline Pack operator >= (Pack a, Pack b) { return _mm_cmpge_pd(a.v, b.v); }
+inline int MoveMask(Pack mask) { return _mm_movemask_pd(mask.v); }
+inline Pack Select(Pack mask, Pack a, Pack b) { return _mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v)); }
+//Lanes with the sign bit set, including -0. The shifted high halves are copied over the low ones.
+inline Pack SignBit(Pack a) {
+	return _mm_castsi128_pd(_mm_shuffle_epi32(_mm_srai_epi32(_mm_castpd_si128(a.v), 31), _MM_SHUFFLE(3, 3, 1, 1)));
+}
+//2^n for integral n in [-1022, 1023], (n + 1023) << 20 goes into the high half of every double
+inline Pack Pow2(Pack n) {
+	__m128i e = _mm_slli_epi32(_mm_cvtpd_epi32((n + Pack(1023)).v), 20);
+	return _mm_castsi128_pd(_mm_unpacklo_epi32(_mm_setzero_si128(), e));
+}
+//floor(log2(a)) for normal a > 0, read from the high halves
+inline Pack Exponent(Pack a) {
+	__m128d bits = _mm_and_pd(a.v, _mm_castsi128_pd(_mm_set1_epi64x(0x7ff0000000000000ll)));
+	__m128i high = _mm_shuffle_epi32(_mm_castpd_si128(bits), _MM_SHUFFLE(3, 1, 3, 1));
+	return Pack(_mm_cvtepi32_pd(high)) * Pack(1.0 / 1048576.0) - Pack(1023);
+}
+//No double estimate below AVX-512
+inline Pack RSqrtFast(Pack a) { return Pack(1) / Sqrt(a); }
+#else
+struct Pack {
+	typedef Float Native;
+	static const int Width = 1;
+	Pack() {}
+	Pack(Float f) : v(f) {}
+	static Pack Load(const Float* p) { return *p; }
+	template <typename F> static Pack FromLanes(F lane) { return lane(0); }
+	void Store(Float* p) const { *p = v; }
+	Native v;
+};
+inline Pack operator + (Pack a, Pack b) { return a.v + b.v; }
+inline Pack operator - (Pack a, Pack b) { return a.v - b.v; }
+inline Pack operator * (Pack a, Pack b) { return a.v * b.v; }
+inline Pack operator / (Pack a, Pack b) { return a.v / b.v; }
+inline Pack Min(Pack a, Pack b) { return a.v < b.v ? a.v : b.v; }
+inline Pack Max(Pack a, Pack b) { return a.v > b.v ? a.v : b.v; }
+inline Pack Sqrt(Pack a) { return std::sqrt(a.v); }
+inline Pack Abs(Pack a) { return std::abs(a.v); }
+inline bool operator < (Pack a, Pack b) { return a.v < b.v; }
+inline bool operator <= (Pack a, Pack b) { return a.v <= b.v; }
+inline bool operator > (Pack a, Pack b) { return a.v > b.v; }
+inline bool operator >= (Pack a, Pack b) { return a.v >= b.v; }
+inline Pack Select(bool mask, Pack a, Pack b) { return mask ? a : b; }
+inline bool SignBit(Pack a) { return std::signbit(a.v); }
+inline Pack Pow2(Pack n) { return std::ldexp((Float)1, (int)n.v); }
+inline Pack Exponent(Pack a) { return (Float)std::ilogb(a.v); }
+inline Pack RSqrtFast(Pack a) { return (Float)1 / std::sqrt(a.v); }
+#endif
+
+#if (defined(HSM_SSE) && !defined(HSM_AVX)) || !defined(HSM_SSE)
+//SSE2 has no rounding instructions
+inline Pack Floor(Pack a) {
+	Float lanes[Pack::Width];
+	a.Store(lanes);
+	for (int i = 0; i < Pack::Width; ++i) lanes[i] = std::floor(lanes[i]);
+	return Pack::Load(lanes);
+}
+inline Pack Ceil(Pack a) {
+	Float lanes[Pack::Width];
+	a.Store(lanes);
+	for (int i = 0; i < Pack::Width; ++i) lanes[i] = std::ceil(lanes[i]);
+	return Pack::Load(lanes);
+}
+#endif
+
+//f on every lane, for the libm fallbacks
+template <typename F>
+inline Pack PerLane(Pack a, F f) {
+	Float lanes[Pack::Width];
+	a.Store(lanes);
+	return Pack::FromLanes([&](int i) { return f(lanes[i]); });
+}
+template <typename F>
+inline Pack PerLane(Pack a, Pack b, F f) {
+	Float lanesA[Pack::Width], lanesB[Pack::Width];
+	a.Store(lanesA);
+	b.Store(lanesB);
+	return Pack::FromLanes([&](int i) { return f(lanesA[i], lanesB[i]); });
+}
+
+template <typename P> inline P Load(const Float* p);
+template <> inline Float Load<Float>(const Float* p) { return *p; }
+template <> inline Pack Load<Pack>(const Float* p) { return Pack::Load(p); }
+inline void Store(Float* p, Float f) { *p = f; }
+inline void Store(Float* p, Pack f) { f.Store(p); }
+//Lane i loads p[i * stride]. Lanes are inserted in registers, storing them to a buffer and reloading
+//it as a whole stalls store forwarding on every call.
+template <typename P> inline P LoadStrided(const Float* p, size_t stride);
+template <> inline Float LoadStrided<Float>(const Float* p, size_t) { return *p; }
+template <> inline Pack LoadStrided<Pack>(const Float* p, size_t stride) {
+	return Pack::FromLanes([=](int i) { return p[i * stride]; });
+}
+//Lane i loads base[index[i * indexStride] * elementStride]
+template <typename P> inline P Gather(const Float* base, size_t elementStride, const uint32_t* index, size_t indexStride);
+template <> inline Float Gather<Float>(const Float* base, size_t elementStride, const uint32_t* index, size_t) {
+	return base[*index * elementStride];
+}
+template <> inline Pack Gather<Pack>(const Float* base, size_t elementStride, const uint32_t* index, size_t indexStride) {
+	return Pack::FromLanes([=](int i) { return base[index[i * indexStride] * elementStride]; });
+}
+//Min and Max return b when either operand is NaN, like minps/maxps
+inline Float Min(Float a, Float b) { return a < b ? a : b; }
+inline Float Max(Float a, Float b) { return a > b ? a : b; }
+inline int MoveMask(bool mask) { return mask ? 1 : 0; }
+inline Float Sqrt(Float a) { return std::sqrt(a); }
+inline Float Abs(Float a) { return std::abs(a); }
+inline Float Floor(Float a) { return std::floor(a); }
+inline Float Ceil(Float a) { return std::ceil(a); }
+inline Float Select(bool mask, Float a, Float b) { return mask ? a : b; }
+inline bool SignBit(Float a) { return std::signbit(a); }
+inline Float Pow2(Float n) { return std::ldexp((Float)1, (int)n); }
+inline Float Exponent(Float a) { return (Float)std::ilogb(a); }
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+//Same estimate and Newton step as the packs, so scalar tails match them
+inline Float RSqrtFast(Float a) {
+	Float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(a)));
+	return r * (1.5f - 0.5f * a * r * r);
+}
+#else
+inline Float RSqrtFast(Float a) { return (Float)1 / std::sqrt(a); }
+#endif
+template <typename F> inline Float PerLane(Float a, F f) { return f(a); }
+template <typename F> inline Float PerLane(Float a, Float b, F f) { return f(a, b); }
+
+//Calls kernel(i, Pack()) over whole packs and kernel(i, Float()) over the remaining tail.
+template <typename Kernel>
+inline void ForEach(size_t count, Kernel kernel) {
+	size_t packed = count - count % Pack::Width;
+	for (size_t i = 0; i < packed; i += Pack::Width) kernel(i, Pack());
+	for (size_t i = packed; i < count; ++i) kernel(i, Float());
+}
+
+//Expanded over K instead of looping, so the accumulators stay in registers without relying on the unroller.
+template <size_t... K>
+inline void MinMaxStep(const Float* p, Pack* lo, Pack* hi, std::index_sequence<K...>) {
+	int expand[] = { (lo[K] = Min(Pack::Load(p + K * Pack::Width), lo[K]), hi[K] = Max(Pack::Load(p + K * Pack::Width), hi[K]), 0)... };
+	(void)expand;
+}
+
+//Per component min and max over count records of Period interleaved Floats, like Point3f (3) or Bounds3f (6) arrays.
+//Period packs hold exactly Pack::Width records, so lane j of accumulator k always sees component (k * Width + j) % Period
+//and the loop needs plain loads only. NaN components are skipped.
+template <int Period>
+inline void MinMaxInterleaved(const Float* data, size_t count, Float* mins, Float* maxs) {
+	Pack lo[Period], hi[Period];
+	for (int k = 0; k < Period; ++k) {
+		lo[k] = Pack(std::numeric_limits<Float>::max());
+		hi[k] = Pack(std::numeric_limits<Float>::lowest());
+	}
+	size_t packed = count - count % Pack::Width;
+	for (size_t i = 0; i < packed; i += Pack::Width)
+		MinMaxStep(data + i * Period, lo, hi, std::make_index_sequence<Period>());
+	for (int c = 0; c < Period; ++c) {
+		mins[c] = std::numeric_limits<Float>::max();
+		maxs[c] = std::numeric_limits<Float>::lowest();
+	}
+	for (int k = 0; k < Period; ++k) {
+		Float l[Pack::Width], h[Pack::Width];
+		lo[k].Store(l);
+		hi[k].Store(h);
+		for (int j = 0; j < Pack::Width; ++j) {
+			int c = (k * Pack::Width + j) % Period;
+			mins[c] = Min(l[j], mins[c]);
+			maxs[c] = Max(h[j], maxs[c]);
+		}
+	}
+	for (size_t i = packed * Period; i < count * Period; ++i) {
+		int c = (int)(i % Period);
+		mins[c] = Min(data[i], mins[c]);
+		maxs[c] = Max(data[i], maxs[c]);
+	}
+}
+
+//Math functions
+//Precision policy: Libm calls the C library lane by lane, Fast evaluates the branch-free polynomials
+//below in all lanes at once. Define HSM_LIBM_MATH to make Libm the default.
+//The bounds are max ULP against the exact result in the stated domain, measured on 2e7 samples per
+//function (uniform and log-uniform, plus the floats next to multiples of Pi / 2 for sine and cosine).
+enum class Precision { Libm, Fast };
+#ifdef HSM_LIBM_MATH
+static constexpr Precision DefaultPrecision = Precision::Libm;
+#else
+static constexpr Precision DefaultPrecision = Precision::Fast;
+#endif
+
+//Round to nearest with the 1.5 * 2^mantissa trick, exact for |x| < 2^22 (float) or 2^51 (double)
+template <typename P>
+inline P RoundNearest(P x) {
+#ifdef USE_DOUBLE
+	const P magic(6755399441055744.0);
+#else
+	const P magic(12582912.0f);
+#endif
+	return (x + magic) - magic;
+}
+
+//Reduction by k * Pi / 2 with Pi / 2 split into four parts (Cody-Waite) and the Cephes minimax
+//polynomials on [-Pi / 4, Pi / 4]. float: 2 ULP for |x| < 1000 and 3 ULP for |x| < 8192,
+//double: 2 ULP for |x| < 1e5. Larger arguments lose the reduction, a pack with one of them goes to libm.
+template <typename P>
+inline void FastSinCos(P x, P& s, P& c) {
+#ifdef USE_DOUBLE
+	const P reductionLimit(1e5);
+#else
+	const P reductionLimit(8192.0f);
+#endif
+	if (MoveMask(Abs(x) >= reductionLimit)) {
+		s = PerLane(x, [](Float v) { return std::sin(v); });
+		c = PerLane(x, [](Float v) { return std::cos(v); });
+		return;
+	}
+	P k = RoundNearest(x * P(0.63661977236758134308));
+#ifdef USE_DOUBLE
+	P r = (((x - k * P(1.5707963109016418)) - k * P(1.5893254712295857e-08)) - k * P(6.123233932053594e-17)) - k * P(6.36831716351095e-25);
+	P r2 = r * r;
+	P sinR = r + r * r2 * (((((P(1.58962301576546568060e-10) * r2 - P(2.50507477628578072866e-8)) * r2 +
+		P(2.75573136213857245213e-6)) * r2 - P(1.98412698295895385996e-4)) * r2 + P(8.33333333332211858878e-3)) * r2 -
+		P(1.66666666666666307295e-1));
+	P cosR = P(1) - P(0.5) * r2 + r2 * r2 * (((((P(-1.13585365213876817300e-11) * r2 + P(2.08757008419747316778e-9)) * r2 -
+		P(2.75573141792967388112e-7)) * r2 + P(2.48015872888517045348e-5)) * r2 - P(1.38888888888730564116e-3)) * r2 +
+		P(4.16666666666665929218e-2));
+#else
+	P r = (((x - k * P(1.5703125f)) - k * P(4.837512969970703125e-4f)) - k * P(7.549533620476723e-8f)) - k * P(2.5633441e-12f);
+	P r2 = r * r;
+	P sinR = r + r * r2 * ((P(-1.9515295891e-4f) * r2 + P(8.3321608736e-3f)) * r2 - P(1.6666654611e-1f));
+	P cosR = P(1) - P(0.5f) * r2 + r2 * r2 * ((P(2.443315711809948e-5f) * r2 - P(1.388731625493765e-3f)) * r2 +
+		P(4.166664568298827e-2f));
+#endif
+	//k mod 4: odd quadrants swap sine and cosine, 2 and 3 negate the sine, 1 and 2 the cosine
+	P q = k - P(4) * RoundNearest(k * P(0.25) - P(0.375));
+	auto odd = q - P(2) * RoundNearest(q * P(0.5) - P(0.25)) > P(0.5);
+	P sinQ = Select(odd, cosR, sinR), cosQ = Select(odd, sinR, cosR);
+	s = Select(q > P(1.5), P(0) - sinQ, sinQ);
+	c = Select(Abs(q - P(1.5)) < P(1), P(0) - cosQ, cosQ);
+}
+
+//acos through asin(s) = s + s * R(s^2) on [0, 0.5], |x| > 0.5 uses acos(|x|) = 2 asin(sqrt((1 - |x|) / 2)).
+//R is the Cephes asinf polynomial (float) or the fdlibm rational (double). float: 2 ULP, double: 2 ULP.
+template <typename P>
+inline P FastACos(P x) {
+	P a = Abs(x);
+	auto large = a > P(0.5);
+	P z = Select(large, P(0.5) * (P(1) - a), a * a);
+	P s = Select(large, Sqrt(z), a);
+#ifdef USE_DOUBLE
+	P R = z * (P(1.66666666666666657415e-01) + z * (P(-3.25565818622400915405e-01) + z * (P(2.01212532134862925881e-01) +
+		z * (P(-4.00555345006794114027e-02) + z * (P(7.91534994289814532176e-04) + z * P(3.47933107596021167570e-05)))))) /
+		(P(1) + z * (P(-2.40339491173441421878e+00) + z * (P(2.02094576023350569471e+00) + z * (P(-6.88283971605453293030e-01) +
+		z * P(7.70381505559019352791e-02)))));
+#else
+	P R = z * ((((P(4.2163199048e-2f) * z + P(2.4181311049e-2f)) * z + P(4.5470025998e-2f)) * z + P(7.4953002686e-2f)) * z +
+		P(1.6666752422e-1f));
+#endif
+	P asinS = s + s * R;
+	auto negative = x < P(0);
+	P largeResult = Select(negative, P(Pi) - P(2) * asinS, P(2) * asinS);
+	P smallResult = P(PiOver2) - Select(negative, P(0) - asinS, asinS);
+	return Select(large, largeResult, smallResult);
+}
+
+//atan of min(|x|, |y|) / max(|x|, |y|), reduced below tan(Pi / 8) with atan(t) = Pi / 4 + atan((t - 1) / (t + 1)),
+//then mapped to the octant of (x, y). Cephes atanf polynomial (float) or fdlibm's (double).
+//float: 3.5 ULP, double: 3 ULP, atan2(+-inf, +-inf) is NaN. Zeros follow atan2: atan2(+-0, -0) is +-Pi.
+template <typename P>
+inline P FastATan2(P y, P x) {
+	P ax = Abs(x), ay = Abs(y);
+	P maxXY = Max(ax, ay), minXY = Min(ax, ay);
+	P t = Select(maxXY > P(0), minXY / maxXY, P(0));
+	auto reduce = t > P(0.41421356237309504880);
+	t = Select(reduce, (t - P(1)) / (t + P(1)), t);
+	P z = t * t;
+#ifdef USE_DOUBLE
+	P w = z * z;
+	P s1 = z * (P(3.33333333333329318027e-01) + w * (P(1.42857142725034663711e-01) + w * (P(9.09088713343650656196e-02) +
+		w * (P(6.66107313738753120669e-02) + w * (P(4.97687799461593236017e-02) + w * P(1.62858201153657823623e-02))))));
+	P s2 = w * (P(-1.99999999998764832476e-01) + w * (P(-1.11111104054623557880e-01) + w * (P(-7.69187620504482999495e-02) +
+		w * (P(-5.83357013379057348645e-02) + w * P(-3.65315727442169155270e-02)))));
+	P r = t - t * (s1 + s2);
+#else
+	P r = t + t * z * (((P(8.05374449538e-2f) * z - P(1.38776856032e-1f)) * z + P(1.99777106478e-1f)) * z - P(3.33329491539e-1f));
+#endif
+	r = Select(reduce, r + P(PiOver4), r);
+	r = Select(ay > ax, P(PiOver2) - r, r);
+	//signs are read from the sign bits, so -0 selects the same octant as a negative value
+	r = Select(SignBit(x), P(Pi) - r, r);
+	r = Select(SignBit(y), r * P(-1), r);
+	//NaN inputs fail the comparison and propagate
+	return Select(ax + ay >= P(0), r, x + y);
+}
+
+//exp(x) = 2^n exp(r) with r = x - n ln2 in [-ln2 / 2, ln2 / 2], 2^n applied in two steps so n = 128 (1024)
+//doesn't overflow the exponent field. Cephes expf polynomial (float) or fdlibm's Remez form (double).
+//float: 2 ULP, double: 2 ULP, results below the normal range flush to 0.
+template <typename P>
+inline P FastExp(P x) {
+	P n = RoundNearest(x * P(1.44269504088896340736));
+#ifdef USE_DOUBLE
+	const Float overflow = 709.782712893383973096, underflow = -708.39641853226410622;
+	P hi = x - n * P(6.93147180369123816490e-01), lo = n * P(1.90821492927058770002e-10);
+	P r = hi - lo, t = r * r;
+	P c = r - t * (P(1.66666666666666019037e-01) + t * (P(-2.77777777770155933842e-03) + t * (P(6.61375632143793436117e-05) +
+		t * (P(-1.65339022054652515390e-06) + t * P(4.13813679705723846039e-08)))));
+	P e = P(1) - ((lo - (r * c) / (P(2) - c)) - hi);
+#else
+	const Float overflow = 88.7228391f, underflow = -87.3365479f;
+	P r = (x - n * P(0.693359375f)) + n * P(2.12194440e-4f);
+	P e = (((((P(1.9875691500e-4f) * r + P(1.3981999507e-3f)) * r + P(8.3334519073e-3f)) * r + P(4.1665795894e-2f)) * r +
+		P(1.6666665459e-1f)) * r + P(5.0000001201e-1f)) * (r * r) + r + P(1);
+#endif
+	auto positive = n > P(0);
+	P result = e * Pow2(n - Select(positive, P(1), P(-1))) * Select(positive, P(2), P(0.5));
+	result = Select(x > P(overflow), P(Infinity), result);
+	return Select(x < P(underflow), P(0), result);
+}
+
+//log(x) = e ln2 + log(m) with m in [sqrt(2) / 2, sqrt(2)), ln2 split in two parts.
+//Cephes logf polynomial in m - 1 (float) or fdlibm's in s = (m - 1) / (m + 1) (double).
+//float: 2 ULP, double: 2 ULP, log(0) is -inf and negative inputs give NaN.
+template <typename P>
+inline P FastLog(P x) {
+	//Subnormals are scaled into the normal range first
+#ifdef USE_DOUBLE
+	auto subnormal = x < P(2.2250738585072014e-308);
+	P xn = Select(subnormal, x * P(18014398509481984.0), x);
+	P e = Exponent(xn);
+	//m in [1, 2), the scale is split so 2^(1 - e) stays a normal number
+	P m = xn * Pow2(P(1) - e) * P(0.5);
+	e = e - Select(subnormal, P(54), P(0));
+#else
+	auto subnormal = x < P(1.17549435e-38f);
+	P xn = Select(subnormal, x * P(16777216.0f), x);
+	P e = Exponent(xn);
+	//m in [1, 2), the scale is split so 2^(1 - e) stays a normal number
+	P m = xn * Pow2(P(1) - e) * P(0.5f);
+	e = e - Select(subnormal, P(24), P(0));
+#endif
+	auto high = m > P(1.41421356237309504880);
+	m = Select(high, m * P(0.5), m);
+	e = Select(high, e + P(1), e);
+	P f = m - P(1);
+#ifdef USE_DOUBLE
+	P s = f / (P(2) + f), z = s * s, w = z * z;
+	P t1 = w * (P(3.999999999940941908e-01) + w * (P(2.222219843214978396e-01) + w * P(1.531383769920937332e-01)));
+	P t2 = z * (P(6.666666666666735130e-01) + w * (P(2.857142874366239149e-01) + w * (P(1.818357216161805012e-01) +
+		w * P(1.479819860511658591e-01))));
+	P hfsq = P(0.5) * f * f;
+	P result = e * P(6.93147180369123816490e-01) - ((hfsq - (s * (hfsq + t1 + t2) + e * P(1.90821492927058770002e-10))) - f);
+#else
+	P z = f * f;
+	P y = f * z * ((((((((P(7.0376836292e-2f) * f - P(1.1514610310e-1f)) * f + P(1.1676998740e-1f)) * f - P(1.2420140846e-1f)) * f +
+		P(1.4249322787e-1f)) * f - P(1.6668057665e-1f)) * f + P(2.0000714765e-1f)) * f - P(2.4999993993e-1f)) * f + P(3.3333331174e-1f));
+	y = y - e * P(2.12194440e-4f) - P(0.5f) * z;
+	P result = (f + y) + e * P(0.693359375f);
+#endif
+	result = Select(x >= P(Infinity), P(Infinity), result);
+	return Select(x <= P(0), Select(x < P(0), P(std::numeric_limits<Float>::quiet_NaN()), P(-Infinity)), result);
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline void SinCos(P x, P& s, P& c) {
+	if (Prec == Precision::Fast) FastSinCos(x, s, c);
+	else {
+		s = PerLane(x, [](Float v) { return std::sin(v); });
+		c = PerLane(x, [](Float v) { return std::cos(v); });
+	}
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P Sin(P x) {
+	if (Prec == Precision::Libm) return PerLane(x, [](Float v) { return std::sin(v); });
+	P s, c;
+	FastSinCos(x, s, c);
+	return s;
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P Cos(P x) {
+	if (Prec == Precision::Libm) return PerLane(x, [](Float v) { return std::cos(v); });
+	P s, c;
+	FastSinCos(x, s, c);
+	return c;
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P ACos(P x) {
+	return Prec == Precision::Fast ? FastACos(x) : PerLane(x, [](Float v) { return std::acos(v); });
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P ATan2(P y, P x) {
+	return Prec == Precision::Fast ? FastATan2(y, x) : PerLane(y, x, [](Float a, Float b) { return std::atan2(a, b); });
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P Exp(P x) {
+	return Prec == Precision::Fast ? FastExp(x) : PerLane(x, [](Float v) { return std::exp(v); });
+}
+
+template <Precision Prec = DefaultPrecision, typename P>
+inline P Log(P x) {
+	return Prec == Precision::Fast ? FastLog(x) : PerLane(x, [](Float v) { return std::log(v); });
+}
+
+//1 / sqrt(x), Fast uses the hardware estimate and one Newton step where there is one (float: 4 ULP)
+template <Precision Prec = DefaultPrecision, typename P>
+inline P RSqrt(P x) {
+	return Prec == Precision::Fast ? RSqrtFast(x) : P(1) / Sqrt(x);
+}
+
+}
+
+//PCG32 random number generator (pcg-random.org), 16 bytes of state.
+//Every sequence index selects an independent stream, Advance skips ahead in O(log n).
+class RNG {
+public:
+	//public methods
+	RNG() : state(DefaultState), inc(DefaultStream) {}
+	explicit RNG(uint64_t seed, uint64_t sequenceIndex = 0) { SetSequence(seed, sequenceIndex); }
+
+	void SetSequence(uint64_t seed, uint64_t sequenceIndex = 0) {
+		state = 0u;
+		inc = (sequenceIndex << 1u) | 1u;
+		Uniform32();
+		state += seed;
+		Uniform32();
+	}
+
+	uint32_t Uniform32() {
+		uint64_t oldState = state;
+		state = oldState * Multiplier + inc;
+		uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rot = (uint32_t)(oldState >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+	}
+
+	//uniform in [0, 1)
+	template <typename T>
+	T Uniform();
+
+	void Advance(int64_t delta) {
+		uint64_t curMult = Multiplier, curPlus = inc, accMult = 1u, accPlus = 0u;
+		uint64_t steps = (uint64_t)delta;
+		while (steps > 0) {
+			if (steps & 1) {
+				accMult *= curMult;
+				accPlus = accPlus * curMult + curPlus;
+			}
+			curPlus = (curMult + 1) * curPlus;
+			curMult *= curMult;
+			steps /= 2;
+		}
+		state = accMult * state + accPlus;
+	}
+
+private:
+	static const uint64_t DefaultState = 0x853c49e6748fea9bULL;
+	static const uint64_t DefaultStream = 0xda3e39cb94b95bdbULL;
+	static const uint64_t Multiplier = 0x5851f42d4c957f2dULL;
+
+	uint64_t state, inc;
+};
+
+template <>
+inline float RNG::Uniform<float>() {
+	return std::min(0.99999994f, Uniform32() * 2.3283064365386963e-10f);
+}
+
+template <>
+inline double RNG::Uniform<double>() {
+	//separate statements, the order of two calls within one expression is unspecified
+	uint64_t hi = Uniform32();
+	uint64_t lo = Uniform32();
+	return (((hi << 32) | lo) >> 11) * 1.1102230246251565e-16;
+}
+
+//Per-thread generator used when no RNG is passed, thread n starts on sequence n.
+inline RNG& ThreadRNG() {
+	static std::atomic<uint64_t> threadCount(0);
+	thread_local RNG rng(0, threadCount++);
+	return rng;
+}
+
+template<typename T>
+inline T Random(RNG& rng) {
+	return rng.Uniform<T>();
+}
 
 template<typename T>
 inline T Random() {
-	static std::uniform_real_distribution<T> distribution(0.0, 1.0);
-	static std::mt19937 generator;
-	return distribution(generator);
+	return Random<T>(ThreadRNG());
 }
 
 inline int RandomInt() {
 	return static_cast<int>(Random<Float>());
 }
 
+template<typename T>
+inline T Random(RNG& rng, T min, T max) {
+	return min + (max - min) * Random<T>(rng);
+}
+
 template<typename T>
 inline T Random(T min, T max) {
-	return min + (max - min) * Random<T>();
+	return Random<T>(ThreadRNG(), min, max);
+}
+
+inline int RandomInt(RNG& rng, int min, int max) {
+	return static_cast<int>(Random<Float>(rng, min, max));
 }
 
 inline int RandomInt(int min, int max) {
-	return static_cast<int>(Random<Float>(min, max));
+	return RandomInt(ThreadRNG(), min, max);
 }
 
 template <typename T, typename S, typename R>
@@ -63,1110 +777,3900 @@ inline T Clamp(T val, S low, R high) {
 		return val;
 }
 
-template<typename T>
-inline bool isNaN(const T t) { return std::isnan(t); }
-template<>
-inline bool isNaN(const int t) { return false; }
-template<typename T>
-inline bool isNearZero(const T t) { return fabs(t) < 1e-8; }
-template<>
-inline bool isNearZero(const int t) { return false; }
+constexpr Float Lerp(Float t, Float v1, Float v2) { return (1 - t) * v1 + t * v2; }
 
-inline Float Radians(Float degree) { return (Pi / 180.0f) * degree; }
+//Bound on the relative error of n successive roundings, (1 + MachineEpsilon)^n - 1 <= Gamma(n)
+constexpr Float Gamma(int n) { return (n * MachineEpsilon) / (1 - n * MachineEpsilon); }
 
-inline Float Degrees(Float radian) { return (180.0f / Pi) * radian; }
+typedef std::conditional<sizeof(Float) == 4, uint32_t, uint64_t>::type FloatBits;
 
-template<typename T> class Vector2;
-template<typename T> class Bounds2;
-//two-dimensional point
-template<typename T>
-class Point2 {
+//The adjacent Float towards +infinity, +infinity and NaN are returned unchanged
+inline Float NextFloatUp(Float v) {
+	if (!(v < Infinity)) return v;
+	//-0 steps like +0
+	if (v == 0) v = 0;
+	FloatBits bits;
+	std::memcpy(&bits, &v, sizeof(Float));
+	if (v >= 0) ++bits;
+	else --bits;
+	std::memcpy(&v, &bits, sizeof(Float));
+	return v;
+}
+
+//The adjacent Float towards -infinity, -infinity and NaN are returned unchanged
+inline Float NextFloatDown(Float v) {
+	if (!(v > -Infinity)) return v;
+	if (v == 0) v = -0.0f;
+	FloatBits bits;
+	std::memcpy(&bits, &v, sizeof(Float));
+	if (v > 0) --bits;
+	else ++bits;
+	std::memcpy(&v, &bits, sizeof(Float));
+	return v;
+}
+
+//Interval [low, high] around a value computed in Float that contains the exact value. Every operation
+//rounds its bounds outwards by one Float, so the exact result of the same operations on exact operands
+//stays inside. An exact value is the interval [v, v], the Float value of an interval is its midpoint.
+class Interval {
 public:
 	//public methods
-	Point2() :x(0), y(0) {}
-	Point2(T xx, T yy) :x(xx), y(yy) {}
-
-	template<typename S>
-	explicit Point2(const Point2<S>& p) {
-		x = (T)p.x;
-		y = (T)p.y;
+	constexpr Interval() : low(0), high(0) {}
+	constexpr explicit Interval(Float v) : low(v), high(v) {}
+	constexpr Interval(Float low, Float high) : low(std::min(low, high)), high(std::max(low, high)) {}
+
+	//v +- error, with the error from an analysis like the Gamma bounds
+	static Interval FromValueAndError(Float v, Float error) {
+		if (error == 0) return Interval(v);
+		return Interval(NextFloatDown(v - error), NextFloatUp(v + error));
 	}
 
-	template<typename S>
-	explicit Point2(const Vector2<S>& v) {
-		x = (T)v.x;
-		y = (T)v.y;
+	constexpr Float LowerBound() const { return low; }
+	constexpr Float UpperBound() const { return high; }
+	constexpr Float Midpoint() const { return (low + high) / 2; }
+	constexpr Float Width() const { return high - low; }
+	constexpr bool IsExact() const { return low == high; }
+	constexpr bool InRange(Float v) const { return v >= low && v <= high; }
+	explicit constexpr operator Float() const { return Midpoint(); }
+
+	//Largest distance from the midpoint to a bound, rounded up
+	Float Error() const {
+		if (low == high) return 0;
+		Float m = Midpoint();
+		return NextFloatUp(std::max(m - low, high - m));
 	}
 
-	bool HasNaN() const {
-		return isNaN(x) || isNaN(y);
-	}
+	constexpr Interval operator -() const { return Interval(-high, -low); }
 
-	Point2<T>& operator = (const Point2<T>& p) {
-		x = p.x;
-		y = p.y;
-		return *this;
+	Interval operator + (const Interval& i) const {
+		return Interval(NextFloatDown(low + i.low), NextFloatUp(high + i.high));
 	}
 
-	bool operator == (const Point2<T>& p) const {
-		return x == p.x && y == p.y;
+	Interval operator - (const Interval& i) const {
+		return Interval(NextFloatDown(low - i.high), NextFloatUp(high - i.low));
 	}
 
-	bool operator != (const Point2<T>& p) const {
-		return x != p.x || y != p.y;
+	Interval operator * (const Interval& i) const {
+		Float p0 = low * i.low, p1 = high * i.low, p2 = low * i.high, p3 = high * i.high;
+		return Interval(NextFloatDown(std::min(std::min(p0, p1), std::min(p2, p3))),
+			            NextFloatUp(std::max(std::max(p0, p1), std::max(p2, p3))));
 	}
 
-	Point2<T> operator -() const {
-		return Point2<T>(-x, -y);
+	//A divisor that contains 0 gives the whole line
+	Interval operator / (const Interval& i) const {
+		if (i.InRange(0)) return Interval(-Infinity, Infinity);
+		Float q0 = low / i.low, q1 = high / i.low, q2 = low / i.high, q3 = high / i.high;
+		return Interval(NextFloatDown(std::min(std::min(q0, q1), std::min(q2, q3))),
+			            NextFloatUp(std::max(std::max(q0, q1), std::max(q2, q3))));
 	}
 
-	T operator [](int i) const {
-		assert(i == 0 || i == 1);
-		if (i == 0) return x;
-		return y;
-	}
+	Interval operator + (Float f) const { return Interval(NextFloatDown(low + f), NextFloatUp(high + f)); }
+	Interval operator - (Float f) const { return Interval(NextFloatDown(low - f), NextFloatUp(high - f)); }
 
-	T& operator [](int i) {
-		assert(i == 0 || i == 1);
-		if (i == 0) return x;
-		return y;
+	Interval operator * (Float f) const {
+		if (f >= 0) return Interval(NextFloatDown(low * f), NextFloatUp(high * f));
+		return Interval(NextFloatDown(high * f), NextFloatUp(low * f));
 	}
 
-	Point2<T> operator + (const Vector2<T>& v) const {
-		return Point2<T>(x + v.x, y + v.y);
-	}
+	Interval operator / (Float f) const { return *this / Interval(f); }
 
-	Point2<T> operator + (const Point2<T>& p) const {
-		return Point2<T>(x + p.x, y + p.y);
-	}
+	Interval& operator += (const Interval& i) { return *this = *this + i; }
+	Interval& operator -= (const Interval& i) { return *this = *this - i; }
+	Interval& operator *= (const Interval& i) { return *this = *this * i; }
+	Interval& operator /= (const Interval& i) { return *this = *this / i; }
+	Interval& operator *= (Float f) { return *this = *this * f; }
+	Interval& operator /= (Float f) { return *this = *this / f; }
 
-	Point2<T>& operator += (const Vector2<T>& v) {
-		x += v.x;
-		y += v.y;
-		return *this;
-	}
+	//public data
+	Float low, high;
+};
 
-	Point2<T> operator - (const Vector2<T>& v) const {
-		return Point2<T>(x - v.x, y - v.y);
-	}
+inline Interval operator + (Float f, const Interval& i) { return i + f; }
+inline Interval operator - (Float f, const Interval& i) { return -i + f; }
+inline Interval operator * (Float f, const Interval& i) { return i * f; }
+inline Interval operator / (Float f, const Interval& i) { return Interval(f) / i; }
 
-	Point2<T>& operator -= (const Vector2<T>& v) {
-		x -= v.x;
-		y -= v.y;
-		return *this;
-	}
+inline std::ostream& operator << (std::ostream& o, const Interval& i) {
+	o << "[ " << i.low << " , " << i.high << " ]";
+	return o;
+}
 
-	Vector2<T> operator - (const Point2<T>& p) const {
-		return Vector2<T>(x - p.x, y - p.y);
-	}
+template<typename T>
+inline bool isNaN(const T t) { return std::isnan(t); }
+template<>
+inline bool isNaN(const int t) { return false; }
+template<typename T>
+inline bool isNearZero(const T t) { return fabs(t) < 1e-8; }
+template<>
+inline bool isNearZero(const int t) { return false; }
 
-	template<typename S>
-	Point2<T> operator *(S n) const {
-		return Point2<T>(n * x, n * y);
-	}
+constexpr Float Radians(Float degree) { return (Pi / 180.0f) * degree; }
 
-	template<typename S>
-	Point2<T>& operator *= (S n) {
-		x *= n;
-		y *= n;
-		return *this;
-	}
+constexpr Float Degrees(Float radian) { return (180.0f / Pi) * radian; }
 
-	template<typename S>
-	Point2<T> operator / (S n) const {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		return Point2<T>(x * inverse, y * inverse);
-	}
+//Trigonometry usable in constant expressions, evaluated in double: the argument is reduced to
+//[-Pi/4, Pi/4] with a two-part Pi/2 and the Taylor series is cut where the error is below 1e-17.
+constexpr double ReduceQuadrant(double x, int& quadrant) {
+	double k = x * 0.63661977236758134308;
+	k = k < 0 ? (double)(int64_t)(k - 0.5) : (double)(int64_t)(k + 0.5);
+	quadrant = (int)((int64_t)k & 3);
+	return (x - k * 1.57079632673412561417) - k * 6.07710050650619224932e-11;
+}
 
-	template<typename S>
-	Point2<T>& operator /= (S n) {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		x *= inverse;
-		y *= inverse;
-		return *this;
+constexpr double SinSeries(double r) {
+	double r2 = r * r, term = r, sum = r;
+	for (int n = 2; n <= 20; n += 2) {
+		term *= -r2 / (n * (n + 1));
+		sum += term;
 	}
+	return sum;
+}
 
-	inline Float DistanceSquared(const Point2<T>& p) const {
-		return std::pow(x - p.x, 2) + std::pow(y - p.y, 2);
+constexpr double CosSeries(double r) {
+	double r2 = r * r, term = 1, sum = 1;
+	for (int n = 1; n <= 19; n += 2) {
+		term *= -r2 / (n * (n + 1));
+		sum += term;
 	}
-	inline Float Distance(const Point2<T>& p) const { return std::sqrt(DistanceSquared(p)); }
+	return sum;
+}
 
-	inline Point2<T> Floor() const { return Point2<T>(std::floor(x), std::floor(y)); }
-	inline Point2<T> Ceil() const { return Point2<T>(std::ceil(x), std::ceil(y)); }
-	inline Point2<T> Abs() const { return Point2<T>(std::abs(x), std::abs(y)); }
+constexpr Float ConstexprSin(Float x) {
+	int quadrant = 0;
+	double r = ReduceQuadrant(x, quadrant);
+	double s = (quadrant & 1) ? CosSeries(r) : SinSeries(r);
+	return (Float)(quadrant & 2 ? -s : s);
+}
 
-	inline Point2<T> Lerp(const Point2<T>& p, Float t) const { return (1 - t)*(*this) + t * p; }
+constexpr Float ConstexprCos(Float x) {
+	int quadrant = 0;
+	double r = ReduceQuadrant(x, quadrant);
+	double c = (quadrant & 1) ? SinSeries(r) : CosSeries(r);
+	return (Float)((quadrant + 1) & 2 ? -c : c);
+}
 
-	//public data
-	T x, y;
-};
+constexpr Float ConstexprTan(Float x) {
+	int quadrant = 0;
+	double r = ReduceQuadrant(x, quadrant);
+	double s = SinSeries(r), c = CosSeries(r);
+	return (Float)((quadrant & 1) ? -c / s : s / c);
+}
 
-template<typename T>
-std::ostream & operator << (std::ostream &o, const Point2<T>& p) {
-	o << '[' << p.x << ',' << p.y << ']';
-	return o;
+//simd math functions with the default precision at run time, the series during constant evaluation
+constexpr Float Sin(Float x) {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+	if (!HSM_IS_CONSTANT_EVALUATED()) return simd::Sin(x);
+#endif
+	return ConstexprSin(x);
 }
 
-template<typename T, typename U>
-inline Point2<T> operator * (U n, const Point2<T>& v) {
-	return v * n;
+constexpr Float Cos(Float x) {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+	if (!HSM_IS_CONSTANT_EVALUATED()) return simd::Cos(x);
+#endif
+	return ConstexprCos(x);
 }
 
-template <typename T>
-Point2<T> Lerp(Float t, const Point2<T> &p0, const Point2<T> &p1) {
-	return (1 - t) * p0 + t * p1;
+//Both from one argument reduction
+constexpr void SinCos(Float x, Float& s, Float& c) {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+	if (!HSM_IS_CONSTANT_EVALUATED()) {
+		simd::SinCos(x, s, c);
+		return;
+	}
+#endif
+	s = ConstexprSin(x);
+	c = ConstexprCos(x);
 }
 
-template <typename T>
-bool Inside(const Point2<T> &p, const Bounds2<T> &b) {
-	return (p.x >= b.pMin.x && p.x <= b.pMax.x && p.y >= b.pMin.y && p.y <= b.pMax.y);
+constexpr Float Tan(Float x) {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+	if (!HSM_IS_CONSTANT_EVALUATED()) {
+		if (simd::DefaultPrecision == simd::Precision::Libm) return std::tan(x);
+		Float s = 0, c = 0;
+		simd::SinCos(x, s, c);
+		return s / c;
+	}
+#endif
+	return ConstexprTan(x);
 }
 
-template<typename T> class Vector3;
+template<typename T> class Bounds2;
 template<typename T> class Bounds3;
-//three-dimensional point
-template<typename T>
-class Point3 {
-public:
-	//public methods
-	Point3() :x(0), y(0), z(0) {}
-	Point3(T xx, T yy, T zz) :x(xx), y(yy), z(zz) {}
 
+//Storage of the N components, 2, 3 and 4 components are named x, y, z, w.
+template<int N, typename T>
+struct VectorComponents {
+	constexpr VectorComponents() :e{} {}
 	template<typename S>
-	explicit Point3(const Point3<S>& p) {
-		x = (T)p.x;
-		y = (T)p.y;
-		z = (T)p.z;
-	}
-
-	template<typename S>
-	explicit Point3(const Vector3<S>& v) {
-		x = (T)v.x;
-		y = (T)v.y;
-		z = (T)v.z;
-	}
-
-	bool HasNaN() const {
-		return isNaN(x) || isNaN(y) || isNaN(z);
+	constexpr explicit VectorComponents(const VectorComponents<N, S>& c) :e{} {
+		for (int i = 0; i < N; ++i) e[i] = (T)c[i];
 	}
 
-	Point3<T>& operator = (const Point3<T>& p) {
-		x = p.x;
-		y = p.y;
-		z = p.z;
-		return *this;
+	constexpr T operator [](int i) const {
+		assert(i >= 0 && i < N);
+		return e[i];
 	}
 
-	bool operator == (const Point3<T>& p) const {
-		return x == p.x && y == p.y && z == p.z;
+	constexpr T& operator [](int i) {
+		assert(i >= 0 && i < N);
+		return e[i];
 	}
 
-	bool operator != (const Point3<T>& p) const {
-		return x != p.x || y != p.y || z != p.z;
-	}
+	T e[N];
+};
 
-	Point3<T> operator -() const {
-		return Point3<T>(-x, -y, -z);
-	}
+template<typename T>
+struct VectorComponents<2, T> {
+	constexpr VectorComponents() :x(0), y(0) {}
+	constexpr VectorComponents(T xx, T yy) :x(xx), y(yy) {}
+	template<typename S>
+	constexpr explicit VectorComponents(const VectorComponents<2, S>& c) :x((T)c.x), y((T)c.y) {}
 
-	T operator [](int i) const {
-		assert(i >= 0 && i <= 3);
+	constexpr T operator [](int i) const {
+		assert(i == 0 || i == 1);
 		if (i == 0) return x;
-		else if (i == 1) return y;
-		return z;
+		return y;
 	}
 
-	T& operator [](int i) {
-		assert(i >= 0 && i <= 2);
+	constexpr T& operator [](int i) {
+		assert(i == 0 || i == 1);
 		if (i == 0) return x;
-		else if (i == 1) return y;
-		return z;
+		return y;
 	}
 
-	Point3<T> operator + (const Vector3<T>& v) const {
-		return Point3<T>(x + v.x, y + v.y, z + v.z);
+	T x, y;
+};
+
+template<typename T>
+struct VectorComponents<3, T> {
+	constexpr VectorComponents() :x(0), y(0), z(0) {}
+	constexpr VectorComponents(T xx, T yy, T zz) :x(xx), y(yy), z(zz) {}
+	template<typename S>
+	constexpr explicit VectorComponents(const VectorComponents<3, S>& c) :x((T)c.x), y((T)c.y), z((T)c.z) {}
+
+	constexpr T operator [](int i) const {
+		assert(i >= 0 && i <= 2);
+		if (i == 0) return x;
+		if (i == 1) return y;
+		return z;
 	}
 
-	Point3<T> operator + (const Point3<T>& p) const {
-		return Point3<T>(x + p.x, y + p.y, z + p.z);
+	constexpr T& operator [](int i) {
+		assert(i >= 0 && i <= 2);
+		if (i == 0) return x;
+		if (i == 1) return y;
+		return z;
 	}
 
-	Point3<T>& operator += (const Vector3<T>& v) {
-		x += v.x;
-		y += v.y;
-		z += v.z;
-		return *this;
+	T x, y, z;
+};
+
+template<typename T>
+struct VectorComponents<4, T> {
+	constexpr VectorComponents() :x(0), y(0), z(0), w(0) {}
+	constexpr VectorComponents(T xx, T yy, T zz, T ww) :x(xx), y(yy), z(zz), w(ww) {}
+	template<typename S>
+	constexpr explicit VectorComponents(const VectorComponents<4, S>& c) :x((T)c.x), y((T)c.y), z((T)c.z), w((T)c.w) {}
+
+	constexpr T operator [](int i) const {
+		assert(i >= 0 && i <= 3);
+		if (i == 0) return x;
+		if (i == 1) return y;
+		if (i == 2) return z;
+		return w;
+	}
+
+	constexpr T& operator [](int i) {
+		assert(i >= 0 && i <= 3);
+		if (i == 0) return x;
+		if (i == 1) return y;
+		if (i == 2) return z;
+		return w;
+	}
+
+	T x, y, z, w;
+};
+
+//Points and vectors share one implementation, the kind only decides which sums and differences
+//exist: point + vector and point + point (weighted sums) are points, point - point is a vector.
+struct VectorKind {};
+struct PointKind {};
+
+template<typename A, typename B> struct SumKind {};
+template<> struct SumKind<VectorKind, VectorKind> { typedef VectorKind type; };
+template<> struct SumKind<PointKind, VectorKind> { typedef PointKind type; };
+template<> struct SumKind<PointKind, PointKind> { typedef PointKind type; };
+
+template<typename A, typename B> struct DifferenceKind {};
+template<> struct DifferenceKind<VectorKind, VectorKind> { typedef VectorKind type; };
+template<> struct DifferenceKind<PointKind, VectorKind> { typedef PointKind type; };
+template<> struct DifferenceKind<PointKind, PointKind> { typedef VectorKind type; };
+
+//N-dimensional point or vector. Every operator is a single loop over the components that writes
+//the result directly, after inlining a chained expression is one fused pass without temporaries.
+template<int N, typename T, typename Kind = VectorKind>
+class Vector : public VectorComponents<N, T> {
+public:
+	//public methods
+	using VectorComponents<N, T>::VectorComponents;
+	using VectorComponents<N, T>::operator[];
+	constexpr Vector() = default;
+
+	template<typename S, typename K>
+	constexpr explicit Vector(const Vector<N, S, K>& v) :VectorComponents<N, T>(static_cast<const VectorComponents<N, S>&>(v)) {}
+
+	bool HasNaN() const {
+		for (int i = 0; i < N; ++i)
+			if (isNaN((*this)[i])) return true;
+		return false;
+	}
+
+	constexpr bool operator == (const Vector<N, T, Kind>& v) const {
+		for (int i = 0; i < N; ++i)
+			if ((*this)[i] != v[i]) return false;
+		return true;
+	}
+
+	constexpr bool operator != (const Vector<N, T, Kind>& v) const {
+		return !(*this == v);
 	}
 
-	Point3<T> operator - (const Vector3<T>& v) const {
-		return Point3<T>(x - v.x, y - v.y, z - v.z);
+	constexpr Vector<N, T, Kind> operator -() const {
+		Vector<N, T, Kind> r;
+		for (int i = 0; i < N; ++i) r[i] = -(*this)[i];
+		return r;
 	}
 
-	Point3<T>& operator -= (const Vector3<T>& v) {
-		x -= v.x;
-		y -= v.y;
-		z -= v.z;
+	template<typename K>
+	constexpr Vector<N, T, typename SumKind<Kind, K>::type> operator + (const Vector<N, T, K>& v) const {
+		Vector<N, T, typename SumKind<Kind, K>::type> r;
+		for (int i = 0; i < N; ++i) r[i] = (*this)[i] + v[i];
+		return r;
+	}
+
+	template<typename K>
+	constexpr Vector<N, T, Kind>& operator += (const Vector<N, T, K>& v) {
+		static_assert(std::is_same<typename SumKind<Kind, K>::type, Kind>::value, "the sum changes the kind");
+		for (int i = 0; i < N; ++i) (*this)[i] += v[i];
 		return *this;
 	}
 
-	Vector3<T> operator - (const Point3<T>& p) const {
-		return Vector3<T>(x - p.x, y - p.y, z - p.z);
+	template<typename K>
+	constexpr Vector<N, T, typename DifferenceKind<Kind, K>::type> operator - (const Vector<N, T, K>& v) const {
+		Vector<N, T, typename DifferenceKind<Kind, K>::type> r;
+		for (int i = 0; i < N; ++i) r[i] = (*this)[i] - v[i];
+		return r;
+	}
+
+	template<typename K>
+	constexpr Vector<N, T, Kind>& operator -= (const Vector<N, T, K>& v) {
+		static_assert(std::is_same<typename DifferenceKind<Kind, K>::type, Kind>::value, "the difference changes the kind");
+		for (int i = 0; i < N; ++i) (*this)[i] -= v[i];
+		return *this;
 	}
 
 	template<typename S>
-	Point3<T> operator *(S n) const {
-		return Point3<T>(n * x, n * y, n * z);
+	constexpr Vector<N, T, Kind> operator *(S n) const {
+		Vector<N, T, Kind> r;
+		for (int i = 0; i < N; ++i) r[i] = n * (*this)[i];
+		return r;
 	}
 
 	template<typename S>
-	Point3<T>& operator *= (S n) {
-		x *= n;
-		y *= n;
-		z *= n;
+	constexpr Vector<N, T, Kind>& operator *= (S n) {
+		for (int i = 0; i < N; ++i) (*this)[i] *= n;
 		return *this;
 	}
 
 	template<typename S>
-	Point3<T> operator / (S n) const {
+	constexpr Vector<N, T, Kind> operator / (S n) const {
 		assert(n != 0);
 		Float inverse = (Float)1 / n;
-		return Point3<T>(x * inverse, y * inverse, z * inverse);
+		Vector<N, T, Kind> r;
+		for (int i = 0; i < N; ++i) r[i] = (*this)[i] * inverse;
+		return r;
 	}
 
 	template<typename S>
-	Point3<T>& operator /= (S n) {
+	constexpr Vector<N, T, Kind>& operator /= (S n) {
 		assert(n != 0);
 		Float inverse = (Float)1 / n;
-		x *= inverse;
-		y *= inverse;
-		z *= inverse;
+		for (int i = 0; i < N; ++i) (*this)[i] *= inverse;
 		return *this;
 	}
 
-	inline Float DistanceSquared(const Point3<T>& p) const {
-		return std::pow(x - p.x, 2) + std::pow(y - p.y, 2) + std::pow(z - p.z, 2);
+	inline Float DistanceSquared(const Vector<N, T, Kind>& p) const {
+		auto sum = std::pow((*this)[0] - p[0], 2);
+		for (int i = 1; i < N; ++i) sum += std::pow((*this)[i] - p[i], 2);
+		return sum;
+	}
+	inline Float Distance(const Vector<N, T, Kind>& p) const { return std::sqrt(DistanceSquared(p)); }
+
+	constexpr bool IsNearZero() const {
+		for (int i = 0; i < N; ++i)
+			if (!isNearZero<T>((*this)[i])) return false;
+		return true;
 	}
-	inline Float Distance(const Point3<T>& p) const { return std::sqrt(DistanceSquared(p)); }
 
-	inline Point3<T> Floor() const { return Point3<T>(std::floor(x), std::floor(y), std::floor(z)); }
-	inline Point3<T> Ceil() const { return Point3<T>(std::ceil(x), std::ceil(y), std::ceil(z)); }
-	inline Point3<T> Abs() const { return Point3<T>(std::abs(x), std::abs(y), std::abs(z)); }
+	constexpr Float LengthSquared() const {
+		T sum = (*this)[0] * (*this)[0];
+		for (int i = 1; i < N; ++i) sum += (*this)[i] * (*this)[i];
+		return sum;
+	}
+	inline Float Length() const { return std::sqrt(LengthSquared()); }
+	inline Vector<N, T, Kind> Normalize() const { return *this / Length(); }
 
-	inline Point3<T> Lerp(const Point3<T>& p, Float t) const { return (1 - t)*(*this) + t * p; }
+	inline Vector<N, T, Kind> Floor() const { return Apply([](T a) { return (T)std::floor(a); }); }
+	inline Vector<N, T, Kind> Ceil() const { return Apply([](T a) { return (T)std::ceil(a); }); }
+	inline Vector<N, T, Kind> Abs() const { return Apply([](T a) { return (T)std::abs(a); }); }
 
-	//public data
-	T x, y, z;
+	constexpr Vector<N, T, Kind> Lerp(const Vector<N, T, Kind>& p, Float t) const {
+		Vector<N, T, Kind> r;
+		for (int i = 0; i < N; ++i) r[i] = (1 - t) * (*this)[i] + t * p[i];
+		return r;
+	}
+
+	constexpr Vector<N, T, Kind> Reflect(const Vector<N, T, Kind>& normal) const {
+		return *this - 2 * Dot(*this, normal) * normal;
+	}
+
+	Vector<N, T, Kind> Refract(const Vector<N, T, Kind>& normal, Float etaiOverEtat) const {
+		Float cosTheta = fmin(Dot(-*this, normal), 1.0f);
+		//R perpendicular
+		Vector<N, T, Kind> rOutPerp = etaiOverEtat * (*this + cosTheta * normal);
+		//R parallel
+		Vector<N, T, Kind> rOutParallel = -sqrt(fabs(1.0f - rOutPerp.LengthSquared())) * normal;
+		return rOutPerp + rOutParallel;
+	}
+
+private:
+	template<typename F>
+	Vector<N, T, Kind> Apply(F f) const {
+		Vector<N, T, Kind> r;
+		for (int i = 0; i < N; ++i) r[i] = f((*this)[i]);
+		return r;
+	}
 };
 
-template<typename T>
-std::ostream & operator << (std::ostream &o, const Point3<T>& p) {
-	o << '[' << p.x << ',' << p.y << ',' << p.z << ']';
+template<int N, typename T, typename Kind>
+std::ostream & operator << (std::ostream &o, const Vector<N, T, Kind>& v) {
+	o << '[' << v[0];
+	for (int i = 1; i < N; ++i) o << ',' << v[i];
+	o << ']';
 	return o;
 }
 
-template<typename T, typename U>
-inline Point3<T> operator * (U n, const Point3<T>& v) {
+template<int N, typename T, typename Kind, typename U>
+constexpr Vector<N, T, Kind> operator * (U n, const Vector<N, T, Kind>& v) {
 	return v * n;
 }
 
+template<int N, typename T, typename Kind>
+constexpr Vector<N, T, Kind> Lerp(Float t, const Vector<N, T, Kind> &p0, const Vector<N, T, Kind> &p1) {
+	return p0.Lerp(p1, t);
+}
+
+template<int N, typename T>
+constexpr Float Dot(const Vector<N, T>& v1, const Vector<N, T>& v2) {
+	T sum = v1[0] * v2[0];
+	for (int i = 1; i < N; ++i) sum += v1[i] * v2[i];
+	return sum;
+}
+
+template<typename T>
+constexpr Vector<3, T> Cross(const Vector<3, T>& v1, const Vector<3, T>& v2) {
+	return Vector<3, T>((v1.y * v2.z) - (v1.z * v2.y), 
+		(v1.z * v2.x) - (v1.x * v2.z), (v1.x * v2.y) - (v1.y * v2.x));
+}
+
+template<typename T> using Point2 = Vector<2, T, PointKind>;
+template<typename T> using Point3 = Vector<3, T, PointKind>;
+template<typename T> using Vector2 = Vector<2, T, VectorKind>;
+template<typename T> using Vector3 = Vector<3, T, VectorKind>;
+template<typename T> using Vector4 = Vector<4, T, VectorKind>;
+
 template <typename T>
-Point3<T> Lerp(Float t, const Point3<T> &p0, const Point3<T> &p1) {
-	return (1 - t) * p0 + t * p1;
+constexpr bool Inside(const Point2<T> &p, const Bounds2<T> &b) {
+	return (p.x >= b.pMin.x && p.x <= b.pMax.x && p.y >= b.pMin.y && p.y <= b.pMax.y);
 }
 
 template <typename T>
-bool Inside(const Point3<T> &p, const Bounds3<T> &b) {
+constexpr bool Inside(const Point3<T> &p, const Bounds3<T> &b) {
 	return (p.x >= b.pMin.x && p.x <= b.pMax.x && p.y >= b.pMin.y && 
 		    p.y <= b.pMax.y && p.z >= b.pMin.z && p.z <= b.pMax.z);
 }
 
-//two-dimensional vector
-template<typename T>
-class Vector2 {
+typedef Vector3<Float> Vector3f;
+typedef Vector3<int> Vector3i;
+typedef Vector2<Float> Vector2f;
+typedef Vector2<int> Vector2i;
+typedef Vector4<Float> Vector4f;
+typedef Point2<Float> Point2f;
+typedef Point2<int> Point2i;
+typedef Point3<Float> Point3f;
+typedef Point3<int> Point3i;
+
+constexpr Vector3f Convert(const Point3f& p) {
+	return Vector3f(p.x, p.y, p.z);
+}
+
+//Points and vectors with an Interval per component, the hit point routines and the error carrying transforms
+//return them. Point3f(p) is the midpoint and Error() the distance from it to the bounds of every component.
+class Point3fi : public Point3<Interval> {
 public:
 	//public methods
-	Vector2() :x(0), y(0) {}
-	Vector2(T xx, T yy) :x(xx), y(yy) {}
+	using Point3<Interval>::Vector;
+	constexpr Point3fi() = default;
+	constexpr Point3fi(const Point3<Interval>& p) : Point3<Interval>(p) {}
+	Point3fi(const Point3f& p, const Vector3f& error) :
+		Point3<Interval>(Interval::FromValueAndError(p.x, error.x), Interval::FromValueAndError(p.y, error.y),
+			             Interval::FromValueAndError(p.z, error.z)) {}
+
+	Vector3f Error() const { return Vector3f(x.Error(), y.Error(), z.Error()); }
+	constexpr bool IsExact() const { return x.IsExact() && y.IsExact() && z.IsExact(); }
+};
 
-	template<typename S>
-	explicit Vector2(const Point2<T>& p) {
-		x = (T)p.x;
-		y = (T)p.y;
-	}
+class Vector3fi : public Vector3<Interval> {
+public:
+	//public methods
+	using Vector3<Interval>::Vector;
+	constexpr Vector3fi() = default;
+	constexpr Vector3fi(const Vector3<Interval>& v) : Vector3<Interval>(v) {}
+	Vector3fi(const Vector3f& v, const Vector3f& error) :
+		Vector3<Interval>(Interval::FromValueAndError(v.x, error.x), Interval::FromValueAndError(v.y, error.y),
+			              Interval::FromValueAndError(v.z, error.z)) {}
+
+	Vector3f Error() const { return Vector3f(x.Error(), y.Error(), z.Error()); }
+	constexpr bool IsExact() const { return x.IsExact() && y.IsExact() && z.IsExact(); }
+};
 
-	template<typename S>
-	explicit Vector2(const Vector2<T>& v) {
-		x = (T)v.x;
-		y = (T)v.y;
-	}
+//Sampling kernels, closed-form warps of uniform [0, 1) samples without rejection or branches.
+//P is Float or simd::Pack, so the scalar and batched samplers produce the same values.
+namespace simd {
+
+//Shirley-Chiu concentric mapping of the square onto the unit disk
+template <typename P>
+inline void ConcentricDisk(P u0, P u1, P& x, P& y) {
+	P ox = P(2) * u0 - P(1), oy = P(2) * u1 - P(1);
+	auto xMajor = Abs(ox) > Abs(oy);
+	P r = Select(xMajor, ox, oy);
+	P ratio = Select(xMajor, oy, ox) / r;
+	ratio = Select(Abs(r) > P(0), ratio, P(0));
+	P theta = Select(xMajor, P(PiOver4) * ratio, P(PiOver2) - P(PiOver4) * ratio);
+	P sinTheta, cosTheta;
+	SinCos(theta, sinTheta, cosTheta);
+	x = r * cosTheta;
+	y = r * sinTheta;
+}
 
-	bool HasNaN() const { return isNaN(x) || isNaN(y); }
+template <typename P>
+inline void UniformSphere(P u0, P u1, P& x, P& y, P& z) {
+	z = P(1) - P(2) * u0;
+	P r = Sqrt(Max(P(1) - z * z, P(0)));
+	P sinPhi, cosPhi;
+	SinCos(P(2 * Pi) * u1, sinPhi, cosPhi);
+	x = r * cosPhi;
+	y = r * sinPhi;
+}
 
-	Vector2<T>& operator = (const Vector2<T>& v) {
-		x = v.x;
-		y = v.y;
-		return *this;
-	}
+template <typename P>
+inline void UniformHemisphere(P u0, P u1, P& x, P& y, P& z) {
+	z = u0;
+	P r = Sqrt(Max(P(1) - z * z, P(0)));
+	P sinPhi, cosPhi;
+	SinCos(P(2 * Pi) * u1, sinPhi, cosPhi);
+	x = r * cosPhi;
+	y = r * sinPhi;
+}
 
-	bool operator == (const Vector2<T>& v) const {
-		return x == v.x && y == v.y;
-	}
+//Malley's method, project the concentric disk up to the hemisphere, pdf = z / Pi
+template <typename P>
+inline void CosineHemisphere(P u0, P u1, P& x, P& y, P& z) {
+	ConcentricDisk(u0, u1, x, y);
+	z = Sqrt(Max(P(1) - x * x - y * y, P(0)));
+}
 
-	bool operator != (const Vector2<T>& v) const {
-		return x != v.x || y != v.y;
-	}
+}
 
-	Vector2<T> operator -() const {
-		return Vector2<T>(-x, -y);
-	}
+inline Point2f SampleUniformDiskConcentric(const Point2f& u, Float* pdf = nullptr) {
+	Float x, y;
+	simd::ConcentricDisk(u.x, u.y, x, y);
+	if (pdf) *pdf = InvPi;
+	return Point2f(x, y);
+}
 
-	T operator [](int i) const {
-		assert(i >= 0 && i <= 1);
-		if (i == 0) return x;
-		return y;
-	}
+inline Vector3f SampleUniformSphere(const Point2f& u, Float* pdf = nullptr) {
+	Float x, y, z;
+	simd::UniformSphere(u.x, u.y, x, y, z);
+	if (pdf) *pdf = Inv4Pi;
+	return Vector3f(x, y, z);
+}
 
-	T& operator [](int i) {
-		assert(i >= 0 && i <= 1);
-		if (i == 0) return x;
-		return y;
-	}
+inline Vector3f SampleUniformHemisphere(const Point2f& u, Float* pdf = nullptr) {
+	Float x, y, z;
+	simd::UniformHemisphere(u.x, u.y, x, y, z);
+	if (pdf) *pdf = Inv2Pi;
+	return Vector3f(x, y, z);
+}
 
-	Vector2<T> operator + (const Vector2<T>& v) const {
-		return Point3<T>(x + v.x, y + v.y);
-	}
+inline Vector3f SampleCosineHemisphere(const Point2f& u, Float* pdf = nullptr) {
+	Float x, y, z;
+	simd::CosineHemisphere(u.x, u.y, x, y, z);
+	if (pdf) *pdf = z * InvPi;
+	return Vector3f(x, y, z);
+}
 
-	Vector2<T>& operator += (const Vector2<T>& v) {
-		x += v.x;
-		y += v.y;
-		return *this;
-	}
+//Uniform in the unit ball, a sphere direction scaled by the cube root of the third sample
+inline Vector3f SampleUniformBall(const Point3f& u, Float* pdf = nullptr) {
+	if (pdf) *pdf = 3 * Inv4Pi;
+	return SampleUniformSphere(Point2f(u.x, u.y)) * std::cbrt(u.z);
+}
 
-	Vector2<T> operator - (const Vector2<T>& v) const {
-		return Point3<T>(x - v.x, y - v.y);
-	}
+inline Vector3f RandomInUnitSphere(RNG& rng) {
+	return SampleUniformBall(Point3f(Random<Float>(rng), Random<Float>(rng), Random<Float>(rng)));
+}
 
-	Vector2<T>& operator -= (const Vector2<T>& v) {
-		x -= v.x;
-		y -= v.y;
-		return *this;
-	}
+inline Vector3f RandomInUnitSphere() { return RandomInUnitSphere(ThreadRNG()); }
 
-	template<typename S>
-	Vector2<T> operator *(S n) const {
-		return Vector2<T>(n * x, n * y);
-	}
+inline Vector2f RandomInUnitDisk(RNG& rng) {
+	Point2f p = SampleUniformDiskConcentric(Point2f(Random<Float>(rng), Random<Float>(rng)));
+	return Vector2f(p.x, p.y);
+}
 
-	template<typename S>
-	Vector2<T>& operator *= (S n) {
-		x *= n;
-		y *= n;
-		return *this;
-	}
+inline Vector2f RandomInUnitDisk() { return RandomInUnitDisk(ThreadRNG()); }
 
-	template<typename S>
-	Vector2<T> operator / (S n) const {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		return Vector2<T>(x * inverse, y * inverse);
-	}
+inline Vector3f RandomInHemisphere(RNG& rng, const Vector3f& normal) {
+	Vector3f v = RandomInUnitSphere(rng);
+	if (Dot(v, normal) > 0.0f) return v;
+	return -v;
+}
 
-	template<typename S>
-	Vector2<T>& operator /= (S n) {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		x *= inverse;
-		y *= inverse;
-		return *this;
-	}
+inline Vector3f RandomInHemisphere(const Vector3f& normal) { return RandomInHemisphere(ThreadRNG(), normal); }
 
-	inline Float LengthSquared()const { return x * x + y * y; }
-	inline Float Length()const { return std::sqrt(LengthSquared()); }
+inline Vector3f RandomUnitVec(RNG& rng) {
+	return SampleUniformSphere(Point2f(Random<Float>(rng), Random<Float>(rng)));
+}
 
-	inline Vector2<T> Abs() const { return Vector2<T>(std::abs(x), std::abs(y)); }
-	inline Vector2<T> Normalize() const { return *this / Length(); }
+inline Vector3f RandomUnitVec() { return RandomUnitVec(ThreadRNG()); }
 
-	//public data
-	T x, y;
-};
+inline Vector3f RandomVec(RNG& rng, Float min, Float max) {
+	return Vector3f(Random<Float>(rng, min, max), Random<Float>(rng, min, max), Random<Float>(rng, min, max));
+}
 
-template<typename T>
-inline std::ostream& operator << (std::ostream& o, const Vector2<T>& v) {
-	o << '[' << v.x << ',' << v.y << ']';
-	return o;
+inline Vector3f RandomVec(Float min, Float max) { return RandomVec(ThreadRNG(), min, max); }
+
+inline Vector3f RandomVec(RNG& rng) {
+	return Vector3f(Random<Float>(rng), Random<Float>(rng), Random<Float>(rng));
 }
 
-template<typename T, typename U>
-inline Vector2<T> operator * (U n, const Vector2<T>& v) {
-	return v * n;
+inline Vector3f RandomVec() { return RandomVec(ThreadRNG()); }
+
+inline Point3f RandomPoint(RNG& rng, Float min, Float max) {
+	return Point3f(Random<Float>(rng, min, max), Random<Float>(rng, min, max), Random<Float>(rng, min, max));
 }
 
-template<typename T>
-inline Float Dot(const Vector2<T>& v1, const Vector2<T>& v2) {
-	return v1.x * v2.x + v1.y * v2.y;
+inline Point3f RandomPoint(Float min, Float max) { return RandomPoint(ThreadRNG(), min, max); }
+
+inline Point3f RandomPoint(RNG& rng) {
+	return Point3f(Random<Float>(rng), Random<Float>(rng), Random<Float>(rng));
 }
 
-//three-dimensional vector
-template<typename T>
-class Vector3 {
+inline Point3f RandomPoint() { return RandomPoint(ThreadRNG()); }
+
+inline Vector3f RandomCosineDirection(RNG& rng) {
+	return SampleCosineHemisphere(Point2f(Random<Float>(rng), Random<Float>(rng)));
+}
+
+inline Vector3f RandomCosineDirection() { return RandomCosineDirection(ThreadRNG()); }
+
+inline Vector3f Random2Sphere(RNG& rng, double radius, double distanceSquared) {
+	Float r1 = Random<Float>(rng);
+	Float r2 = Random<Float>(rng);
+	Float z = 1 + r2 * (Float)(std::sqrt(1 - radius * radius / distanceSquared) - 1);
+
+	Float sinPhi, cosPhi;
+	simd::SinCos(2 * Pi * r1, sinPhi, cosPhi);
+	Float r = std::sqrt(1 - z * z);
+
+	return Vector3f(cosPhi * r, sinPhi * r, z);
+}
+
+inline Vector3f Random2Sphere(double radius, double distanceSquared) {
+	return Random2Sphere(ThreadRNG(), radius, distanceSquared);
+}
+
+//Low-discrepancy samplers
+inline uint64_t MixBits(uint64_t v) {
+	v ^= (v >> 31);
+	v *= 0x7fb5d329728ea185ULL;
+	v ^= (v >> 27);
+	v *= 0x81dadef4bc2dd44dULL;
+	v ^= (v >> 33);
+	return v;
+}
+
+inline uint32_t ReverseBits32(uint32_t n) {
+	n = (n << 16) | (n >> 16);
+	n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+	n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+	n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+	n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+	return n;
+}
+
+//Owen scrambling of the bits of x, see "Practical Hash-based Owen Scrambling" by Brent Burley
+inline uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+	x = ReverseBits32(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return ReverseBits32(x);
+}
+
+//Element i of a random permutation of [0, l) selected by p, see "Correlated Multi-Jittered Sampling" by Andrew Kensler
+inline uint32_t PermutationElement(uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xe170893d;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3f;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3df;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+//The first two dimensions of the Sobol sequence, dimension 1 uses the direction numbers of x + 1
+inline uint32_t SobolSample(uint32_t index, int dimension) {
+	assert(dimension == 0 || dimension == 1);
+	if (dimension == 0) return ReverseBits32(index);
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+		if (index & 1) result ^= v;
+	return result;
+}
+
+inline Float UInt32ToFloat(uint32_t x) {
+	return std::min(OneMinusEpsilon, Float(x * 2.3283064365386963e-10));
+}
+
+//Samples of one pixel are addressed by (pixel, sampleIndex, dimension). Get1D and Get2D consume
+//one and two dimensions, so a sample path reads the same values however it is scheduled.
+class PixelSampler {
 public:
 	//public methods
-	Vector3() :x(0), y(0), z(0) {}
-	Vector3(T xx, T yy, T zz) :x(xx), y(yy), z(zz) {} 
+	explicit PixelSampler(uint32_t seed = 0) : seed(seed) {}
 
-	template<typename S>
-	explicit Vector3(const Point3<T>& p) {
-		x = (T)p.x;
-		y = (T)p.y;
-		z = (T)p.z;
+	void StartPixelSample(const Point2i& p, uint32_t index, int dim = 0) {
+		pixel = p;
+		sampleIndex = index;
+		dimension = dim;
 	}
 
-	template<typename S>
-	explicit Vector3(const Vector3<T>& v) {
-		x = (T)v.x;
-		y = (T)v.y;
-		z = (T)v.z;
+protected:
+	//different for every pixel, dimension and seed
+	uint64_t DimensionHash() const {
+		uint64_t p = ((uint64_t)(uint32_t)pixel.x << 32) | (uint32_t)pixel.y;
+		return MixBits(p ^ MixBits(((uint64_t)(uint32_t)dimension << 32) | seed));
 	}
 
-	bool HasNaN() const { return isNaN(x) || isNaN(y) || isNaN(z); }
+	Point2i pixel;
+	uint32_t sampleIndex = 0;
+	int dimension = 0;
+	uint32_t seed;
+};
 
-	Vector3<T>& operator = (const Vector3<T>& v) {
-		x = v.x;
-		y = v.y;
-		z = v.z;
-		return *this;
-	}
+//Draws from an RNG, the reference the low-discrepancy samplers are measured against.
+class IndependentSampler : public PixelSampler {
+public:
+	//public methods
+	explicit IndependentSampler(uint32_t seed = 0) : PixelSampler(seed) {}
 
-	bool operator == (const Vector3<T>& v) const {
-		return x == v.x && y == v.y && z == v.z;
+	void StartPixelSample(const Point2i& p, uint32_t index, int dim = 0) {
+		PixelSampler::StartPixelSample(p, index, dim);
+		rng.SetSequence(MixBits(((uint64_t)(uint32_t)p.x << 32) | (uint32_t)p.y), seed);
+		rng.Advance(index * 65536ull + dim);
 	}
 
-	bool operator != (const Vector3<T>& v) const {
-		return x != v.x || y != v.y || z != v.z;
+	Float Get1D() {
+		++dimension;
+		return rng.Uniform<Float>();
 	}
 
-	Vector3<T> operator -() const {
-		return Vector3<T>(-x, -y, -z);
+	Point2f Get2D() {
+		dimension += 2;
+		Float x = rng.Uniform<Float>();
+		return Point2f(x, rng.Uniform<Float>());
 	}
 
-	T operator [](int i) const {
-		assert(i >= 0 && i <= 2);
-		if (i == 0) return x;
-		if (i == 1) return y;
-		return z;
-	}
+private:
+	RNG rng;
+};
 
-	T& operator [](int i) {
-		assert(i >= 0 && i <= 2);
-		if (i == 0) return x;
-		if (i == 1) return y;
-		return z;
+//Owen-scrambled Sobol (0,2)-sequence padded across dimension pairs, every pair shuffles the
+//sample index and scrambles the bits with its own hash.
+class SobolSampler : public PixelSampler {
+public:
+	//public methods
+	explicit SobolSampler(uint32_t seed = 0) : PixelSampler(seed) {}
+
+	Float Get1D() {
+		uint64_t hash = DimensionHash();
+		++dimension;
+		uint32_t index = OwenScramble(sampleIndex, (uint32_t)hash);
+		return UInt32ToFloat(OwenScramble(SobolSample(index, 0), (uint32_t)(hash >> 32)));
 	}
 
-	Vector3<T> operator + (const Vector3<T>& v) const {
-		return Vector3<T>(x + v.x, y + v.y, z + v.z);
+	Point2f Get2D() {
+		uint64_t hash = DimensionHash();
+		dimension += 2;
+		uint32_t index = OwenScramble(sampleIndex, (uint32_t)hash);
+		uint64_t bitsHash = MixBits(hash);
+		return Point2f(UInt32ToFloat(OwenScramble(SobolSample(index, 0), (uint32_t)bitsHash)),
+			           UInt32ToFloat(OwenScramble(SobolSample(index, 1), (uint32_t)(bitsHash >> 32))));
 	}
+};
 
-	Vector3<T>& operator += (const Vector3<T>& v) {
-		x += v.x;
-		y += v.y;
-		z += v.z;
-		return *this;
+//Halton sequence with the digits of every dimension permuted, the permutation of a digit
+//depends on the digits before it (Owen scrambling in base b).
+//Dimension d uses the d-th prime as its base, up to MaxDimensions dimensions per sample.
+class HaltonSampler : public PixelSampler {
+public:
+	//public methods
+	explicit HaltonSampler(uint32_t seed = 0) : PixelSampler(seed) {}
+
+	Float Get1D() {
+		uint64_t hash = DimensionHash();
+		return ScrambledRadicalInverse(dimension++, hash);
 	}
 
-	Vector3<T> operator - (const Vector3<T>& v) const {
-		return Vector3<T>(x - v.x, y - v.y, z - v.z);
+	Point2f Get2D() {
+		uint64_t hash = DimensionHash();
+		Float x = ScrambledRadicalInverse(dimension, hash);
+		Float y = ScrambledRadicalInverse(dimension + 1, MixBits(hash));
+		dimension += 2;
+		return Point2f(x, y);
 	}
 
-	Vector3<T>& operator -= (const Vector3<T>& v) {
-		x -= v.x;
-		y -= v.y;
-		z -= v.z;
-		return *this;
+	//public data
+	static const int MaxDimensions = 1024;
+
+private:
+	//the first MaxDimensions primes, 2 to 8161
+	static const uint32_t* Primes() {
+		static const std::vector<uint32_t> primes = [] {
+			std::vector<uint32_t> p;
+			std::vector<bool> composite(8192);
+			for (uint32_t i = 2; p.size() < MaxDimensions; ++i) {
+				if (composite[i]) continue;
+				p.push_back(i);
+				for (uint32_t j = i * i; j < composite.size(); j += i) composite[j] = true;
+			}
+			return p;
+		}();
+		return primes.data();
 	}
 
-	template<typename S>
-	Vector3<T> operator *(S n) const {
-		return Vector3<T>(n * x, n * y, n * z);
+	Float ScrambledRadicalInverse(int dim, uint64_t hash) const {
+		//dimensions sharing a base would share its strata whatever their permutations, so every
+		//dimension gets its own prime. Release builds past the limit repeat the bases.
+		assert(dim < MaxDimensions);
+		const uint32_t base = Primes()[dim % MaxDimensions];
+		const Float invBase = (Float)1 / base;
+		uint64_t a = sampleIndex, reversedDigits = 0;
+		Float invBaseM = 1;
+		for (uint64_t digitIndex = 0; 1 - (base - 1) * invBaseM < 1; ++digitIndex) {
+			uint64_t next = a / base;
+			uint32_t digit = (uint32_t)(a - next * base);
+			//the digit count keeps a run of zero digits from reusing one permutation
+			uint32_t digitHash = (uint32_t)MixBits(hash ^ reversedDigits ^ (digitIndex << 58));
+			digit = PermutationElement(digit, base, digitHash);
+			reversedDigits = reversedDigits * base + digit;
+			invBaseM *= invBase;
+			a = next;
+		}
+		return std::min(invBaseM * reversedDigits, OneMinusEpsilon);
 	}
+};
 
-	template<typename S>
-	Vector3<T>& operator *= (S n) {
-		x *= n;
-		y *= n;
-		z *= n;
-		return *this;
+//Roberts' R2 sequence based on the plastic number, Cranley-Patterson rotated per pixel and dimension
+class R2Sampler : public PixelSampler {
+public:
+	//public methods
+	explicit R2Sampler(uint32_t seed = 0) : PixelSampler(seed) {}
+
+	Float Get1D() {
+		uint64_t hash = DimensionHash();
+		++dimension;
+		//golden ratio sequence
+		return Wrap(0.5 + sampleIndex * 0.61803398874989484820 + (uint32_t)hash * 2.3283064365386963e-10);
 	}
 
-	template<typename S>
-	Vector3<T> operator / (S n) const {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		return Vector3<T>(x * inverse, y * inverse, z * inverse);
+	Point2f Get2D() {
+		uint64_t hash = DimensionHash();
+		dimension += 2;
+		const double a1 = 0.75487766624669276005, a2 = 0.56984029099805326591;
+		return Point2f(Wrap(0.5 + sampleIndex * a1 + (uint32_t)hash * 2.3283064365386963e-10),
+			           Wrap(0.5 + sampleIndex * a2 + (uint32_t)(hash >> 32) * 2.3283064365386963e-10));
 	}
 
-	template<typename S>
-	Vector3<T>& operator /= (S n) {
-		assert(n != 0);
-		Float inverse = (Float)1 / n;
-		x *= inverse;
-		y *= inverse;
-		z *= inverse;
-		return *this;
+private:
+	static Float Wrap(double x) {
+		return std::min(OneMinusEpsilon, Float(x - std::floor(x)));
 	}
+};
 
-	inline bool IsNearZero() const { return isNearZero<T>(x) && isNearZero<T>(y) && isNearZero<T>(z); }
-	inline Float LengthSquared()const { return x * x + y * y + z * z; }
-	inline Float Length()const { return std::sqrt(LengthSquared()); }
+//Color
+//Linear RGB and RGBA with Rec. 709 primaries. Colors are their own kind of vector: they add and subtract
+//with each other and multiply and divide component-wise, but do not mix with points and vectors.
+struct ColorKind {};
+template<> struct SumKind<ColorKind, ColorKind> { typedef ColorKind type; };
+template<> struct DifferenceKind<ColorKind, ColorKind> { typedef ColorKind type; };
 
-	inline Vector3<T> Abs() const { return Vector3<T>(std::abs(x), std::abs(y), std::abs(z)); }
-	inline Vector3<T> Normalize() const { return *this / Length(); }
-	inline Vector3<T> Reflect(const Vector3<T>& normal) { return *this - 2 * Dot(*this, normal)*normal; }
+typedef Vector<3, Float, ColorKind> Color;
+typedef Vector<4, Float, ColorKind> ColorRGBA;
 
-	Vector3<T> Refract(const Vector3<T>& normal, Float etaiOverEtat) {
-		Float cosTheta = fmin(Dot(-*this, normal), 1.0f);
-		//R perpendicular
-		Vector3<T> rOutPerp = etaiOverEtat * (*this + cosTheta * normal);
-		//R parallel
-		Vector3<T> rOutParallel = -sqrt(fabs(1.0f - rOutPerp.LengthSquared())) * normal;
-		return rOutPerp + rOutParallel;
-	}
+static_assert(sizeof(Color) == 3 * sizeof(Float) && sizeof(ColorRGBA) == 4 * sizeof(Float),
+	          "color buffers are converted as arrays of interleaved Floats");
 
-	//public data
-	T x, y, z;
-};
+inline Color operator * (const Color& c1, const Color& c2) {
+	return Color(c1.x * c2.x, c1.y * c2.y, c1.z * c2.z);
+}
 
-template<typename T>
-inline std::ostream& operator << (std::ostream& o, const Vector3<T>& v) {
-	o << '[' << v.x << ',' << v.y << ',' << v.z << ']';
-	return o;
+inline ColorRGBA operator * (const ColorRGBA& c1, const ColorRGBA& c2) {
+	return ColorRGBA(c1.x * c2.x, c1.y * c2.y, c1.z * c2.z, c1.w * c2.w);
 }
 
-template<typename T, typename U>
-inline Vector3<T> operator * (U n, const Vector3<T>& v) {
-	return v * n;
+inline Color operator / (const Color& c1, const Color& c2) {
+	return Color(c1.x / c2.x, c1.y / c2.y, c1.z / c2.z);
+}
+
+inline ColorRGBA operator / (const ColorRGBA& c1, const ColorRGBA& c2) {
+	return ColorRGBA(c1.x / c2.x, c1.y / c2.y, c1.z / c2.z, c1.w / c2.w);
+}
+
+template <int N, typename S, typename R>
+inline Vector<N, Float, ColorKind> Clamp(const Vector<N, Float, ColorKind>& c, S low, R high) {
+	Vector<N, Float, ColorKind> r;
+	for (int i = 0; i < N; ++i) r[i] = Clamp(c[i], low, high);
+	return r;
+}
+
+//Relative luminance
+constexpr Float Luminance(const Color& c) {
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+//IEEE half precision with round to nearest even. Overflow gives infinity, NaN stays NaN and
+//subnormals are kept.
+inline uint16_t FloatToHalf(float f) {
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(float));
+	uint32_t sign = bits & 0x80000000u;
+	bits ^= sign;
+	uint16_t h;
+	if (bits >= (127u + 16) << 23)
+		h = bits > 255u << 23 ? 0x7e00 : 0x7c00;
+	else if (bits < (127u - 14) << 23) {
+		//the addition rounds the mantissa to the subnormal half grid, which is 2^-24 apart
+		const uint32_t magicBits = ((127u - 15) + (23 - 10) + 1) << 23;
+		float magic, rounded;
+		std::memcpy(&magic, &magicBits, sizeof(float));
+		std::memcpy(&rounded, &bits, sizeof(float));
+		rounded += magic;
+		std::memcpy(&bits, &rounded, sizeof(float));
+		h = (uint16_t)(bits - magicBits);
+	}
+	else {
+		uint32_t odd = (bits >> 13) & 1;
+		bits += ((15u - 127) << 23) + 0xfff + odd;
+		h = (uint16_t)(bits >> 13);
+	}
+	return (uint16_t)(h | sign >> 16);
+}
+
+inline float HalfToFloat(uint16_t h) {
+	uint32_t bits = (uint32_t)(h & 0x7fff) << 13;
+	uint32_t exponent = bits & (0x7c00u << 13);
+	bits += (127u - 15) << 23;
+	if (exponent == 0x7c00u << 13)
+		bits += (128u - 16) << 23;
+	else if (exponent == 0) {
+		//subnormal, renormalized by the subtraction
+		const uint32_t magicBits = (127u - 14) << 23;
+		float magic, f;
+		bits += 1 << 23;
+		std::memcpy(&magic, &magicBits, sizeof(float));
+		std::memcpy(&f, &bits, sizeof(float));
+		f -= magic;
+		std::memcpy(&bits, &f, sizeof(float));
+	}
+	bits |= (uint32_t)(h & 0x8000) << 16;
+	float f;
+	std::memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+//The transfer functions and tonemapping operators are kernels on Float or Pack. The scalar functions
+//call them with Float, so a single color converts to the same values as the buffers.
+namespace simd {
+
+//Powers as Exp(Log(x) * y), the Log error is scaled by the exponent.
+//float: 9 ULP, double: 10 ULP
+template <typename P>
+inline P LinearToSRGB(P x) {
+	P curve = P(1.055) * Exp(Log(x) * P(1 / 2.4)) - P(0.055);
+	return Select(x <= P(0.0031308), x * P(12.92), curve);
+}
+
+//float: 17 ULP, double: 13 ULP
+template <typename P>
+inline P SRGBToLinear(P x) {
+	P curve = Exp(Log((x + P(0.055)) * P(1 / 1.055)) * P(2.4));
+	return Select(x <= P(0.04045), x * P(1 / 12.92), curve);
+}
+
+//Extended Reinhard, x (1 + x / white^2) / (1 + x) maps white to 1. invWhite2 is 1 / white^2,
+//0 gives the plain x / (1 + x).
+template <typename P>
+inline P Reinhard(P x, P invWhite2) {
+	return x * (P(1) + x * invWhite2) / (P(1) + x);
+}
+
+//Narkowicz's fit of the ACES reference rendering and output transforms, clamped to [0, 1]
+template <typename P>
+inline P ACESFilmic(P x) {
+	//inputs past 8 map above 1 anyway, limiting them keeps x^2 finite and maps NaN to 0
+	x = Min(Max(x, P(0)), P(8));
+	P y = (x * (P(2.51) * x + P(0.03))) / (x * (P(2.43) * x + P(0.59)) + P(0.14));
+	return Min(y, P(1));
+}
+
+//Mask of the lanes of the pack at i that hold alpha, for interleaved RGBA starting at 0
+template <typename P>
+inline auto AlphaLanes(size_t i) {
+	static const Float pattern[11] = { 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0 };
+	return Load<P>(&pattern[i % 4]) > P(0);
+}
+
+//Linear [0, 1] to sRGB codes through buckets of the float bits below 1: the exponent and the top 8 mantissa
+//bits. A bucket spans at most 0.22 codes (next to 1), so it holds at most one code boundary and encodes
+//as the code at its start, plus one from the boundary up. The boundaries are the smallest Floats that round to the next
+//code on the exact curve in double, so every input encodes as the reference does. Inputs below 2^-13
+//encode to 0 and share bucket 0.
+struct SRGB8Encoding {
+	static constexpr int Buckets = (13 << 8) + 1;
+	static constexpr uint32_t LowBits = (127 - 13) << 23;
+
+	static int Code(Float x) {
+		double v = x <= 0.0031308 ? 12.92 * x : 1.055 * std::pow((double)x, 1 / 2.4) - 0.055;
+		return (int)std::floor(255 * v + 0.5);
+	}
+
+	SRGB8Encoding() {
+		//first[k] is the smallest Float of code k, searched from the inverse of the curve at the half-code
+		Float first[257];
+		first[0] = 0;
+		first[256] = Infinity;
+		for (int k = 1; k < 256; ++k) {
+			double v = (k - 0.5) / 255;
+			Float x = (Float)(v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+			while (Code(x) >= k) x = std::nextafter(x, Float(0));
+			while (Code(x) < k) x = std::nextafter(x, Float(1));
+			first[k] = x;
+		}
+		int k = 0;
+		for (int b = 0; b < Buckets; ++b) {
+			uint32_t startBits = LowBits + ((uint32_t)b << 15), endBits = startBits + (1u << 15);
+			float start, end;
+			std::memcpy(&start, &startBits, sizeof(float));
+			std::memcpy(&end, &endBits, sizeof(float));
+			while (first[k + 1] <= start) ++k;
+			assert(k == 255 || first[k + 2] >= end);
+			base[b] = (uint8_t)k;
+			boundary[b] = first[k + 1] < end ? first[k + 1] : Infinity;
+		}
+	}
+
+	//x in [0, 1]
+	uint8_t operator()(Float x) const {
+		float f = std::max((float)x, 1.0f / 8192);
+		uint32_t bits;
+		std::memcpy(&bits, &f, sizeof(float));
+		uint32_t b = (bits - LowBits) >> 15;
+		return (uint8_t)(base[b] + (x >= boundary[b]));
+	}
+
+	uint8_t base[Buckets];
+	Float boundary[Buckets];
+};
+
+//NaN encodes as 0 and alpha stays linear
+inline void LinearToSRGB8Batch(const Float* in, uint8_t* out, size_t count, bool rgba) {
+	static const SRGB8Encoding encode;
+	//Max first, so NaN becomes 0
+	auto clamp = [](Float x) { return Min(Max(x, Float(0)), Float(1)); };
+	if (!rgba) {
+		for (size_t i = 0; i < count; ++i) out[i] = encode(clamp(in[i]));
+		return;
+	}
+	for (size_t i = 0; i < count; i += 4) {
+		out[i] = encode(clamp(in[i]));
+		out[i + 1] = encode(clamp(in[i + 1]));
+		out[i + 2] = encode(clamp(in[i + 2]));
+		out[i + 3] = (uint8_t)RoundNearest(clamp(in[i + 3]) * 255);
+	}
+}
+
+//Linear values of the 256 codes, from the exact curve in double
+inline const Float* SRGB8Table() {
+	static Float table[256];
+	static const bool filled = [] {
+		for (int i = 0; i < 256; ++i) {
+			double v = i / 255.0;
+			table[i] = (Float)(v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4));
+		}
+		return true;
+	}();
+	(void)filled;
+	return table;
+}
+
+inline void SRGB8ToLinearBatch(const uint8_t* in, Float* out, size_t count, bool rgba) {
+	const Float* table = SRGB8Table();
+	if (!rgba) {
+		for (size_t i = 0; i < count; ++i) out[i] = table[in[i]];
+		return;
+	}
+	for (size_t i = 0; i < count; i += 4) {
+		out[i] = table[in[i]];
+		out[i + 1] = table[in[i + 1]];
+		out[i + 2] = table[in[i + 2]];
+		out[i + 3] = in[i + 3] * (Float(1) / 255);
+	}
+}
+
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+//Four floats to halves in the low 64 bits, the same rounding as FloatToHalf
+inline __m128i FloatToHalf4(__m128 f) {
+#ifdef __F16C__
+	return _mm_cvtps_ph(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+	const __m128i magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+	__m128 sign = _mm_and_ps(f, _mm_set1_ps(-0.0f));
+	__m128 a = _mm_xor_ps(f, sign);
+	__m128i bits = _mm_castps_si128(a);
+	__m128i special = _mm_or_si128(_mm_and_si128(_mm_castps_si128(_mm_cmpunord_ps(a, a)), _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+	__m128i regular = _mm_cmpgt_epi32(_mm_set1_epi32((127 + 16) << 23), bits);
+	__m128i subnormal = _mm_cmpgt_epi32(_mm_set1_epi32((127 - 14) << 23), bits);
+	__m128i small = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(a, _mm_castsi128_ps(magic))), magic);
+	__m128i odd = _mm_srai_epi32(_mm_slli_epi32(bits, 31 - 13), 31);
+	__m128i normal = _mm_srli_epi32(_mm_sub_epi32(_mm_add_epi32(bits, _mm_set1_epi32(0xfff - ((127 - 15) << 23))), odd), 13);
+	__m128i h = _mm_or_si128(_mm_and_si128(subnormal, small), _mm_andnot_si128(subnormal, normal));
+	h = _mm_or_si128(_mm_and_si128(regular, h), _mm_andnot_si128(regular, special));
+	//the arithmetic shift makes negative halves negative 32-bit values, which the signed pack keeps
+	h = _mm_or_si128(h, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+	return _mm_packs_epi32(h, h);
+#endif
+}
+
+//Four halves in the low 64 bits to floats
+inline __m128 HalfToFloat4(__m128i h) {
+#ifdef __F16C__
+	return _mm_cvtph_ps(h);
+#else
+	h = _mm_unpacklo_epi16(h, _mm_setzero_si128());
+	__m128i magnitude = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+	__m128i sign = _mm_slli_epi32(_mm_xor_si128(h, magnitude), 16);
+	//scaling by 2^112 rebiases the exponent and renormalizes subnormals in one multiply
+	__m128 f = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(magnitude, 13)), _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23)));
+	__m128i infNaN = _mm_and_si128(_mm_cmpgt_epi32(magnitude, _mm_set1_epi32(0x7bff)), _mm_set1_epi32(255 << 23));
+	return _mm_or_ps(f, _mm_castsi128_ps(_mm_or_si128(sign, infNaN)));
+#endif
+}
+#endif
+
+inline void HalfBatch(const Float* in, uint16_t* out, size_t count) {
+	size_t i = 0;
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+	for (; i + 4 <= count; i += 4)
+		_mm_storel_epi64((__m128i*)&out[i], FloatToHalf4(_mm_loadu_ps(&in[i])));
+#endif
+	for (; i < count; ++i) out[i] = FloatToHalf((float)in[i]);
+}
+
+inline void HalfToLinearBatch(const uint16_t* in, Float* out, size_t count) {
+	size_t i = 0;
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(&out[i], HalfToFloat4(_mm_loadl_epi64((const __m128i*)&in[i])));
+#endif
+	for (; i < count; ++i) out[i] = HalfToFloat(in[i]);
+}
+
+//count pixels of four interleaved channels, R in the low bits
+inline void RGB10A2Batch(const Float* in, uint32_t* out, size_t count) {
+	ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		const int Width = sizeof(P) / sizeof(Float);
+		Float codes[4][Width];
+		for (int c = 0; c < 4; ++c) {
+			P x = Min(Max(LoadStrided<P>(&in[4 * i + c], 4), P(0)), P(1));
+			Store(codes[c], RoundNearest(x * P(c == 3 ? 3 : 1023)));
+		}
+		for (int j = 0; j < Width; ++j)
+			out[i + j] = (uint32_t)codes[0][j] | (uint32_t)codes[1][j] << 10 | (uint32_t)codes[2][j] << 20 | (uint32_t)codes[3][j] << 30;
+	});
+}
+
+inline void RGB10A2ToLinearBatch(const uint32_t* in, Float* out, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t v = in[i];
+		out[4 * i] = (v & 1023) * (Float(1) / 1023);
+		out[4 * i + 1] = (v >> 10 & 1023) * (Float(1) / 1023);
+		out[4 * i + 2] = (v >> 20 & 1023) * (Float(1) / 1023);
+		out[4 * i + 3] = (v >> 30) * (Float(1) / 3);
+	}
+}
+
+inline void ReinhardBatch(const Float* in, Float* out, size_t count, bool rgba, Float white) {
+	const Float invWhite2 = 1 / (white * white);
+	ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x = Load<P>(&in[i]);
+		P y = Reinhard(x, P(invWhite2));
+		if (rgba) y = Select(AlphaLanes<P>(i), x, y);
+		Store(&out[i], y);
+	});
+}
+
+inline void ACESFilmicBatch(const Float* in, Float* out, size_t count, bool rgba, Float exposure) {
+	ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x = Load<P>(&in[i]);
+		P y = ACESFilmic(x * P(exposure));
+		if (rgba) y = Select(AlphaLanes<P>(i), x, y);
+		Store(&out[i], y);
+	});
+}
+
+}
+
+inline Float LinearToSRGB(Float v) { return simd::LinearToSRGB(v); }
+inline Float SRGBToLinear(Float v) { return simd::SRGBToLinear(v); }
+
+inline Color LinearToSRGB(const Color& c) {
+	return Color(LinearToSRGB(c.x), LinearToSRGB(c.y), LinearToSRGB(c.z));
+}
+
+inline Color SRGBToLinear(const Color& c) {
+	return Color(SRGBToLinear(c.x), SRGBToLinear(c.y), SRGBToLinear(c.z));
+}
+
+inline Color TonemapReinhard(const Color& c, Float white = Infinity) {
+	const Float invWhite2 = 1 / (white * white);
+	return Color(simd::Reinhard(c.x, invWhite2), simd::Reinhard(c.y, invWhite2), simd::Reinhard(c.z, invWhite2));
+}
+
+inline Color TonemapACES(const Color& c, Float exposure = 1) {
+	return Color(simd::ACESFilmic(c.x * exposure), simd::ACESFilmic(c.y * exposure), simd::ACESFilmic(c.z * exposure));
+}
+
+//Framebuffer conversions of count pixels. Byte and half buffers hold 3 or 4 values per pixel, RGB10A2
+//one uint32_t per pixel. Alpha is linear in every format and passes the tonemappers unchanged.
+//Tonemapping may run in place.
+inline void ToSRGB8(const Color* in, uint8_t* out, size_t count) { simd::LinearToSRGB8Batch(&in->x, out, 3 * count, false); }
+inline void ToSRGB8(const ColorRGBA* in, uint8_t* out, size_t count) { simd::LinearToSRGB8Batch(&in->x, out, 4 * count, true); }
+inline void FromSRGB8(const uint8_t* in, Color* out, size_t count) { simd::SRGB8ToLinearBatch(in, &out->x, 3 * count, false); }
+inline void FromSRGB8(const uint8_t* in, ColorRGBA* out, size_t count) { simd::SRGB8ToLinearBatch(in, &out->x, 4 * count, true); }
+
+inline void ToHalf(const Color* in, uint16_t* out, size_t count) { simd::HalfBatch(&in->x, out, 3 * count); }
+inline void ToHalf(const ColorRGBA* in, uint16_t* out, size_t count) { simd::HalfBatch(&in->x, out, 4 * count); }
+inline void FromHalf(const uint16_t* in, Color* out, size_t count) { simd::HalfToLinearBatch(in, &out->x, 3 * count); }
+inline void FromHalf(const uint16_t* in, ColorRGBA* out, size_t count) { simd::HalfToLinearBatch(in, &out->x, 4 * count); }
+
+inline void ToRGB10A2(const ColorRGBA* in, uint32_t* out, size_t count) { simd::RGB10A2Batch(&in->x, out, count); }
+inline void FromRGB10A2(const uint32_t* in, ColorRGBA* out, size_t count) { simd::RGB10A2ToLinearBatch(in, &out->x, count); }
+
+inline void TonemapReinhard(const Color* in, Color* out, size_t count, Float white = Infinity) {
+	simd::ReinhardBatch(&in->x, &out->x, 3 * count, false, white);
+}
+
+inline void TonemapReinhard(const ColorRGBA* in, ColorRGBA* out, size_t count, Float white = Infinity) {
+	simd::ReinhardBatch(&in->x, &out->x, 4 * count, true, white);
+}
+
+inline void TonemapACES(const Color* in, Color* out, size_t count, Float exposure = 1) {
+	simd::ACESFilmicBatch(&in->x, &out->x, 3 * count, false, exposure);
+}
+
+inline void TonemapACES(const ColorRGBA* in, ColorRGBA* out, size_t count, Float exposure = 1) {
+	simd::ACESFilmicBatch(&in->x, &out->x, 4 * count, true, exposure);
+}
+
+template <typename T>
+constexpr int MaxDimension(const Vector3<T> &v) {
+	return (v.x > v.y) ? ((v.x > v.z) ? 0 : 2) : ((v.y > v.z) ? 1 : 2);
+}
+
+template <typename T>
+constexpr Vector3<T> Permute(const Vector3<T> &v, int x, int y, int z) {
+	return Vector3<T>(v[x], v[y], v[z]);
+}
+
+//Bounds2
+template <typename T>
+class Bounds2 {
+public:
+	//public methods
+	//Empty box, pMin above pMax so that the first Union gives the other operand.
+	constexpr Bounds2() :
+		pMin(std::numeric_limits<T>::max(), std::numeric_limits<T>::max()),
+		pMax(std::numeric_limits<T>::lowest(), std::numeric_limits<T>::lowest()) {}
+
+	constexpr explicit Bounds2(const Point2<T> &p) : pMin(p), pMax(p) {}
+
+	constexpr Bounds2(const Point2<T> &p1, const Point2<T> &p2) :
+		pMin(std::min(p1.x, p2.x), std::min(p1.y, p2.y)),
+		pMax(std::max(p1.x, p2.x), std::max(p1.y, p2.y)) {}
+
+	constexpr bool IsEmpty() const { return pMin.x > pMax.x || pMin.y > pMax.y; }
+
+	constexpr Vector2<T> Diagonal() const { return pMax - pMin; }
+
+	constexpr T Area() const { return (pMax.x - pMin.x) * (pMax.y - pMin.y); }
+
+	//Point at the relative position t, (0, 0) is pMin and (1, 1) pMax.
+	constexpr Point2<T> Lerp(const Point2<T> &t) const {
+		return Point2<T>(hsm::Lerp(t.x, pMin.x, pMax.x), hsm::Lerp(t.y, pMin.y, pMax.y));
+	}
+
+	//Inverse of Lerp, the position of p relative to the corners.
+	constexpr Vector2<T> Offset(const Point2<T> &p) const {
+		Vector2<T> o = p - pMin;
+		if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
+		if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
+		return o;
+	}
+
+	constexpr Point2<T>& operator [] (int i) {
+		assert(i == 0 || i == 1);
+		if (i == 0) return pMin;
+		return pMax;
+	}
+
+	constexpr const Point2<T>& operator [] (int i) const {
+		assert(i == 0 || i == 1);
+		if (i == 0) return pMin;
+		return pMax;
+	}
+
+	constexpr bool operator == (const Bounds2<T>& b) const {
+		return pMin == b.pMin && pMax == b.pMax;
+	}
+
+	constexpr bool operator != (const Bounds2<T>& b) const {
+		return pMin != b.pMin || pMax != b.pMax;
+	}
+
+	void BoundingSphere(Point2<T>& center, T& radius) const {
+		Point2<T> c = (pMin + pMax) * 0.5f;
+		center.x = c.x;
+		center.y = c.y;
+		radius = Inside(center, *this) ? center.Distance(pMax) : 0;
+	}
+
+	//public data
+	Point2<T> pMin, pMax;
+};
+
+template <typename T>
+inline std::ostream& operator << (std::ostream& o, const Bounds2<T>& b) {
+	o << "[ " << b.pMin << " , " << b.pMax << " ]";
+	return o;
+}
+
+//Bounds3
+template <typename T>
+class Bounds3 {
+public:
+	//public methods
+	//Empty box, pMin above pMax so that the first Union gives the other operand.
+	constexpr Bounds3() :
+		pMin(std::numeric_limits<T>::max(), std::numeric_limits<T>::max(), std::numeric_limits<T>::max()),
+		pMax(std::numeric_limits<T>::lowest(), std::numeric_limits<T>::lowest(), std::numeric_limits<T>::lowest()) {}
+
+	constexpr explicit Bounds3(const Point3<T> &p) : pMin(p), pMax(p) {}
+
+	constexpr Bounds3(const Point3<T> &p1, const Point3<T> &p2) :
+		pMin(std::min(p1.x, p2.x), std::min(p1.y, p2.y), std::min(p1.z, p2.z)),
+		pMax(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z)) {}
+
+	constexpr bool IsEmpty() const { return pMin.x > pMax.x || pMin.y > pMax.y || pMin.z > pMax.z; }
+
+	constexpr Vector3<T> Diagonal() const { return pMax - pMin; }
+
+	//Point at the relative position t, (0, 0, 0) is pMin and (1, 1, 1) pMax.
+	constexpr Point3<T> Lerp(const Point3<T> &t) const {
+		return Point3<T>(hsm::Lerp(t.x, pMin.x, pMax.x), hsm::Lerp(t.y, pMin.y, pMax.y), hsm::Lerp(t.z, pMin.z, pMax.z));
+	}
+
+	//Inverse of Lerp, the position of p relative to the corners.
+	constexpr Vector3<T> Offset(const Point3<T> &p) const {
+		Vector3<T> o = p - pMin;
+		if (pMax.x > pMin.x) o.x /= pMax.x - pMin.x;
+		if (pMax.y > pMin.y) o.y /= pMax.y - pMin.y;
+		if (pMax.z > pMin.z) o.z /= pMax.z - pMin.z;
+		return o;
+	}
+
+	constexpr T SurfaceArea() const {
+		Vector3<T> v = Diagonal();
+		return 2 * (v.x * v.y + v.y * v.z + v.x * v.z);
+	}
+
+	constexpr T Volume() const {
+		Vector3<T> v = Diagonal();
+		return v.x * v.y * v.z;
+	}
+
+	constexpr Point3<T>& operator [] (int i) {
+		assert(i == 0 || i == 1);
+		if (i == 0) return pMin;
+		return pMax;
+	}
+
+	constexpr const Point3<T>& operator [] (int i) const {
+		assert(i == 0 || i == 1);
+		if (i == 0) return pMin;
+		return pMax;
+	}
+
+	constexpr bool operator == (const Bounds3<T>& b) const {
+		return pMin == b.pMin && pMax == b.pMax;
+	}
+
+	constexpr bool operator != (const Bounds3<T>& b) const {
+		return pMin != b.pMin || pMax != b.pMax;
+	}
+
+	void BoundingSphere(Point3<T>& center, T& radius) const {
+		Point3<T> c = (pMin + pMax) * 0.5f;
+		center.x = c.x;
+		center.y = c.y;
+		center.z = c.z;
+		radius = Inside(center, *this) ? center.Distance(pMax) : 0;
+	}
+
+	//public data
+	Point3<T> pMin, pMax;
+};
+
+template <typename T>
+inline std::ostream& operator << (std::ostream& o, const Bounds3<T>& b) {
+	o << "[ " << b.pMin << " , " << b.pMax << " ]";
+	return o;
+}
+
+typedef Bounds2<int> Bounds2i;
+typedef Bounds2<Float> Bounds2f;
+typedef Bounds3<int> Bounds3i;
+typedef Bounds3<Float> Bounds3f;
+
+//Bounds operations, an empty operand leaves Union unchanged and makes Intersect empty.
+template <typename T>
+constexpr Bounds2<T> Union(const Bounds2<T> &b, const Point2<T> &p) {
+	Bounds2<T> r;
+	r.pMin = Point2<T>(std::min(b.pMin.x, p.x), std::min(b.pMin.y, p.y));
+	r.pMax = Point2<T>(std::max(b.pMax.x, p.x), std::max(b.pMax.y, p.y));
+	return r;
+}
+
+template <typename T>
+constexpr Bounds2<T> Union(const Bounds2<T> &b1, const Bounds2<T> &b2) {
+	Bounds2<T> r;
+	r.pMin = Point2<T>(std::min(b1.pMin.x, b2.pMin.x), std::min(b1.pMin.y, b2.pMin.y));
+	r.pMax = Point2<T>(std::max(b1.pMax.x, b2.pMax.x), std::max(b1.pMax.y, b2.pMax.y));
+	return r;
+}
+
+//The result is empty when the boxes are disjoint.
+template <typename T>
+constexpr Bounds2<T> Intersect(const Bounds2<T> &b1, const Bounds2<T> &b2) {
+	Bounds2<T> r;
+	r.pMin = Point2<T>(std::max(b1.pMin.x, b2.pMin.x), std::max(b1.pMin.y, b2.pMin.y));
+	r.pMax = Point2<T>(std::min(b1.pMax.x, b2.pMax.x), std::min(b1.pMax.y, b2.pMax.y));
+	return r;
+}
+
+//Boxes that only share a face overlap.
+template <typename T>
+constexpr bool Overlaps(const Bounds2<T> &b1, const Bounds2<T> &b2) {
+	return b1.pMax.x >= b2.pMin.x && b1.pMin.x <= b2.pMax.x && b1.pMax.y >= b2.pMin.y && b1.pMin.y <= b2.pMax.y;
+}
+
+//Grows the box by delta on every side, a negative delta shrinks it.
+template <typename T, typename U>
+constexpr Bounds2<T> Expand(const Bounds2<T> &b, U delta) {
+	Bounds2<T> r;
+	r.pMin = Point2<T>(b.pMin.x - delta, b.pMin.y - delta);
+	r.pMax = Point2<T>(b.pMax.x + delta, b.pMax.y + delta);
+	return r;
+}
+
+template <typename T>
+constexpr Bounds3<T> Union(const Bounds3<T> &b, const Point3<T> &p) {
+	Bounds3<T> r;
+	r.pMin = Point3<T>(std::min(b.pMin.x, p.x), std::min(b.pMin.y, p.y), std::min(b.pMin.z, p.z));
+	r.pMax = Point3<T>(std::max(b.pMax.x, p.x), std::max(b.pMax.y, p.y), std::max(b.pMax.z, p.z));
+	return r;
+}
+
+template <typename T>
+constexpr Bounds3<T> Union(const Bounds3<T> &b1, const Bounds3<T> &b2) {
+	Bounds3<T> r;
+	r.pMin = Point3<T>(std::min(b1.pMin.x, b2.pMin.x), std::min(b1.pMin.y, b2.pMin.y), std::min(b1.pMin.z, b2.pMin.z));
+	r.pMax = Point3<T>(std::max(b1.pMax.x, b2.pMax.x), std::max(b1.pMax.y, b2.pMax.y), std::max(b1.pMax.z, b2.pMax.z));
+	return r;
+}
+
+//The result is empty when the boxes are disjoint.
+template <typename T>
+constexpr Bounds3<T> Intersect(const Bounds3<T> &b1, const Bounds3<T> &b2) {
+	Bounds3<T> r;
+	r.pMin = Point3<T>(std::max(b1.pMin.x, b2.pMin.x), std::max(b1.pMin.y, b2.pMin.y), std::max(b1.pMin.z, b2.pMin.z));
+	r.pMax = Point3<T>(std::min(b1.pMax.x, b2.pMax.x), std::min(b1.pMax.y, b2.pMax.y), std::min(b1.pMax.z, b2.pMax.z));
+	return r;
+}
+
+//Boxes that only share a face overlap.
+template <typename T>
+constexpr bool Overlaps(const Bounds3<T> &b1, const Bounds3<T> &b2) {
+	return b1.pMax.x >= b2.pMin.x && b1.pMin.x <= b2.pMax.x && b1.pMax.y >= b2.pMin.y && b1.pMin.y <= b2.pMax.y &&
+		   b1.pMax.z >= b2.pMin.z && b1.pMin.z <= b2.pMax.z;
+}
+
+//Grows the box by delta on every side, a negative delta shrinks it.
+template <typename T, typename U>
+constexpr Bounds3<T> Expand(const Bounds3<T> &b, U delta) {
+	Bounds3<T> r;
+	r.pMin = Point3<T>(b.pMin.x - delta, b.pMin.y - delta, b.pMin.z - delta);
+	r.pMax = Point3<T>(b.pMax.x + delta, b.pMax.y + delta, b.pMax.z + delta);
+	return r;
+}
+
+//Ray
+class Ray {
+public:
+	//public methods
+	Ray() {}
+	Ray(const Point3f& o, const Vector3f& d, Float t = 0.0f) : origin(o), direction(d), time(t) {}
+
+	Point3f At(Float t) const { return origin + t * direction; }
+
+	bool HasNaN() const {
+		return (origin.HasNaN() || direction.HasNaN());
+	}
+
+	//public data
+	Point3f origin;
+	Vector3f direction;
+	Float time;
+};
+
+inline std::ostream &operator<<(std::ostream &o, const Ray &r) {
+	o << "[ origin:" << r.origin << ", direction:" << r.direction << ", time:" << r.time << "]";
+	return o;
+}
+
+//Ray with what box tests reuse: the inverse direction, its signs and the parametric range [tMin, tMax].
+//Zero direction components keep their infinite inverse, the slab tests below are written for it.
+//Construct it again, or transform it, after changing the origin or the direction.
+class PrecomputedRay : public Ray {
+public:
+	//public methods
+	PrecomputedRay() {}
+	PrecomputedRay(const Ray& r, Float tMin = 0, Float tMax = Infinity) : Ray(r), tMin(tMin), tMax(tMax) {
+		invDirection = Vector3f(1 / direction.x, 1 / direction.y, 1 / direction.z);
+		//from the inverse, so that -0 counts as negative like its -infinity
+		sign[0] = invDirection.x < 0;
+		sign[1] = invDirection.y < 0;
+		sign[2] = invDirection.z < 0;
+	}
+
+	//public data
+	Vector3f invDirection;
+	//1 when the direction points towards the negative side of the axis, b[sign[i]] is the near plane of box b
+	int sign[3];
+	Float tMin, tMax;
+};
+
+inline std::ostream &operator<<(std::ostream &o, const PrecomputedRay &r) {
+	o << "[ origin:" << r.origin << ", direction:" << r.direction << ", time:" << r.time <<
+		", t:[" << r.tMin << ", " << r.tMax << "]]";
+	return o;
+}
+
+//Slab test of [ray.tMin, tMax] against the box, tNear and tFar receive the overlap when they are not null.
+//A ray parallel to a slab gets infinite slab distances, except 0 * infinity = NaN when the origin lies on one
+//of its planes. The slab distance is always the first operand of simd::Min and simd::Max, which return the
+//second operand for NaN, so such a slab is dropped and tNear and tFar are never NaN.
+inline bool IntersectP(const PrecomputedRay& ray, const Bounds3f& b, Float tMax, Float* tNear = nullptr, Float* tFar = nullptr) {
+	Float n = ray.tMin, f = tMax;
+	n = simd::Max((b[ray.sign[0]].x - ray.origin.x) * ray.invDirection.x, n);
+	f = simd::Min((b[1 - ray.sign[0]].x - ray.origin.x) * ray.invDirection.x, f);
+	n = simd::Max((b[ray.sign[1]].y - ray.origin.y) * ray.invDirection.y, n);
+	f = simd::Min((b[1 - ray.sign[1]].y - ray.origin.y) * ray.invDirection.y, f);
+	n = simd::Max((b[ray.sign[2]].z - ray.origin.z) * ray.invDirection.z, n);
+	f = simd::Min((b[1 - ray.sign[2]].z - ray.origin.z) * ray.invDirection.z, f);
+	if (tNear) *tNear = n;
+	if (tFar) *tFar = f;
+	//n < tMax rejects a parallel ray outside a slab, whose near distance is infinite
+	return n <= f && n < tMax;
+}
+
+inline bool IntersectP(const PrecomputedRay& ray, const Bounds3f& b, Float* tNear = nullptr, Float* tFar = nullptr) {
+	return IntersectP(ray, b, ray.tMax, tNear, tFar);
+}
+
+//Origin of a ray that leaves the surface point p with normal n in direction w. p is moved along n, to the side
+//w points to, until its error box is behind the plane through the offset point, and then by one Float in every
+//component so that rounding the sum cannot move it back. The exact surface point lies in the error box, so the
+//new ray cannot hit the surface it starts on, without a scene dependent epsilon.
+inline Point3f OffsetRayOrigin(const Point3fi& p, const Vector3f& n, const Vector3f& w) {
+	Float d = Dot(n.Abs(), p.Error());
+	Vector3f offset = d * n;
+	if (Dot(w, n) < 0) offset = -offset;
+	Point3f po = Point3f(p) + offset;
+	for (int i = 0; i < 3; ++i) {
+		if (offset[i] > 0) po[i] = NextFloatUp(po[i]);
+		else if (offset[i] < 0) po[i] = NextFloatDown(po[i]);
+	}
+	return po;
+}
+
+inline Ray SpawnRay(const Point3fi& p, const Vector3f& n, const Vector3f& w, Float time = 0) {
+	return Ray(OffsetRayOrigin(p, n, w), w, time);
+}
+
+//Shadow ray from the surface point p towards the point to, reached at t = 1. tMax stops it ShadowEpsilon
+//before, so the surface at to is not hit.
+inline PrecomputedRay SpawnRayTo(const Point3fi& p, const Vector3f& n, const Point3f& to, Float time = 0) {
+	Point3f o = OffsetRayOrigin(p, n, to - Point3f(p));
+	return PrecomputedRay(Ray(o, to - o, time), 0, 1 - ShadowEpsilon);
+}
+
+//Between two surface points, both ends are offset
+inline PrecomputedRay SpawnRayTo(const Point3fi& from, const Vector3f& nFrom, const Point3fi& to, const Vector3f& nTo,
+	                             Float time = 0) {
+	Point3f pf = OffsetRayOrigin(from, nFrom, Point3f(to) - Point3f(from));
+	Point3f pt = OffsetRayOrigin(to, nTo, pf - Point3f(to));
+	return PrecomputedRay(Ray(pf, pt - pf, time), 0, 1 - ShadowEpsilon);
+}
+
+//SIMD kernels
+//Every kernel adds its products in the same order as the scalar code, so the results are bit-compatible.
+namespace simd {
+
+inline void MatMul4x4(const Float a[4][4], const Float b[4][4], Float r[4][4]) {
+#if defined(USE_DOUBLE) && defined(HSM_AVX)
+	__m256d b0 = _mm256_loadu_pd(b[0]), b1 = _mm256_loadu_pd(b[1]);
+	__m256d b2 = _mm256_loadu_pd(b[2]), b3 = _mm256_loadu_pd(b[3]);
+	for (int i = 0; i < 4; ++i) {
+		__m256d row = _mm256_mul_pd(_mm256_broadcast_sd(&a[i][0]), b0);
+		row = _mm256_add_pd(row, _mm256_mul_pd(_mm256_broadcast_sd(&a[i][1]), b1));
+		row = _mm256_add_pd(row, _mm256_mul_pd(_mm256_broadcast_sd(&a[i][2]), b2));
+		row = _mm256_add_pd(row, _mm256_mul_pd(_mm256_broadcast_sd(&a[i][3]), b3));
+		_mm256_storeu_pd(r[i], row);
+	}
+#elif defined(USE_DOUBLE) && defined(HSM_SSE)
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; j += 2) {
+			__m128d row = _mm_mul_pd(_mm_set1_pd(a[i][0]), _mm_loadu_pd(&b[0][j]));
+			row = _mm_add_pd(row, _mm_mul_pd(_mm_set1_pd(a[i][1]), _mm_loadu_pd(&b[1][j])));
+			row = _mm_add_pd(row, _mm_mul_pd(_mm_set1_pd(a[i][2]), _mm_loadu_pd(&b[2][j])));
+			row = _mm_add_pd(row, _mm_mul_pd(_mm_set1_pd(a[i][3]), _mm_loadu_pd(&b[3][j])));
+			_mm_storeu_pd(&r[i][j], row);
+		}
+	}
+#elif !defined(USE_DOUBLE) && defined(HSM_AVX)
+	//two rows per iteration, the upper 128 bits work on the second row
+	__m256 b0 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(b[0]));
+	__m256 b1 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(b[1]));
+	__m256 b2 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(b[2]));
+	__m256 b3 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(b[3]));
+	for (int i = 0; i < 4; i += 2) {
+		__m256 rows = _mm256_loadu_ps(a[i]);
+		__m256 row = _mm256_mul_ps(_mm256_permute_ps(rows, 0x00), b0);
+		row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_permute_ps(rows, 0x55), b1));
+		row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_permute_ps(rows, 0xAA), b2));
+		row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_permute_ps(rows, 0xFF), b3));
+		_mm256_storeu_ps(r[i], row);
+	}
+#elif !defined(USE_DOUBLE) && defined(HSM_SSE)
+	__m128 b0 = _mm_loadu_ps(b[0]), b1 = _mm_loadu_ps(b[1]);
+	__m128 b2 = _mm_loadu_ps(b[2]), b3 = _mm_loadu_ps(b[3]);
+	for (int i = 0; i < 4; ++i) {
+		__m128 ai = _mm_loadu_ps(a[i]);
+		__m128 row = _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0x00), b0);
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0x55), b1));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0xAA), b2));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0xFF), b3));
+		_mm_storeu_ps(r[i], row);
+	}
+#else
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+			r[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j] + a[i][3] * b[3][j];
+#endif
+}
+
+//3x4 affine matrices with an implicit (0, 0, 0, 1) last row, r must not alias a or b
+inline void MatMulAffine(const Float a[3][4], const Float b[3][4], Float r[3][4]) {
+#if defined(USE_DOUBLE) && defined(HSM_AVX)
+	__m256d b0 = _mm256_loadu_pd(b[0]), b1 = _mm256_loadu_pd(b[1]), b2 = _mm256_loadu_pd(b[2]);
+	for (int i = 0; i < 3; ++i) {
+		__m256d row = _mm256_mul_pd(_mm256_broadcast_sd(&a[i][0]), b0);
+		row = _mm256_add_pd(row, _mm256_mul_pd(_mm256_broadcast_sd(&a[i][1]), b1));
+		row = _mm256_add_pd(row, _mm256_mul_pd(_mm256_broadcast_sd(&a[i][2]), b2));
+		row = _mm256_add_pd(row, _mm256_set_pd(a[i][3], 0.0, 0.0, 0.0));
+		_mm256_storeu_pd(r[i], row);
+	}
+#elif !defined(USE_DOUBLE) && defined(HSM_SSE)
+	const __m128 b0 = _mm_loadu_ps(b[0]), b1 = _mm_loadu_ps(b[1]), b2 = _mm_loadu_ps(b[2]);
+	const __m128 lastLane = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	auto row = [&](const Float* ai) {
+		__m128 a = _mm_loadu_ps(ai);
+		__m128 result = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0);
+		result = _mm_add_ps(result, _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b1));
+		result = _mm_add_ps(result, _mm_mul_ps(_mm_shuffle_ps(a, a, 0xAA), b2));
+		//(0, 0, 0, a[3])
+		return _mm_add_ps(result, _mm_and_ps(a, lastLane));
+	};
+	//all rows are computed before the stores, so a whole result can stay in registers
+	__m128 r0 = row(a[0]), r1 = row(a[1]), r2 = row(a[2]);
+	_mm_storeu_ps(r[0], r0);
+	_mm_storeu_ps(r[1], r1);
+	_mm_storeu_ps(r[2], r2);
+#else
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < 4; ++j)
+			r[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+		r[i][3] += a[i][3];
+	}
+#endif
+}
+
+//r may alias m
+inline void Transpose4x4(const Float m[4][4], Float r[4][4]) {
+#if defined(USE_DOUBLE) && defined(HSM_AVX)
+	__m256d r0 = _mm256_loadu_pd(m[0]), r1 = _mm256_loadu_pd(m[1]);
+	__m256d r2 = _mm256_loadu_pd(m[2]), r3 = _mm256_loadu_pd(m[3]);
+	__m256d t0 = _mm256_unpacklo_pd(r0, r1);
+	__m256d t1 = _mm256_unpackhi_pd(r0, r1);
+	__m256d t2 = _mm256_unpacklo_pd(r2, r3);
+	__m256d t3 = _mm256_unpackhi_pd(r2, r3);
+	_mm256_storeu_pd(r[0], _mm256_permute2f128_pd(t0, t2, 0x20));
+	_mm256_storeu_pd(r[1], _mm256_permute2f128_pd(t1, t3, 0x20));
+	_mm256_storeu_pd(r[2], _mm256_permute2f128_pd(t0, t2, 0x31));
+	_mm256_storeu_pd(r[3], _mm256_permute2f128_pd(t1, t3, 0x31));
+#elif !defined(USE_DOUBLE) && defined(HSM_SSE)
+	__m128 r0 = _mm_loadu_ps(m[0]), r1 = _mm_loadu_ps(m[1]);
+	__m128 r2 = _mm_loadu_ps(m[2]), r3 = _mm_loadu_ps(m[3]);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(r[0], r0);
+	_mm_storeu_ps(r[1], r1);
+	_mm_storeu_ps(r[2], r2);
+	_mm_storeu_ps(r[3], r3);
+#else
+	Float t[4][4];
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+			t[i][j] = m[j][i];
+	memcpy(r, t, sizeof(Float) * 16);
+#endif
+}
+
+//out = m * (x, y, z, w), w is 1 for points and 0 for vectors
+inline void Transform4(const Float m[4][4], Float x, Float y, Float z, bool point, Float out[4]) {
+#if defined(USE_DOUBLE) && defined(HSM_AVX)
+	Float cols[4][4];
+	Transpose4x4(m, cols);
+	__m256d r = _mm256_mul_pd(_mm256_loadu_pd(cols[0]), _mm256_set1_pd(x));
+	r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_loadu_pd(cols[1]), _mm256_set1_pd(y)));
+	r = _mm256_add_pd(r, _mm256_mul_pd(_mm256_loadu_pd(cols[2]), _mm256_set1_pd(z)));
+	if (point) r = _mm256_add_pd(r, _mm256_loadu_pd(cols[3]));
+	_mm256_storeu_pd(out, r);
+#elif !defined(USE_DOUBLE) && defined(HSM_SSE)
+	__m128 c0 = _mm_loadu_ps(m[0]), c1 = _mm_loadu_ps(m[1]);
+	__m128 c2 = _mm_loadu_ps(m[2]), c3 = _mm_loadu_ps(m[3]);
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	__m128 r = _mm_mul_ps(c0, _mm_set1_ps(x));
+	r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(y)));
+	r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(z)));
+	if (point) r = _mm_add_ps(r, c3);
+	_mm_storeu_ps(out, r);
+#else
+	for (int i = 0; i < 4; ++i) {
+		out[i] = m[i][0] * x + m[i][1] * y + m[i][2] * z;
+		if (point) out[i] += m[i][3];
+	}
+#endif
+}
+
+//r = inverse of m computed from its adjugate, returns the determinant (r is undefined when it is zero)
+inline Float Inverse4x4(const Float m[4][4], Float r[4][4]) {
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+	//2x2 block form, m = [A B; C D], see "Fast 4x4 Matrix Inverse with SSE SIMD" by Eric Zhang
+#define HSM_SWIZZLE(v, x, y, z, w) _mm_shuffle_ps(v, v, _MM_SHUFFLE(w, z, y, x))
+#define HSM_SHUFFLE(v1, v2, x, y, z, w) _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(w, z, y, x))
+	struct Mat2 {
+		//A * B
+		static __m128 Mul(__m128 a, __m128 b) {
+			return _mm_add_ps(_mm_mul_ps(a, HSM_SWIZZLE(b, 0, 3, 0, 3)),
+				              _mm_mul_ps(HSM_SWIZZLE(a, 1, 0, 3, 2), HSM_SWIZZLE(b, 2, 1, 2, 1)));
+		}
+		//adj(A) * B
+		static __m128 AdjMul(__m128 a, __m128 b) {
+			return _mm_sub_ps(_mm_mul_ps(HSM_SWIZZLE(a, 3, 3, 0, 0), b),
+				              _mm_mul_ps(HSM_SWIZZLE(a, 1, 1, 2, 2), HSM_SWIZZLE(b, 2, 3, 0, 1)));
+		}
+		//A * adj(B)
+		static __m128 MulAdj(__m128 a, __m128 b) {
+			return _mm_sub_ps(_mm_mul_ps(a, HSM_SWIZZLE(b, 3, 0, 3, 0)),
+				              _mm_mul_ps(HSM_SWIZZLE(a, 1, 0, 3, 2), HSM_SWIZZLE(b, 2, 1, 2, 1)));
+		}
+	};
+	__m128 r0 = _mm_loadu_ps(m[0]), r1 = _mm_loadu_ps(m[1]);
+	__m128 r2 = _mm_loadu_ps(m[2]), r3 = _mm_loadu_ps(m[3]);
+	__m128 A = _mm_movelh_ps(r0, r1), B = _mm_movehl_ps(r1, r0);
+	__m128 C = _mm_movelh_ps(r2, r3), D = _mm_movehl_ps(r3, r2);
+
+	//(|A|, |B|, |C|, |D|)
+	__m128 detSub = _mm_sub_ps(_mm_mul_ps(HSM_SHUFFLE(r0, r2, 0, 2, 0, 2), HSM_SHUFFLE(r1, r3, 1, 3, 1, 3)),
+		                       _mm_mul_ps(HSM_SHUFFLE(r0, r2, 1, 3, 1, 3), HSM_SHUFFLE(r1, r3, 0, 2, 0, 2)));
+	__m128 detA = HSM_SWIZZLE(detSub, 0, 0, 0, 0), detB = HSM_SWIZZLE(detSub, 1, 1, 1, 1);
+	__m128 detC = HSM_SWIZZLE(detSub, 2, 2, 2, 2), detD = HSM_SWIZZLE(detSub, 3, 3, 3, 3);
+
+	__m128 DC = Mat2::AdjMul(D, C);
+	__m128 AB = Mat2::AdjMul(A, B);
+	__m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), Mat2::Mul(B, DC));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), Mat2::Mul(C, AB));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), Mat2::MulAdj(D, AB));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), Mat2::MulAdj(A, DC));
+
+	//|M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+	__m128 tr = _mm_mul_ps(AB, HSM_SWIZZLE(DC, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, HSM_SWIZZLE(tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, HSM_SWIZZLE(tr, 1, 0, 3, 2));
+	__m128 detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+
+	__m128 rDetM = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), detM);
+	X = _mm_mul_ps(X, rDetM);
+	Y = _mm_mul_ps(Y, rDetM);
+	Z = _mm_mul_ps(Z, rDetM);
+	W = _mm_mul_ps(W, rDetM);
+	_mm_storeu_ps(r[0], HSM_SHUFFLE(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(r[1], HSM_SHUFFLE(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(r[2], HSM_SHUFFLE(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(r[3], HSM_SHUFFLE(Z, W, 2, 0, 2, 0));
+#undef HSM_SWIZZLE
+#undef HSM_SHUFFLE
+	return _mm_cvtss_f32(detM);
+#else
+	//2x2 sub-determinants of the upper (s) and lower (c) two rows
+	Float s0 = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+	Float s1 = m[0][0] * m[1][2] - m[0][2] * m[1][0];
+	Float s2 = m[0][0] * m[1][3] - m[0][3] * m[1][0];
+	Float s3 = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+	Float s4 = m[0][1] * m[1][3] - m[0][3] * m[1][1];
+	Float s5 = m[0][2] * m[1][3] - m[0][3] * m[1][2];
+	Float c0 = m[2][0] * m[3][1] - m[2][1] * m[3][0];
+	Float c1 = m[2][0] * m[3][2] - m[2][2] * m[3][0];
+	Float c2 = m[2][0] * m[3][3] - m[2][3] * m[3][0];
+	Float c3 = m[2][1] * m[3][2] - m[2][2] * m[3][1];
+	Float c4 = m[2][1] * m[3][3] - m[2][3] * m[3][1];
+	Float c5 = m[2][2] * m[3][3] - m[2][3] * m[3][2];
+	Float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+	Float invDet = 1 / det;
+	Float t[4][4] = {
+		{ ( m[1][1] * c5 - m[1][2] * c4 + m[1][3] * c3) * invDet, (-m[0][1] * c5 + m[0][2] * c4 - m[0][3] * c3) * invDet,
+		  ( m[3][1] * s5 - m[3][2] * s4 + m[3][3] * s3) * invDet, (-m[2][1] * s5 + m[2][2] * s4 - m[2][3] * s3) * invDet },
+		{ (-m[1][0] * c5 + m[1][2] * c2 - m[1][3] * c1) * invDet, ( m[0][0] * c5 - m[0][2] * c2 + m[0][3] * c1) * invDet,
+		  (-m[3][0] * s5 + m[3][2] * s2 - m[3][3] * s1) * invDet, ( m[2][0] * s5 - m[2][2] * s2 + m[2][3] * s1) * invDet },
+		{ ( m[1][0] * c4 - m[1][1] * c2 + m[1][3] * c0) * invDet, (-m[0][0] * c4 + m[0][1] * c2 - m[0][3] * c0) * invDet,
+		  ( m[3][0] * s4 - m[3][1] * s2 + m[3][3] * s0) * invDet, (-m[2][0] * s4 + m[2][1] * s2 - m[2][3] * s0) * invDet },
+		{ (-m[1][0] * c3 + m[1][1] * c1 - m[1][2] * c0) * invDet, ( m[0][0] * c3 - m[0][1] * c1 + m[0][2] * c0) * invDet,
+		  (-m[3][0] * s3 + m[3][1] * s1 - m[3][2] * s0) * invDet, ( m[2][0] * s3 - m[2][1] * s1 + m[2][2] * s0) * invDet }
+	};
+	memcpy(r, t, sizeof(Float) * 16);
+	return det;
+#endif
+}
+
+//Transforms count (x, y, z) triples by the upper 3x4 part of m, with the translation column
+//for points and an optional divide by the fourth row. out may be the same array as in.
+//m only needs three rows when project is false
+//Triples start stride Floats apart in both arrays, only their three Floats are written. A stride of
+//at least 4 lets the SSE path load a whole register per triple, e.g. the origins of an array of rays.
+inline void TransformBatch(const Float m[][4], bool point, bool project, const Float* in, Float* out, size_t count,
+	                       size_t stride = 3) {
+	assert(stride >= 3);
+	size_t i = 0;
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+#define HSM_SHUFFLE(v1, v2, x, y, z, w) _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(w, z, y, x))
+	const __m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]), m02 = _mm_set1_ps(m[0][2]), m03 = _mm_set1_ps(m[0][3]);
+	const __m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]), m13 = _mm_set1_ps(m[1][3]);
+	const __m128 m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]), m22 = _mm_set1_ps(m[2][2]), m23 = _mm_set1_ps(m[2][3]);
+	const Float* last = project ? m[3] : m[0];
+	const __m128 m30 = _mm_set1_ps(last[0]), m31 = _mm_set1_ps(last[1]), m32 = _mm_set1_ps(last[2]), m33 = _mm_set1_ps(last[3]);
+	const bool packed = stride == 3;
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		if (packed) {
+			//a = (x0 y0 z0 x1), b = (y1 z1 x2 y2), c = (z2 x3 y3 z3)
+			__m128 a = _mm_loadu_ps(in + 3 * i), b = _mm_loadu_ps(in + 3 * i + 4), c = _mm_loadu_ps(in + 3 * i + 8);
+			x = HSM_SHUFFLE(HSM_SHUFFLE(a, a, 0, 0, 3, 3), HSM_SHUFFLE(b, c, 2, 2, 1, 1), 0, 2, 0, 2);
+			y = HSM_SHUFFLE(HSM_SHUFFLE(a, b, 1, 1, 0, 0), HSM_SHUFFLE(b, c, 3, 3, 2, 2), 0, 2, 0, 2);
+			z = HSM_SHUFFLE(HSM_SHUFFLE(a, b, 2, 2, 1, 1), HSM_SHUFFLE(c, c, 0, 0, 3, 3), 0, 2, 0, 2);
+		} else {
+			//the fourth Float of every load belongs to the same or the next element, so it stays inside in
+			const Float* src = in + stride * i;
+			__m128 w = _mm_loadu_ps(src + 3 * stride);
+			x = _mm_loadu_ps(src);
+			y = _mm_loadu_ps(src + stride);
+			z = _mm_loadu_ps(src + 2 * stride);
+			_MM_TRANSPOSE4_PS(x, y, z, w);
+		}
+		__m128 ox = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m01, y)), _mm_mul_ps(m02, z));
+		__m128 oy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, x), _mm_mul_ps(m11, y)), _mm_mul_ps(m12, z));
+		__m128 oz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, x), _mm_mul_ps(m21, y)), _mm_mul_ps(m22, z));
+		if (point) {
+			ox = _mm_add_ps(ox, m03);
+			oy = _mm_add_ps(oy, m13);
+			oz = _mm_add_ps(oz, m23);
+		}
+		if (project) {
+			__m128 ow = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m30, x), _mm_mul_ps(m31, y)), _mm_mul_ps(m32, z)), m33);
+			__m128 inverse = _mm_div_ps(_mm_set1_ps(1.0f), ow);
+			ox = _mm_mul_ps(ox, inverse);
+			oy = _mm_mul_ps(oy, inverse);
+			oz = _mm_mul_ps(oz, inverse);
+		}
+		if (packed) {
+			_mm_storeu_ps(out + 3 * i, HSM_SHUFFLE(HSM_SHUFFLE(ox, oy, 0, 0, 0, 0), HSM_SHUFFLE(oz, ox, 0, 0, 1, 1), 0, 2, 0, 2));
+			_mm_storeu_ps(out + 3 * i + 4, HSM_SHUFFLE(HSM_SHUFFLE(oy, oz, 1, 1, 1, 1), HSM_SHUFFLE(ox, oy, 2, 2, 2, 2), 0, 2, 0, 2));
+			_mm_storeu_ps(out + 3 * i + 8, HSM_SHUFFLE(HSM_SHUFFLE(oz, ox, 2, 2, 3, 3), HSM_SHUFFLE(oy, oz, 3, 3, 3, 3), 0, 2, 0, 2));
+		} else {
+			//back to one (x y z _) register per element, the fourth lane is not stored
+			__m128 ow = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(ox, oy, oz, ow);
+			Float* dst = out + stride * i;
+			const __m128 rows[4] = { ox, oy, oz, ow };
+			for (int k = 0; k < 4; ++k, dst += stride) {
+				_mm_storel_pi((__m64*)dst, rows[k]);
+				_mm_store_ss(dst + 2, _mm_movehl_ps(rows[k], rows[k]));
+			}
+		}
+	}
+#undef HSM_SHUFFLE
+#endif
+	for (; i < count; ++i) {
+		const Float* src = in + stride * i;
+		Float x = src[0], y = src[1], z = src[2];
+		Float ox = m[0][0] * x + m[0][1] * y + m[0][2] * z;
+		Float oy = m[1][0] * x + m[1][1] * y + m[1][2] * z;
+		Float oz = m[2][0] * x + m[2][1] * y + m[2][2] * z;
+		if (point) {
+			ox += m[0][3];
+			oy += m[1][3];
+			oz += m[2][3];
+		}
+		if (project) {
+			Float inverse = (Float)1 / (m[3][0] * x + m[3][1] * y + m[3][2] * z + m[3][3]);
+			ox *= inverse;
+			oy *= inverse;
+			oz *= inverse;
+		}
+		Float* dst = out + stride * i;
+		dst[0] = ox;
+		dst[1] = oy;
+		dst[2] = oz;
+	}
+}
+
+//Writes the empty box of Bounds3f() for an empty box b, Arvo's sums would turn it into a finite box
+//around everything. Returns whether b was empty.
+inline bool StoreIfEmpty(const Float* b, Float* o) {
+	if (!(b[0] > b[3] || b[1] > b[4] || b[2] > b[5])) return false;
+	o[0] = o[1] = o[2] = std::numeric_limits<Float>::max();
+	o[3] = o[4] = o[5] = std::numeric_limits<Float>::lowest();
+	return true;
+}
+
+//Arvo's method for the bounds of transformed boxes: every product of a matrix element with the low
+//and high coordinate contributes its smaller one to the new minimum and its larger one to the maximum.
+//The sums run in the same order as a point transform, so the result contains every transformed point.
+//m is affine (only three rows are read), boxes are packed as (min xyz, max xyz), out may alias in.
+inline void TransformBoundsBatch(const Float m[][4], const Float* in, Float* out, size_t count) {
+	size_t i = 0;
+#if !defined(USE_DOUBLE) && defined(HSM_SSE)
+	//columns of m, the unused fourth lane stays zero
+	const __m128 c0 = _mm_set_ps(0.0f, m[2][0], m[1][0], m[0][0]), c1 = _mm_set_ps(0.0f, m[2][1], m[1][1], m[0][1]);
+	const __m128 c2 = _mm_set_ps(0.0f, m[2][2], m[1][2], m[0][2]), c3 = _mm_set_ps(0.0f, m[2][3], m[1][3], m[0][3]);
+	for (; i < count; ++i) {
+		const Float* b = in + 6 * i;
+		if (StoreIfEmpty(b, out + 6 * i)) continue;
+		__m128 a = _mm_mul_ps(c0, _mm_set1_ps(b[0])), c = _mm_mul_ps(c0, _mm_set1_ps(b[3]));
+		__m128 lo = _mm_min_ps(a, c), hi = _mm_max_ps(a, c);
+		a = _mm_mul_ps(c1, _mm_set1_ps(b[1]));
+		c = _mm_mul_ps(c1, _mm_set1_ps(b[4]));
+		lo = _mm_add_ps(lo, _mm_min_ps(a, c));
+		hi = _mm_add_ps(hi, _mm_max_ps(a, c));
+		a = _mm_mul_ps(c2, _mm_set1_ps(b[2]));
+		c = _mm_mul_ps(c2, _mm_set1_ps(b[5]));
+		lo = _mm_add_ps(_mm_add_ps(lo, _mm_min_ps(a, c)), c3);
+		hi = _mm_add_ps(_mm_add_ps(hi, _mm_max_ps(a, c)), c3);
+		//(lo0 lo1 lo2 hi0) and (hi1 hi2)
+		__m128 t = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(0, 0, 2, 2));
+		Float* o = out + 6 * i;
+		_mm_storeu_ps(o, _mm_shuffle_ps(lo, t, _MM_SHUFFLE(2, 0, 1, 0)));
+		_mm_storel_pi(reinterpret_cast<__m64*>(o + 4), _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(3, 3, 2, 1)));
+	}
+#elif defined(USE_DOUBLE) && defined(HSM_AVX)
+	const __m256d c0 = _mm256_set_pd(0.0, m[2][0], m[1][0], m[0][0]), c1 = _mm256_set_pd(0.0, m[2][1], m[1][1], m[0][1]);
+	const __m256d c2 = _mm256_set_pd(0.0, m[2][2], m[1][2], m[0][2]), c3 = _mm256_set_pd(0.0, m[2][3], m[1][3], m[0][3]);
+	const __m256i xyz = _mm256_set_epi64x(0, -1, -1, -1);
+	for (; i < count; ++i) {
+		const Float* b = in + 6 * i;
+		if (StoreIfEmpty(b, out + 6 * i)) continue;
+		__m256d a = _mm256_mul_pd(c0, _mm256_set1_pd(b[0])), c = _mm256_mul_pd(c0, _mm256_set1_pd(b[3]));
+		__m256d lo = _mm256_min_pd(a, c), hi = _mm256_max_pd(a, c);
+		a = _mm256_mul_pd(c1, _mm256_set1_pd(b[1]));
+		c = _mm256_mul_pd(c1, _mm256_set1_pd(b[4]));
+		lo = _mm256_add_pd(lo, _mm256_min_pd(a, c));
+		hi = _mm256_add_pd(hi, _mm256_max_pd(a, c));
+		a = _mm256_mul_pd(c2, _mm256_set1_pd(b[2]));
+		c = _mm256_mul_pd(c2, _mm256_set1_pd(b[5]));
+		lo = _mm256_add_pd(_mm256_add_pd(lo, _mm256_min_pd(a, c)), c3);
+		hi = _mm256_add_pd(_mm256_add_pd(hi, _mm256_max_pd(a, c)), c3);
+		_mm256_maskstore_pd(out + 6 * i, xyz, lo);
+		_mm256_maskstore_pd(out + 6 * i + 3, xyz, hi);
+	}
+#endif
+	for (; i < count; ++i) {
+		const Float* b = in + 6 * i;
+		if (StoreIfEmpty(b, out + 6 * i)) continue;
+		Float lo[3], hi[3];
+		for (int r = 0; r < 3; ++r) {
+			Float a = m[r][0] * b[0], c = m[r][0] * b[3];
+			lo[r] = std::min(a, c);
+			hi[r] = std::max(a, c);
+			a = m[r][1] * b[1];
+			c = m[r][1] * b[4];
+			lo[r] += std::min(a, c);
+			hi[r] += std::max(a, c);
+			a = m[r][2] * b[2];
+			c = m[r][2] * b[5];
+			lo[r] = lo[r] + std::min(a, c) + m[r][3];
+			hi[r] = hi[r] + std::max(a, c) + m[r][3];
+		}
+		Float* o = out + 6 * i;
+		o[0] = lo[0];
+		o[1] = lo[1];
+		o[2] = lo[2];
+		o[3] = hi[0];
+		o[4] = hi[1];
+		o[5] = hi[2];
+	}
+}
+
+}
+
+//Aligned allocator, keeps SIMD loads inside one cache line
+template <typename T, size_t Alignment = 64>
+class AlignedAllocator {
+public:
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t n) {
+		//the original pointer is stored right before the aligned block
+		void* raw = ::operator new(n * sizeof(T) + Alignment + sizeof(void*));
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	void deallocate(T* p, size_t) {
+		if (p) ::operator delete(reinterpret_cast<void**>(p)[-1]);
+	}
+
+	template <typename U>
+	bool operator == (const AlignedAllocator<U, Alignment>&) const { return true; }
+	template <typename U>
+	bool operator != (const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+//Structure of arrays for three-dimensional points or vectors
+template <typename V>
+class SoA3 {
+public:
+	//public methods
+	SoA3() {}
+	explicit SoA3(size_t n) { Resize(n); }
+	SoA3(const V* aos, size_t n) { FromAoS(aos, n); }
+
+	inline size_t Size() const { return x.size(); }
+
+	void Resize(size_t n) {
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+	}
+
+	V operator [](size_t i) const {
+		assert(i < Size());
+		return V(x[i], y[i], z[i]);
+	}
+
+	void Set(size_t i, const V& v) {
+		assert(i < Size());
+		x[i] = v.x;
+		y[i] = v.y;
+		z[i] = v.z;
+	}
+
+	void FromAoS(const V* aos, size_t n) {
+		Resize(n);
+		for (size_t i = 0; i < n; ++i) Set(i, aos[i]);
+	}
+
+	void ToAoS(V* aos) const {
+		for (size_t i = 0; i < Size(); ++i) aos[i] = (*this)[i];
+	}
+
+	//public data
+	AlignedVector<Float> x, y, z;
+};
+
+typedef SoA3<Vector3f> Vector3SoA;
+typedef SoA3<Point3f> Point3SoA;
+
+//Boxes as two point arrays, the layout batched box tests stream through.
+class Bounds3SoA {
+public:
+	//public methods
+	Bounds3SoA() {}
+	explicit Bounds3SoA(size_t n) { Resize(n); }
+	Bounds3SoA(const Bounds3f* aos, size_t n) { FromAoS(aos, n); }
+
+	inline size_t Size() const { return pMin.Size(); }
+
+	void Resize(size_t n) {
+		pMin.Resize(n);
+		pMax.Resize(n);
+	}
+
+	Bounds3f operator [](size_t i) const {
+		assert(i < Size());
+		return Bounds3f(pMin[i], pMax[i]);
+	}
+
+	void Set(size_t i, const Bounds3f& b) {
+		assert(i < Size());
+		pMin.Set(i, b.pMin);
+		pMax.Set(i, b.pMax);
+	}
+
+	void FromAoS(const Bounds3f* aos, size_t n) {
+		Resize(n);
+		for (size_t i = 0; i < n; ++i) Set(i, aos[i]);
+	}
+
+	void ToAoS(Bounds3f* aos) const {
+		for (size_t i = 0; i < Size(); ++i) aos[i] = (*this)[i];
+	}
+
+	//public data
+	Point3SoA pMin, pMax;
+};
+
+//Bulk operations, SoA outputs are resized and may be the same container as an input,
+//Float outputs must hold Size() values.
+inline void Dot(const Vector3SoA& v1, const Vector3SoA& v2, Float* out) {
+	assert(v1.Size() == v2.Size());
+	simd::ForEach(v1.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P d = simd::Load<P>(&v1.x[i]) * simd::Load<P>(&v2.x[i]) + simd::Load<P>(&v1.y[i]) * simd::Load<P>(&v2.y[i]) +
+			  simd::Load<P>(&v1.z[i]) * simd::Load<P>(&v2.z[i]);
+		simd::Store(&out[i], d);
+	});
+}
+
+inline void Cross(const Vector3SoA& v1, const Vector3SoA& v2, Vector3SoA& out) {
+	assert(v1.Size() == v2.Size());
+	out.Resize(v1.Size());
+	simd::ForEach(v1.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x1 = simd::Load<P>(&v1.x[i]), y1 = simd::Load<P>(&v1.y[i]), z1 = simd::Load<P>(&v1.z[i]);
+		P x2 = simd::Load<P>(&v2.x[i]), y2 = simd::Load<P>(&v2.y[i]), z2 = simd::Load<P>(&v2.z[i]);
+		simd::Store(&out.x[i], (y1 * z2) - (z1 * y2));
+		simd::Store(&out.y[i], (z1 * x2) - (x1 * z2));
+		simd::Store(&out.z[i], (x1 * y2) - (y1 * x2));
+	});
+}
+
+inline void Length(const Vector3SoA& v, Float* out) {
+	simd::ForEach(v.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x = simd::Load<P>(&v.x[i]), y = simd::Load<P>(&v.y[i]), z = simd::Load<P>(&v.z[i]);
+		simd::Store(&out[i], simd::Sqrt(x * x + y * y + z * z));
+	});
+}
+
+inline void Normalize(const Vector3SoA& v, Vector3SoA& out) {
+	out.Resize(v.Size());
+	simd::ForEach(v.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x = simd::Load<P>(&v.x[i]), y = simd::Load<P>(&v.y[i]), z = simd::Load<P>(&v.z[i]);
+		P inverse = simd::RSqrt(x * x + y * y + z * z);
+		simd::Store(&out.x[i], x * inverse);
+		simd::Store(&out.y[i], y * inverse);
+		simd::Store(&out.z[i], z * inverse);
+	});
+}
+
+//Stays in Float, Point3::Distance goes through std::pow and may differ in the last bit.
+inline void Distance(const Point3SoA& p1, const Point3SoA& p2, Float* out) {
+	assert(p1.Size() == p2.Size());
+	simd::ForEach(p1.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P dx = simd::Load<P>(&p1.x[i]) - simd::Load<P>(&p2.x[i]);
+		P dy = simd::Load<P>(&p1.y[i]) - simd::Load<P>(&p2.y[i]);
+		P dz = simd::Load<P>(&p1.z[i]) - simd::Load<P>(&p2.z[i]);
+		simd::Store(&out[i], simd::Sqrt(dx * dx + dy * dy + dz * dz));
+	});
+}
+
+template <typename V>
+inline void Lerp(Float t, const SoA3<V>& p0, const SoA3<V>& p1, SoA3<V>& out) {
+	assert(p0.Size() == p1.Size());
+	out.Resize(p0.Size());
+	simd::ForEach(p0.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P t0 = P(1 - t), t1 = P(t);
+		simd::Store(&out.x[i], t0 * simd::Load<P>(&p0.x[i]) + t1 * simd::Load<P>(&p1.x[i]));
+		simd::Store(&out.y[i], t0 * simd::Load<P>(&p0.y[i]) + t1 * simd::Load<P>(&p1.y[i]));
+		simd::Store(&out.z[i], t0 * simd::Load<P>(&p0.z[i]) + t1 * simd::Load<P>(&p1.z[i]));
+	});
+}
+
+#define HSM_SOA_UNARY(Name)                                                  \
+template <typename V>                                                        \
+inline void Name(const SoA3<V>& v, SoA3<V>& out) {                           \
+	out.Resize(v.Size());                                                    \
+	simd::ForEach(v.Size(), [&](size_t i, auto pack) {                       \
+		typedef decltype(pack) P;                                            \
+		simd::Store(&out.x[i], simd::Name(simd::Load<P>(&v.x[i])));        \
+		simd::Store(&out.y[i], simd::Name(simd::Load<P>(&v.y[i])));        \
+		simd::Store(&out.z[i], simd::Name(simd::Load<P>(&v.z[i])));        \
+	});                                                                      \
+}
+HSM_SOA_UNARY(Abs)
+HSM_SOA_UNARY(Floor)
+HSM_SOA_UNARY(Ceil)
+#undef HSM_SOA_UNARY
+
+//Batched samplers over count pairs of uniform samples u0[i], u1[i]
+inline void SampleUniformDiskConcentric(const Float* u0, const Float* u1, size_t count, Float* x, Float* y) {
+	simd::ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P px, py;
+		simd::ConcentricDisk(simd::Load<P>(&u0[i]), simd::Load<P>(&u1[i]), px, py);
+		simd::Store(&x[i], px);
+		simd::Store(&y[i], py);
+	});
+}
+
+inline void SampleUniformSphere(const Float* u0, const Float* u1, size_t count, Vector3SoA& out) {
+	out.Resize(count);
+	simd::ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x, y, z;
+		simd::UniformSphere(simd::Load<P>(&u0[i]), simd::Load<P>(&u1[i]), x, y, z);
+		simd::Store(&out.x[i], x);
+		simd::Store(&out.y[i], y);
+		simd::Store(&out.z[i], z);
+	});
+}
+
+inline void SampleUniformHemisphere(const Float* u0, const Float* u1, size_t count, Vector3SoA& out) {
+	out.Resize(count);
+	simd::ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x, y, z;
+		simd::UniformHemisphere(simd::Load<P>(&u0[i]), simd::Load<P>(&u1[i]), x, y, z);
+		simd::Store(&out.x[i], x);
+		simd::Store(&out.y[i], y);
+		simd::Store(&out.z[i], z);
+	});
+}
+
+inline void SampleCosineHemisphere(const Float* u0, const Float* u1, size_t count, Vector3SoA& out, Float* pdf = nullptr) {
+	out.Resize(count);
+	simd::ForEach(count, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P x, y, z;
+		simd::CosineHemisphere(simd::Load<P>(&u0[i]), simd::Load<P>(&u1[i]), x, y, z);
+		simd::Store(&out.x[i], x);
+		simd::Store(&out.y[i], y);
+		simd::Store(&out.z[i], z);
+		if (pdf) simd::Store(&pdf[i], z * P(InvPi));
+	});
+}
+
+//Ray packets
+//N rays in structure of arrays form with the inverse direction precomputed
+template <int N>
+class RayPacket {
+public:
+	//public methods
+	RayPacket() {}
+	RayPacket(const Ray* rays, Float tMax = Infinity) {
+		for (int i = 0; i < N; ++i) Set(i, rays[i], tMax);
+	}
+
+	void Set(int i, const Ray& r, Float tMax = Infinity) {
+		assert(i >= 0 && i < N);
+		ox[i] = r.origin.x;
+		oy[i] = r.origin.y;
+		oz[i] = r.origin.z;
+		dx[i] = r.direction.x;
+		dy[i] = r.direction.y;
+		dz[i] = r.direction.z;
+		invDx[i] = 1 / r.direction.x;
+		invDy[i] = 1 / r.direction.y;
+		invDz[i] = 1 / r.direction.z;
+		this->tMax[i] = tMax;
+		time[i] = r.time;
+		//from the inverse like PrecomputedRay, so that -0 counts as negative like its -infinity
+		const Float inverse[3] = { invDx[i], invDy[i], invDz[i] };
+		for (int axis = 0; axis < 3; ++axis) {
+			if (inverse[axis] < 0) sign[axis] |= 1 << i;
+			else sign[axis] &= ~(1 << i);
+		}
+	}
+
+	Ray Get(int i) const {
+		assert(i >= 0 && i < N);
+		return Ray(Point3f(ox[i], oy[i], oz[i]), Vector3f(dx[i], dy[i], dz[i]), time[i]);
+	}
+
+	//public data
+	alignas(32) Float ox[N], oy[N], oz[N];
+	alignas(32) Float dx[N], dy[N], dz[N];
+	alignas(32) Float invDx[N], invDy[N], invDz[N];
+	alignas(32) Float tMax[N], time[N];
+	//bit i is set when ray i points towards the negative side of the axis, -0 included
+	int sign[3] = { 0, 0, 0 };
+};
+
+typedef RayPacket<4> RayPacket4;
+typedef RayPacket<8> RayPacket8;
+
+//N boxes in structure of arrays form
+template <int N>
+class BoundsPacket {
+public:
+	//public methods
+	BoundsPacket() {}
+	BoundsPacket(const Bounds3f* bounds) {
+		for (int i = 0; i < N; ++i) Set(i, bounds[i]);
+	}
+
+	void Set(int i, const Bounds3f& b) {
+		assert(i >= 0 && i < N);
+		minX[i] = b.pMin.x;
+		minY[i] = b.pMin.y;
+		minZ[i] = b.pMin.z;
+		maxX[i] = b.pMax.x;
+		maxY[i] = b.pMax.y;
+		maxZ[i] = b.pMax.z;
+	}
+
+	Bounds3f Get(int i) const {
+		assert(i >= 0 && i < N);
+		return Bounds3f(Point3f(minX[i], minY[i], minZ[i]), Point3f(maxX[i], maxY[i], maxZ[i]));
+	}
+
+	//public data
+	alignas(32) Float minX[N], minY[N], minZ[N];
+	alignas(32) Float maxX[N], maxY[N], maxZ[N];
+};
+
+typedef BoundsPacket<4> BoundsPacket4;
+typedef BoundsPacket<8> BoundsPacket8;
+
+//Slab test of every ray of the packet against one box. Returns the mask of the rays that hit it,
+//tNear and tFar receive the clipped parametric range of every ray.
+template <int N>
+inline int Intersect(const RayPacket<N>& rays, const Bounds3f& b, Float* tNear, Float* tFar) {
+	int mask = 0;
+	simd::ForEach(N, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P n = P(0), f = simd::Load<P>(&rays.tMax[i]);
+		P ox = simd::Load<P>(&rays.ox[i]), invDx = simd::Load<P>(&rays.invDx[i]);
+		P t0 = (P(b.pMin.x) - ox) * invDx, t1 = (P(b.pMax.x) - ox) * invDx;
+		n = simd::Max(simd::Min(t0, t1), n);
+		f = simd::Min(simd::Max(t0, t1), f);
+		P oy = simd::Load<P>(&rays.oy[i]), invDy = simd::Load<P>(&rays.invDy[i]);
+		t0 = (P(b.pMin.y) - oy) * invDy;
+		t1 = (P(b.pMax.y) - oy) * invDy;
+		n = simd::Max(simd::Min(t0, t1), n);
+		f = simd::Min(simd::Max(t0, t1), f);
+		P oz = simd::Load<P>(&rays.oz[i]), invDz = simd::Load<P>(&rays.invDz[i]);
+		t0 = (P(b.pMin.z) - oz) * invDz;
+		t1 = (P(b.pMax.z) - oz) * invDz;
+		n = simd::Max(simd::Min(t0, t1), n);
+		f = simd::Min(simd::Max(t0, t1), f);
+		simd::Store(&tNear[i], n);
+		simd::Store(&tFar[i], f);
+		//n < tMax rejects a ray parallel to a slab and outside of it, whose near distance is infinite
+		mask |= (simd::MoveMask(n <= f) & simd::MoveMask(n < simd::Load<P>(&rays.tMax[i]))) << i;
+	});
+	return mask;
+}
+
+//Slab test of one ray against N boxes within [ray.tMin, ray.tMax], the cached signs pick the near and far planes
+//up front. NaN slabs drop out as in IntersectP.
+template <int N>
+inline int Intersect(const PrecomputedRay& ray, const BoundsPacket<N>& boxes, Float* tNear, Float* tFar) {
+	const Float* nearX = ray.sign[0] ? boxes.maxX : boxes.minX;
+	const Float* farX = ray.sign[0] ? boxes.minX : boxes.maxX;
+	const Float* nearY = ray.sign[1] ? boxes.maxY : boxes.minY;
+	const Float* farY = ray.sign[1] ? boxes.minY : boxes.maxY;
+	const Float* nearZ = ray.sign[2] ? boxes.maxZ : boxes.minZ;
+	const Float* farZ = ray.sign[2] ? boxes.minZ : boxes.maxZ;
+	Float invDx = ray.invDirection.x, invDy = ray.invDirection.y, invDz = ray.invDirection.z;
+	int mask = 0;
+	simd::ForEach(N, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P ox = P(ray.origin.x), oy = P(ray.origin.y), oz = P(ray.origin.z), tMax = P(ray.tMax);
+		P n = simd::Max((simd::Load<P>(&nearX[i]) - ox) * P(invDx), P(ray.tMin));
+		n = simd::Max((simd::Load<P>(&nearY[i]) - oy) * P(invDy), n);
+		n = simd::Max((simd::Load<P>(&nearZ[i]) - oz) * P(invDz), n);
+		P f = simd::Min((simd::Load<P>(&farX[i]) - ox) * P(invDx), tMax);
+		f = simd::Min((simd::Load<P>(&farY[i]) - oy) * P(invDy), f);
+		f = simd::Min((simd::Load<P>(&farZ[i]) - oz) * P(invDz), f);
+		simd::Store(&tNear[i], n);
+		simd::Store(&tFar[i], f);
+		mask |= (simd::MoveMask(n <= f) & simd::MoveMask(n < tMax)) << i;
+	});
+	return mask;
+}
+
+#if !defined(USE_DOUBLE) && defined(HSM_AVX)
+//Four lanes only fill half of an AVX pack, through ForEach they would all run in the scalar tail.
+//Same steps as the templates above on SSE registers.
+inline int Intersect(const RayPacket<4>& rays, const Bounds3f& b, Float* tNear, Float* tFar) {
+	__m128 tMax = _mm_load_ps(rays.tMax);
+	__m128 n = _mm_setzero_ps(), f = tMax;
+	__m128 ox = _mm_load_ps(rays.ox), invDx = _mm_load_ps(rays.invDx);
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMin.x), ox), invDx), t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMax.x), ox), invDx);
+	n = _mm_max_ps(_mm_min_ps(t0, t1), n);
+	f = _mm_min_ps(_mm_max_ps(t0, t1), f);
+	__m128 oy = _mm_load_ps(rays.oy), invDy = _mm_load_ps(rays.invDy);
+	t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMin.y), oy), invDy);
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMax.y), oy), invDy);
+	n = _mm_max_ps(_mm_min_ps(t0, t1), n);
+	f = _mm_min_ps(_mm_max_ps(t0, t1), f);
+	__m128 oz = _mm_load_ps(rays.oz), invDz = _mm_load_ps(rays.invDz);
+	t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMin.z), oz), invDz);
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pMax.z), oz), invDz);
+	n = _mm_max_ps(_mm_min_ps(t0, t1), n);
+	f = _mm_min_ps(_mm_max_ps(t0, t1), f);
+	_mm_storeu_ps(tNear, n);
+	_mm_storeu_ps(tFar, f);
+	return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(n, f), _mm_cmplt_ps(n, tMax)));
+}
+
+inline int Intersect(const PrecomputedRay& ray, const BoundsPacket<4>& boxes, Float* tNear, Float* tFar) {
+	__m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z), tMax = _mm_set1_ps(ray.tMax);
+	__m128 invDx = _mm_set1_ps(ray.invDirection.x), invDy = _mm_set1_ps(ray.invDirection.y), invDz = _mm_set1_ps(ray.invDirection.z);
+	__m128 n = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[0] ? boxes.maxX : boxes.minX), ox), invDx), _mm_set1_ps(ray.tMin));
+	n = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[1] ? boxes.maxY : boxes.minY), oy), invDy), n);
+	n = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[2] ? boxes.maxZ : boxes.minZ), oz), invDz), n);
+	__m128 f = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[0] ? boxes.minX : boxes.maxX), ox), invDx), tMax);
+	f = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[1] ? boxes.minY : boxes.maxY), oy), invDy), f);
+	f = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(ray.sign[2] ? boxes.minZ : boxes.maxZ), oz), invDz), f);
+	_mm_storeu_ps(tNear, n);
+	_mm_storeu_ps(tFar, f);
+	return _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(n, f), _mm_cmplt_ps(n, tMax)));
+}
+#endif
+
+template <int N>
+inline int Intersect(const Ray& ray, const BoundsPacket<N>& boxes, Float* tNear, Float* tFar, Float tMax = Infinity) {
+	return Intersect(PrecomputedRay(ray, 0, tMax), boxes, tNear, tFar);
+}
+
+//Ray-primitive intersection
+//Permutation and shear that turn a ray into the +z axis through the origin, computed once per ray
+//for the watertight triangle test (Woop, Benthin and Wald 2013).
+class WatertightRay {
+public:
+	//public methods
+	explicit WatertightRay(const Ray& ray) {
+		kz = MaxDimension(ray.direction.Abs());
+		kx = kz == 2 ? 0 : kz + 1;
+		ky = kx == 2 ? 0 : kx + 1;
+		//keeps the winding, so the sign of the edge functions does not depend on the ray
+		if (ray.direction[kz] < 0) std::swap(kx, ky);
+		sz = 1 / ray.direction[kz];
+		sx = ray.direction[kx] * sz;
+		sy = ray.direction[ky] * sz;
+		ox = ray.origin[kx];
+		oy = ray.origin[ky];
+		oz = ray.origin[kz];
+	}
+
+	//public data
+	int kx, ky, kz;
+	Float sx, sy, sz;
+	//origin in the permuted order
+	Float ox, oy, oz;
+};
+
+namespace simd {
+
+//Triangle kernels, P is Float or Pack and any argument may be a broadcast scalar, so the same code tests
+//one ray against many triangles or many rays against one triangle. They return the MoveMask bits of the
+//lanes with a hit in (0, tMax), t, u and v are written for every lane. u and v weight the second and
+//third vertex. Degenerate triangles and rays parallel to the plane give NaN and never hit.
+//A hit also needs t above the rounding error of its numerator, so a ray leaving the surface from an origin
+//of OffsetRayOrigin cannot hit it again. The bound is only computed for packs with a hit.
+
+//Bound on the rounding error of t of MollerTrumbore: the edges and s are one rounding off, q four and the
+//dot product adds four more.
+template <typename P>
+HSM_NOINLINE P MollerTrumboreTError(const P& e1x, const P& e1y, const P& e1z, const P& e2x, const P& e2y, const P& e2z,
+	                                const P& sx, const P& sy, const P& sz, const P& invDet) {
+	P qx = Abs(sy * e1z) + Abs(sz * e1y), qy = Abs(sz * e1x) + Abs(sx * e1z), qz = Abs(sx * e1y) + Abs(sy * e1x);
+	return P(Gamma(8)) * (Abs(e2x) * qx + Abs(e2y) * qy + Abs(e2z) * qz) * Abs(invDet);
+}
+
+//Bound on the rounding error of t of Watertight, from "Physically Based Rendering" 3.9.6 with z scaled by
+//sz after the sum, so the shear terms of x and y are bounded by |sx| maxZ and |sy| maxZ.
+template <typename P>
+HSM_NOINLINE P WatertightTError(const WatertightRay& r, const P& ax, const P& ay, const P& az, const P& bx, const P& by,
+	                            const P& bz, const P& cx, const P& cy, const P& cz, const P& e0, const P& e1, const P& e2,
+	                            const P& invDet) {
+	P maxX = Max(Max(Abs(ax), Abs(bx)), Abs(cx)), maxY = Max(Max(Abs(ay), Abs(by)), Abs(cy));
+	P maxZ = Max(Max(Abs(az), Abs(bz)), Abs(cz)), maxE = Max(Max(Abs(e0), Abs(e1)), Abs(e2));
+	P deltaX = P(Gamma(5)) * (maxX + P(std::abs(r.sx)) * maxZ), deltaY = P(Gamma(5)) * (maxY + P(std::abs(r.sy)) * maxZ);
+	P deltaZ = P(Gamma(3)) * maxZ;
+	P deltaE = P(2) * (P(Gamma(2)) * maxX * maxY + deltaY * maxX + deltaX * maxY);
+	return P(3) * (P(Gamma(3)) * maxE * maxZ + deltaE * maxZ + deltaZ * maxE) * Abs(P(r.sz) * invDet);
+}
+
+//Moller-Trumbore, edges and determinant per test, no precomputation. Hits exactly on a shared edge
+//may be missed by both triangles.
+template <typename P>
+HSM_INLINE int MollerTrumbore(P ox, P oy, P oz, P dx, P dy, P dz,
+	                          P ax, P ay, P az, P bx, P by, P bz, P cx, P cy, P cz,
+	                          P tMax, P& t, P& u, P& v) {
+	P e1x = bx - ax, e1y = by - ay, e1z = bz - az;
+	P e2x = cx - ax, e2y = cy - ay, e2z = cz - az;
+	//p = d x e2
+	P px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+	P invDet = P(1) / (e1x * px + e1y * py + e1z * pz);
+	P sx = ox - ax, sy = oy - ay, sz = oz - az;
+	//q = s x e1
+	P qx = sy * e1z - sz * e1y, qy = sz * e1x - sx * e1z, qz = sx * e1y - sy * e1x;
+	u = (sx * px + sy * py + sz * pz) * invDet;
+	v = (dx * qx + dy * qy + dz * qz) * invDet;
+	t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+	//a NaN in u or v reaches the last operand of the outer Min, which then returns it
+	int hit = MoveMask(Min(Min(u, v), P(1) - u - v) >= P(0)) & MoveMask(Min(t, tMax - t) > P(0));
+	if (hit) hit &= MoveMask(t > MollerTrumboreTError(e1x, e1y, e1z, e2x, e2y, e2z, sx, sy, sz, invDet));
+	return hit;
+}
+
+//Watertight test, the vertices are given in the permuted order of the ray (a[kx], a[ky], a[kz]).
+//A ray through a shared edge or vertex hits at least one of the triangles as long as the signs of the
+//edge functions are right. In float, edge functions within the rounding error of their products, which
+//also covers a product fused into an FMA by the compiler, are redone in double where the products are exact.
+//Double builds keep Woop's test without that fallback.
+template <typename P>
+HSM_INLINE int Watertight(const WatertightRay& r, P ax, P ay, P az, P bx, P by, P bz, P cx, P cy, P cz,
+	                      P tMax, P& t, P& u, P& v) {
+	P ox = P(r.ox), oy = P(r.oy), oz = P(r.oz), sx = P(r.sx), sy = P(r.sy), sz = P(r.sz);
+	az = az - oz;
+	bz = bz - oz;
+	cz = cz - oz;
+	ax = (ax - ox) - sx * az;
+	ay = (ay - oy) - sy * az;
+	bx = (bx - ox) - sx * bz;
+	by = (by - oy) - sy * bz;
+	cx = (cx - ox) - sx * cz;
+	cy = (cy - oy) - sy * cz;
+	P p0 = cx * by, q0 = cy * bx, p1 = ax * cy, q1 = ay * cx, p2 = bx * ay, q2 = by * ax;
+	P e0 = p0 - q0, e1 = p1 - q1, e2 = p2 - q2;
+#ifndef USE_DOUBLE
+	P bound = P(2 * std::numeric_limits<Float>::epsilon());
+	//strict, so that degenerate triangles with zero products do not take the slow path
+	int uncertain = MoveMask(Abs(e0) < bound * (Abs(p0) + Abs(q0))) | MoveMask(Abs(e1) < bound * (Abs(p1) + Abs(q1))) |
+		            MoveMask(Abs(e2) < bound * (Abs(p2) + Abs(q2)));
+	if (uncertain) {
+		const int Width = sizeof(P) / sizeof(Float);
+		Float x[3][Width], y[3][Width], e[3][Width];
+		Store(x[0], ax); Store(y[0], ay); Store(x[1], bx); Store(y[1], by); Store(x[2], cx); Store(y[2], cy);
+		Store(e[0], e0); Store(e[1], e1); Store(e[2], e2);
+		for (int j = 0; j < Width; ++j) {
+			if (!((uncertain >> j) & 1)) continue;
+			//float products are exact in double, the difference keeps its sign when rounded back to float
+			e[0][j] = (Float)((double)x[2][j] * y[1][j] - (double)y[2][j] * x[1][j]);
+			e[1][j] = (Float)((double)x[0][j] * y[2][j] - (double)y[0][j] * x[2][j]);
+			e[2][j] = (Float)((double)x[1][j] * y[0][j] - (double)y[1][j] * x[0][j]);
+		}
+		e0 = Load<P>(e[0]);
+		e1 = Load<P>(e[1]);
+		e2 = Load<P>(e[2]);
+	}
+#endif
+	int ge0 = MoveMask(e0 >= P(0)), ge1 = MoveMask(e1 >= P(0)), ge2 = MoveMask(e2 >= P(0));
+	int le0 = MoveMask(e0 <= P(0)), le1 = MoveMask(e1 <= P(0)), le2 = MoveMask(e2 <= P(0));
+	P invDet = P(1) / (e0 + e1 + e2);
+	t = (e0 * az + e1 * bz + e2 * cz) * sz * invDet;
+	u = e1 * invDet;
+	v = e2 * invDet;
+	//the edge functions share a sign inside, all zero makes the determinant zero and t NaN
+	int hit = ((ge0 & ge1 & ge2) | (le0 & le1 & le2)) & MoveMask(Min(t, tMax - t) > P(0));
+	if (hit) hit &= MoveMask(t > WatertightTError(r, ax, ay, az, bx, by, bz, cx, cy, cz, e0, e1, e2, invDet));
+	return hit;
+}
+
+}
+
+inline bool IntersectTriangle(const Ray& ray, const Point3f& p0, const Point3f& p1, const Point3f& p2, Float tMax,
+	                          Float& t, Float& u, Float& v) {
+	return simd::MollerTrumbore(ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z,
+		                        p0.x, p0.y, p0.z, p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, tMax, t, u, v) != 0;
+}
+
+inline bool IntersectTriangle(const WatertightRay& ray, const Point3f& p0, const Point3f& p1, const Point3f& p2, Float tMax,
+	                          Float& t, Float& u, Float& v) {
+	int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	return simd::Watertight(ray, p0[kx], p0[ky], p0[kz], p1[kx], p1[ky], p1[kz], p2[kx], p2[ky], p2[kz], tMax, t, u, v) != 0;
+}
+
+//Nearest hit in (0, tMax) with the sphere surface, the far one when the origin is inside. The discriminant
+//is computed from the distance of the center to the line (Haines et al. 2019), which keeps its precision
+//for small spheres far from the origin.
+inline bool IntersectSphere(const Ray& ray, const Point3f& center, Float radius, Float tMax, Float& t) {
+	Vector3f f = ray.origin - center;
+	Vector3f d = ray.direction;
+	Float a = Dot(d, d), b = -Dot(f, d), c = Dot(f, f) - radius * radius;
+	Vector3f l = f + (b / a) * d;
+	Float discriminant = a * (radius * radius - Dot(l, l));
+	if (discriminant < 0) return false;
+	//the root without cancellation first, the other one from the product of the roots
+	Float q = b + std::copysign(std::sqrt(discriminant), b);
+	Float t0 = c / q, t1 = q / a;
+	if (t0 > t1) std::swap(t0, t1);
+	if (t0 > 0 && t0 < tMax) t = t0;
+	else if (t1 > 0 && t1 < tMax) t = t1;
+	else return false;
+	return true;
+}
+
+//Plane as in Frustum, Dot(normal, p) + distance = 0. Both sides hit.
+inline bool IntersectPlane(const Ray& ray, const Vector4f& plane, Float tMax, Float& t) {
+	Vector3f normal(plane.x, plane.y, plane.z);
+	Float hit = -(Dot(normal, Vector3f(ray.origin)) + plane.w) / Dot(normal, ray.direction);
+	if (!(hit > 0 && hit < tMax)) return false;
+	t = hit;
+	return true;
+}
+
+//Hit point of a triangle test and its error, from the barycentric coordinates (1 - u - v, u, v) rather than
+//from ray.At(t), whose error grows with t. The result goes to OffsetRayOrigin for the next ray.
+inline Point3fi TriangleHitPoint(const Point3f& p0, const Point3f& p1, const Point3f& p2, Float u, Float v) {
+	Float b0 = 1 - u - v;
+	Point3f p = b0 * p0 + u * p1 + v * p2;
+	Vector3f error;
+	for (int i = 0; i < 3; ++i)
+		error[i] = Gamma(7) * (std::abs(b0 * p0[i]) + std::abs(u * p1[i]) + std::abs(v * p2[i]));
+	return Point3fi(p, error);
+}
+
+//Hit point of IntersectSphere projected back onto the sphere, which leaves the error of a few roundings of
+//the radius instead of the error of ray.At(t).
+inline Point3fi SphereHitPoint(const Ray& ray, Float t, const Point3f& center, Float radius) {
+	Vector3f d = ray.At(t) - center;
+	d *= radius / d.Length();
+	Point3f p = center + d;
+	Vector3f error;
+	for (int i = 0; i < 3; ++i) error[i] = Gamma(5) * std::abs(d[i]) + Gamma(1) * std::abs(p[i]);
+	return Point3fi(p, error);
+}
+
+//Triangles as three vertex arrays, the layout the batched tests stream through.
+class TriangleSoA {
+public:
+	//public methods
+	TriangleSoA() {}
+	explicit TriangleSoA(size_t n) { Resize(n); }
+	//Indexed mesh, triangle i is vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]].
+	TriangleSoA(const Point3f* vertices, const uint32_t* indices, size_t triangleCount) {
+		Resize(triangleCount);
+		for (size_t i = 0; i < triangleCount; ++i)
+			Set(i, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+	}
+
+	inline size_t Size() const { return p0.Size(); }
+
+	void Resize(size_t n) {
+		p0.Resize(n);
+		p1.Resize(n);
+		p2.Resize(n);
+	}
+
+	void Set(size_t i, const Point3f& a, const Point3f& b, const Point3f& c) {
+		assert(i < Size());
+		p0.Set(i, a);
+		p1.Set(i, b);
+		p2.Set(i, c);
+	}
+
+	Bounds3f GetBounds(size_t i) const {
+		assert(i < Size());
+		return Union(Bounds3f(p0[i], p1[i]), p2[i]);
+	}
+
+	//public data
+	Point3SoA p0, p1, p2;
+};
+
+//One ray against the triangles [begin, end), a pack of triangles per test. Returns the closest triangle hit
+//before tMax or -1, tMax, u and v receive its hit. The ray is copied into locals so that the broadcasts
+//stay out of the loop.
+inline int IntersectTriangles(const Ray& ray, const TriangleSoA& triangles, size_t begin, size_t end,
+	                          Float& tMax, Float& u, Float& v) {
+	assert(begin <= end && end <= triangles.Size());
+	Float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+	Float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+	Float closest = tMax, closestU = 0, closestV = 0;
+	int hit = -1;
+	const Point3SoA &a = triangles.p0, &b = triangles.p1, &c = triangles.p2;
+	simd::ForEach(end - begin, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		size_t k = begin + i;
+		P t, pu, pv;
+		int mask = simd::MollerTrumbore(P(ox), P(oy), P(oz), P(dx), P(dy), P(dz),
+			simd::Load<P>(&a.x[k]), simd::Load<P>(&a.y[k]), simd::Load<P>(&a.z[k]),
+			simd::Load<P>(&b.x[k]), simd::Load<P>(&b.y[k]), simd::Load<P>(&b.z[k]),
+			simd::Load<P>(&c.x[k]), simd::Load<P>(&c.y[k]), simd::Load<P>(&c.z[k]), P(closest), t, pu, pv);
+		if (!mask) return;
+		Float lt[sizeof(P) / sizeof(Float)], lu[sizeof(P) / sizeof(Float)], lv[sizeof(P) / sizeof(Float)];
+		simd::Store(lt, t);
+		simd::Store(lu, pu);
+		simd::Store(lv, pv);
+		for (int j = 0; mask; ++j, mask >>= 1) {
+			if ((mask & 1) && lt[j] < closest) {
+				closest = lt[j];
+				closestU = lu[j];
+				closestV = lv[j];
+				hit = (int)(k + j);
+			}
+		}
+	});
+	if (hit >= 0) {
+		tMax = closest;
+		u = closestU;
+		v = closestV;
+	}
+	return hit;
+}
+
+inline int IntersectTriangles(const WatertightRay& ray, const TriangleSoA& triangles, size_t begin, size_t end,
+	                          Float& tMax, Float& u, Float& v) {
+	assert(begin <= end && end <= triangles.Size());
+	auto axis = [](const Point3SoA& p, int k) { return k == 0 ? p.x.data() : (k == 1 ? p.y.data() : p.z.data()); };
+	const Float *ax = axis(triangles.p0, ray.kx), *ay = axis(triangles.p0, ray.ky), *az = axis(triangles.p0, ray.kz);
+	const Float *bx = axis(triangles.p1, ray.kx), *by = axis(triangles.p1, ray.ky), *bz = axis(triangles.p1, ray.kz);
+	const Float *cx = axis(triangles.p2, ray.kx), *cy = axis(triangles.p2, ray.ky), *cz = axis(triangles.p2, ray.kz);
+	WatertightRay r = ray;
+	Float closest = tMax, closestU = 0, closestV = 0;
+	int hit = -1;
+	simd::ForEach(end - begin, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		size_t k = begin + i;
+		P t, pu, pv;
+		int mask = simd::Watertight(r, simd::Load<P>(&ax[k]), simd::Load<P>(&ay[k]), simd::Load<P>(&az[k]),
+			simd::Load<P>(&bx[k]), simd::Load<P>(&by[k]), simd::Load<P>(&bz[k]),
+			simd::Load<P>(&cx[k]), simd::Load<P>(&cy[k]), simd::Load<P>(&cz[k]), P(closest), t, pu, pv);
+		if (!mask) return;
+		Float lt[sizeof(P) / sizeof(Float)], lu[sizeof(P) / sizeof(Float)], lv[sizeof(P) / sizeof(Float)];
+		simd::Store(lt, t);
+		simd::Store(lu, pu);
+		simd::Store(lv, pv);
+		for (int j = 0; mask; ++j, mask >>= 1) {
+			if ((mask & 1) && lt[j] < closest) {
+				closest = lt[j];
+				closestU = lu[j];
+				closestV = lv[j];
+				hit = (int)(k + j);
+			}
+		}
+	});
+	if (hit >= 0) {
+		tMax = closest;
+		u = closestU;
+		v = closestV;
+	}
+	return hit;
+}
+
+//Stops at the first triangle hit before tMax.
+inline bool IntersectTrianglesP(const Ray& ray, const TriangleSoA& triangles, size_t begin, size_t end, Float tMax) {
+	assert(begin <= end && end <= triangles.Size());
+	Float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+	Float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+	const Point3SoA &a = triangles.p0, &b = triangles.p1, &c = triangles.p2;
+	size_t packed = (end - begin) - (end - begin) % simd::Pack::Width;
+	auto test = [&](size_t k, auto pack) {
+		typedef decltype(pack) P;
+		P t, pu, pv;
+		return simd::MollerTrumbore(P(ox), P(oy), P(oz), P(dx), P(dy), P(dz),
+			simd::Load<P>(&a.x[k]), simd::Load<P>(&a.y[k]), simd::Load<P>(&a.z[k]),
+			simd::Load<P>(&b.x[k]), simd::Load<P>(&b.y[k]), simd::Load<P>(&b.z[k]),
+			simd::Load<P>(&c.x[k]), simd::Load<P>(&c.y[k]), simd::Load<P>(&c.z[k]), P(tMax), t, pu, pv) != 0;
+	};
+	for (size_t k = begin; k < begin + packed; k += simd::Pack::Width)
+		if (test(k, simd::Pack())) return true;
+	for (size_t k = begin + packed; k < end; ++k)
+		if (test(k, Float())) return true;
+	return false;
+}
+
+inline int IntersectTriangles(const Ray& ray, const TriangleSoA& triangles, Float& tMax, Float& u, Float& v) {
+	return IntersectTriangles(ray, triangles, 0, triangles.Size(), tMax, u, v);
+}
+
+inline int IntersectTriangles(const WatertightRay& ray, const TriangleSoA& triangles, Float& tMax, Float& u, Float& v) {
+	return IntersectTriangles(ray, triangles, 0, triangles.Size(), tMax, u, v);
+}
+
+//Batch of count rays against all the triangles. tMax holds the limit of every ray and receives the distance
+//of its hit, triangle receives the index or -1, u and v may be null.
+inline void IntersectTriangles(const Ray* rays, size_t count, const TriangleSoA& triangles, Float* tMax, int* triangle,
+	                           Float* u = nullptr, Float* v = nullptr) {
+	for (size_t i = 0; i < count; ++i) {
+		Float hu, hv;
+		triangle[i] = IntersectTriangles(rays[i], triangles, tMax[i], hu, hv);
+		if (triangle[i] >= 0 && u) u[i] = hu;
+		if (triangle[i] >= 0 && v) v[i] = hv;
+	}
+}
+
+//Watertight variant of the batch, the rays are set up once by the caller.
+inline void IntersectTriangles(const WatertightRay* rays, size_t count, const TriangleSoA& triangles, Float* tMax,
+	                           int* triangle, Float* u = nullptr, Float* v = nullptr) {
+	for (size_t i = 0; i < count; ++i) {
+		Float hu, hv;
+		triangle[i] = IntersectTriangles(rays[i], triangles, tMax[i], hu, hv);
+		if (triangle[i] >= 0 && u) u[i] = hu;
+		if (triangle[i] >= 0 && v) v[i] = hv;
+	}
+}
+
+//Every ray of the packet against one triangle. Returns the mask of the rays that hit it before their tMax,
+//t, u and v receive the hit of every ray.
+template <int N>
+inline int IntersectTriangle(const RayPacket<N>& rays, const Point3f& p0, const Point3f& p1, const Point3f& p2,
+	                         Float* t, Float* u, Float* v) {
+	int mask = 0;
+	simd::ForEach(N, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P pt, pu, pv;
+		int hit = simd::MollerTrumbore(simd::Load<P>(&rays.ox[i]), simd::Load<P>(&rays.oy[i]), simd::Load<P>(&rays.oz[i]),
+			simd::Load<P>(&rays.dx[i]), simd::Load<P>(&rays.dy[i]), simd::Load<P>(&rays.dz[i]),
+			P(p0.x), P(p0.y), P(p0.z), P(p1.x), P(p1.y), P(p1.z), P(p2.x), P(p2.y), P(p2.z),
+			simd::Load<P>(&rays.tMax[i]), pt, pu, pv);
+		simd::Store(&t[i], pt);
+		simd::Store(&u[i], pu);
+		simd::Store(&v[i], pv);
+		mask |= hit << i;
+	});
+	return mask;
+}
+
+//Matrix
+//R x C matrix, default constructed to identity. Matrix<4, 4, Float> is specialized below with the SIMD kernels.
+template<int R, int C, typename T = Float>
+class Matrix {
+public:
+	//public methods
+	constexpr Matrix() :data{} {
+		for (int i = 0; i < R && i < C; ++i) data[i][i] = 1;
+	}
+
+	//elements in row-major order
+	template<typename... Args>
+	constexpr Matrix(T d00, Args... rest) :data{ d00, (T)rest... } {
+		static_assert(sizeof...(Args) + 1 == R * C, "a matrix needs one value per element");
+	}
+
+	constexpr bool operator == (const Matrix<R, C, T>& mat) const {
+		for (int i = 0; i < R; ++i)
+			for (int j = 0; j < C; ++j) {
+				T d = data[i][j] - mat.data[i][j];
+				if (d > 1e-6 || d < -1e-6) return false;
+			}
+		return true;
+	}
+
+	constexpr bool operator != (const Matrix<R, C, T>& mat) const {
+		return !(*this == mat);
+	}
+
+	template<int K>
+	constexpr Matrix<R, K, T> operator * (const Matrix<C, K, T>& mat) const {
+		Matrix<R, K, T> result;
+		for (int i = 0; i < R; ++i)
+			for (int j = 0; j < K; ++j) {
+				T sum = data[i][0] * mat.data[0][j];
+				for (int k = 1; k < C; ++k) sum += data[i][k] * mat.data[k][j];
+				result.data[i][j] = sum;
+			}
+		return result;
+	}
+
+	constexpr Matrix<C, R, T> Transpose() const {
+		Matrix<C, R, T> result;
+		for (int i = 0; i < R; ++i)
+			for (int j = 0; j < C; ++j)
+				result.data[j][i] = data[i][j];
+		return result;
+	}
+
+	//Square matrices apply linearly. With one extra column (3x4) the last column is a translation,
+	//points are moved by it and vectors are not.
+	template<typename Kind>
+	constexpr Vector<R, T, Kind> operator()(const Vector<R, T, Kind>& v) const {
+		static_assert(C == R || C == R + 1, "only square and affine matrices transform vectors");
+		Vector<R, T, Kind> r;
+		for (int i = 0; i < R; ++i) {
+			T sum = data[i][0] * v[0];
+			for (int j = 1; j < R; ++j) sum += data[i][j] * v[j];
+			if (C > R && std::is_same<Kind, PointKind>::value) sum += data[i][C - 1];
+			r[i] = sum;
+		}
+		return r;
+	}
+
+	//public data
+	T data[R][C];
+};
+
+template<int R, int C, typename T>
+inline std::ostream& operator << (std::ostream& o, const Matrix<R, C, T>& mat) {
+	for (int i = 0; i < R; ++i) {
+		o << "[ " << mat.data[i][0];
+		for (int j = 1; j < C; ++j) o << " , " << mat.data[i][j];
+		o << " ]" << (i + 1 < R ? "\n" : "");
+	}
+	o << std::endl;
+	return o;
+}
+
+typedef Matrix<3, 3> Matrix3x3;
+typedef Matrix<3, 4> Matrix3x4;
+typedef Matrix<4, 4> Matrix4x4;
+
+//Matrix 4x4
+template<>
+class Matrix<4, 4, Float> {
+public:
+	//public methods
+	constexpr Matrix() :
+		data{ { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 0.0f, 1.0f } } {}
+
+	//Leaves the data uninitialized, for results that are overwritten completely.
+	struct NoInit {};
+	explicit Matrix(NoInit) {}
+
+	constexpr Matrix(Float d00, Float d01, Float d02, Float d03, Float d10, Float d11, Float d12, Float d13,
+		Float d20, Float d21, Float d22, Float d23, Float d30, Float d31, Float d32, Float d33) :
+		data{ { d00, d01, d02, d03 }, { d10, d11, d12, d13 }, { d20, d21, d22, d23 }, { d30, d31, d32, d33 } } {}
+
+	Matrix(Float mat[4][4]) {
+		memcpy(data, mat, sizeof(Float) * 16);
+	}
+
+	bool operator == (const Matrix4x4& mat) const {
+		for (int i = 0; i <= 3; ++i)
+			for (int j = 0; j <= 3; ++j)
+				if (std::abs(data[i][j] - mat.data[i][j]) > 1e-6)
+					return false;
+		return true;
+	}
+
+	bool operator != (const Matrix4x4& mat) const {
+		for (int i = 0; i <= 3; ++i)
+			for (int j = 0; j <= 3; ++j)
+				if (std::abs(data[i][j] - mat.data[i][j]) > 1e-6) 
+					return true;
+		return false;
+	}
+
+	constexpr Matrix4x4 operator * (const Matrix4x4& mat) const {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+		if (!HSM_IS_CONSTANT_EVALUATED()) {
+			Matrix4x4 result((NoInit()));
+			simd::MatMul4x4(data, mat.data, result.data);
+			return result;
+		}
+#endif
+		//same summation order as the SIMD kernel
+		Matrix4x4 result;
+		for (int i = 0; i < 4; ++i)
+			for (int j = 0; j < 4; ++j)
+				result.data[i][j] = data[i][0] * mat.data[0][j] + data[i][1] * mat.data[1][j] +
+				                    data[i][2] * mat.data[2][j] + data[i][3] * mat.data[3][j];
+		return result;
+	}
+
+	constexpr bool HasScale() const {
+#define NOT_ONE(x) ((x) < .999f || (x) > 1.001f)
+		return (NOT_ONE(data[0][0]) || NOT_ONE(data[1][1]) || NOT_ONE(data[2][2]));
+#undef NOT_ONE
+	}
+
+	constexpr Matrix4x4 Transpose() const {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+		if (!HSM_IS_CONSTANT_EVALUATED()) {
+			Matrix4x4 result((NoInit()));
+			simd::Transpose4x4(data, result.data);
+			return result;
+		}
+#endif
+		return Matrix4x4(data[0][0], data[1][0], data[2][0], data[3][0], data[0][1], data[1][1], data[2][1], data[3][1],
+			             data[0][2], data[1][2], data[2][2], data[3][2], data[0][3], data[1][3], data[2][3], data[3][3]);
+	}
+
+	//A singular matrix returns all NaN and clears *invertible, callers that pass no flag must not invert one.
+	Matrix4x4 Inverse(bool* invertible = nullptr) const {
+		Matrix4x4 result((NoInit()));
+		bool ok = simd::Inverse4x4(data, result.data) != 0;
+		assert(ok || invertible);
+		if (invertible) *invertible = ok;
+		if (!ok) std::fill(&result.data[0][0], &result.data[0][0] + 16, std::numeric_limits<Float>::quiet_NaN());
+		return result;
+	}
+
+	//Only valid when the last row is (0, 0, 0, 1). Singular matrices are reported like Inverse.
+	Matrix4x4 InverseAffine(bool* invertible = nullptr) const {
+		Float c00 = data[1][1] * data[2][2] - data[1][2] * data[2][1];
+		Float c01 = data[1][2] * data[2][0] - data[1][0] * data[2][2];
+		Float c02 = data[1][0] * data[2][1] - data[1][1] * data[2][0];
+		Float det = data[0][0] * c00 + data[0][1] * c01 + data[0][2] * c02;
+		assert(det != 0 || invertible);
+		if (invertible) *invertible = det != 0;
+		if (det == 0) {
+			Matrix4x4 result((NoInit()));
+			std::fill(&result.data[0][0], &result.data[0][0] + 16, std::numeric_limits<Float>::quiet_NaN());
+			return result;
+		}
+		Float invDet = 1 / det;
+		Float i00 = c00 * invDet;
+		Float i01 = (data[0][2] * data[2][1] - data[0][1] * data[2][2]) * invDet;
+		Float i02 = (data[0][1] * data[1][2] - data[0][2] * data[1][1]) * invDet;
+		Float i10 = c01 * invDet;
+		Float i11 = (data[0][0] * data[2][2] - data[0][2] * data[2][0]) * invDet;
+		Float i12 = (data[0][2] * data[1][0] - data[0][0] * data[1][2]) * invDet;
+		Float i20 = c02 * invDet;
+		Float i21 = (data[0][1] * data[2][0] - data[0][0] * data[2][1]) * invDet;
+		Float i22 = (data[0][0] * data[1][1] - data[0][1] * data[1][0]) * invDet;
+		Float tx = data[0][3], ty = data[1][3], tz = data[2][3];
+		return Matrix4x4(i00, i01, i02, -(i00 * tx + i01 * ty + i02 * tz),
+			             i10, i11, i12, -(i10 * tx + i11 * ty + i12 * tz),
+			             i20, i21, i22, -(i20 * tx + i21 * ty + i22 * tz),
+			             0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	//Only valid for a rotation plus translation, the inverse rotation is the transpose.
+	constexpr Matrix4x4 InverseRigid() const {
+		Float tx = data[0][3], ty = data[1][3], tz = data[2][3];
+		return Matrix4x4(data[0][0], data[1][0], data[2][0], -(data[0][0] * tx + data[1][0] * ty + data[2][0] * tz),
+			             data[0][1], data[1][1], data[2][1], -(data[0][1] * tx + data[1][1] * ty + data[2][1] * tz),
+			             data[0][2], data[1][2], data[2][2], -(data[0][2] * tx + data[1][2] * ty + data[2][2] * tz),
+			             0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	constexpr bool SwapsHandedness() const {
+		Float det = data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1]) -
+					data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0]) +
+					data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
+		return det < 0;
+	}
+
+	constexpr bool IsIdentity() const {
+		return (data[0][0] == 1.f && data[0][1] == 0.f && data[0][2] == 0.f && data[0][3] == 0.f && 
+				data[1][0] == 0.f && data[1][1] == 1.f && data[1][2] == 0.f && data[1][3] == 0.f && 
+				data[2][0] == 0.f && data[2][1] == 0.f && data[2][2] == 1.f && data[2][3] == 0.f &&
+				data[3][0] == 0.f && data[3][1] == 0.f && data[3][2] == 0.f && data[3][3] == 1.f);
+	}
+
+	template <typename T>
+	inline Point3<T> operator()(const Point3<T> &p) const;
+	template <typename T>
+	inline Vector3<T> operator()(const Vector3<T> &v) const;
+	inline Point3f operator()(const Point3f &p) const;
+	inline Vector3f operator()(const Vector3f &v) const;
+	//Point3<Interval> rather than Point3fi, so that sums of Point3fi do not pick the template above
+	inline Point3fi operator()(const Point3<Interval> &p) const;
+	inline Vector3fi operator()(const Vector3<Interval> &v) const;
+	inline Ray operator()(const Ray &r) const;
+	inline PrecomputedRay operator()(const PrecomputedRay &r) const;
+	inline Bounds3f operator()(const Bounds3f &b) const;
+
+	//public data
+	Float data[4][4];
+};
+
+constexpr Matrix4x4 Translate(const Vector3f delta) {
+	return Matrix4x4(1.0f, 0.0f, 0.0f, delta.x, 0.0f, 1.0f, 0.0f, delta.y,
+		             0.0f, 0.0f, 1.0f, delta.z, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+constexpr Matrix4x4 RotateX(Float degree) {
+	Float sinTheta = 0, cosTheta = 0;
+	SinCos(Radians(degree), sinTheta, cosTheta);
+	return Matrix4x4(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, cosTheta, -sinTheta, 0.0f,
+		             0.0f, sinTheta, cosTheta, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+constexpr Matrix4x4 RotateY(Float degree) {
+	Float sinTheta = 0, cosTheta = 0;
+	SinCos(Radians(degree), sinTheta, cosTheta);
+	return Matrix4x4(cosTheta, 0.0f, sinTheta, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
+		             -sinTheta, 0.0f, cosTheta, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+constexpr Matrix4x4 RotateZ(Float degree) {
+	Float sinTheta = 0, cosTheta = 0;
+	SinCos(Radians(degree), sinTheta, cosTheta);
+	return Matrix4x4(cosTheta, -sinTheta, 0.0f, 0.0f, sinTheta, cosTheta, 0.0f, 0.0f,
+		             0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline Matrix4x4 Rotate(const Vector3f& axis, Float degree) {
+	Vector3f normalizedAxis = axis.Normalize();
+	Float sinTheta, cosTheta;
+	simd::SinCos(Radians(degree), sinTheta, cosTheta);
+	return Matrix4x4(normalizedAxis.x * normalizedAxis.x + (1 - normalizedAxis.x * normalizedAxis.x) * cosTheta,
+		normalizedAxis.x * normalizedAxis.y * (1 - cosTheta) - normalizedAxis.z * sinTheta,
+		normalizedAxis.x * normalizedAxis.z * (1 - cosTheta) + normalizedAxis.y * sinTheta,
+		0,
+		normalizedAxis.x * normalizedAxis.y * (1 - cosTheta) + normalizedAxis.z * sinTheta,
+		normalizedAxis.y * normalizedAxis.y + (1 - normalizedAxis.y * normalizedAxis.y) * cosTheta,
+		normalizedAxis.y * normalizedAxis.z * (1 - cosTheta) - normalizedAxis.x * sinTheta,
+		0,
+		normalizedAxis.x * normalizedAxis.z * (1 - cosTheta) - normalizedAxis.y * sinTheta,
+		normalizedAxis.y * normalizedAxis.z * (1 - cosTheta) + normalizedAxis.x * sinTheta,
+		normalizedAxis.z * normalizedAxis.z + (1 - normalizedAxis.z * normalizedAxis.z) * cosTheta,
+		0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+constexpr Matrix4x4 Scale(const Vector3f& scale) {
+	return Matrix4x4(scale.x, 0.0f, 0.0f, 0.0f, 0.0f, scale.y, 0.0f, 0.0f,
+		             0.0f, 0.0f, scale.z, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline Matrix4x4 GetViewMatrix(const Point3f& pos, const Point3f& target, const Vector3f& viewUp) {
+	Vector3f forward = (target - pos).Normalize();
+	if (Cross(viewUp.Normalize(), forward).Length() == 0) {
+		std::cout << "hsm error : The up direction and the view direction is the same direction!" << std::endl;
+		return Matrix4x4();
+	}
+	Vector3f right = Cross(viewUp.Normalize(), forward).Normalize();
+	Vector3f up = Cross(forward, right);
+	Matrix4x4 rotateMat(right.x, right.y, right.z, 0.0f, up.x, up.y, up.z, 0.0f,
+		                forward.x, forward.y, forward.z, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+	Matrix4x4 translateMat(1.0f, 0.0f, 0.0f, -pos.x, 0.0f, 1.0f, 0.0f, -pos.y,
+		                   0.0f, 0.0f, 1.0f, -pos.z, 0.0f, 0.0f, 0.0f, 1.0f);
+	return rotateMat * translateMat;
+}
+
+inline Matrix4x4 GetPerspectiveMatrix(Float aspect, Float fov, Float near, Float far) {
+	Float tanHalfFov = Tan(Radians(fov) * 0.5f);
+	return Matrix4x4(1 / (aspect * tanHalfFov), 0.0f, 0.0f, 0.0f, 0.0f, 1 / tanHalfFov, 0.0f, 0.0f,
+		             0.0f, 0.0f, (near + far) / (far - near), 1.0f, 0.0f, 0.0f, (2 * far * near)/(near - far), 0.0f);
+}
+
+template <typename T>
+inline Point3<T> Matrix4x4::operator()(const Point3<T> &p) const {
+	T x = p.x, y = p.y, z = p.z;
+	T px = data[0][0] * x + data[0][1] * y + data[0][2] * z + data[0][3];
+	T py = data[1][0] * x + data[1][1] * y + data[1][2] * z + data[1][3];
+	T pz = data[2][0] * x + data[2][1] * y + data[2][2] * z + data[2][3];
+	T pw = data[3][0] * x + data[3][1] * y + data[3][2] * z + data[3][3];
+	assert(pw != 0);
+	if (pw == 1) return Point3<T>(px, py, pz);
+	else return Point3<T>(px, py, pz) / pw;
 }
 
-template<typename T>
-inline Float Dot(const Vector3<T>& v1, const Vector3<T>& v2) {
-	return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+template <typename T>
+inline Vector3<T> Matrix4x4::operator()(const Vector3<T> &v) const {
+	T x = v.x, y = v.y, z = v.z;
+	return Vector3<T>(data[0][0] * x + data[0][1] * y + data[0][2] * z,
+					  data[1][0] * x + data[1][1] * y + data[1][2] * z,
+					  data[2][0] * x + data[2][1] * y + data[2][2] * z);
 }
 
-template<typename T>
-inline Vector3<T> Cross(const Vector3<T>& v1, const Vector3<T>& v2) {
-	return Vector3<T>((v1.y * v2.z) - (v1.z * v2.y), 
-		(v1.z * v2.x) - (v1.x * v2.z), (v1.x * v2.y) - (v1.y * v2.x));
+inline Point3f Matrix4x4::operator()(const Point3f &p) const {
+	Float r[4];
+	simd::Transform4(data, p.x, p.y, p.z, true, r);
+	assert(r[3] != 0);
+	if (r[3] == 1) return Point3f(r[0], r[1], r[2]);
+	else return Point3f(r[0], r[1], r[2]) / r[3];
 }
 
-typedef Vector3<Float> Vector3f;
-typedef Vector3<int> Vector3i;
-typedef Vector2<Float> Vector2f;
-typedef Vector2<int> Vector2i;
-typedef Point2<Float> Point2f;
-typedef Point2<int> Point2i;
-typedef Point3<Float> Point3f;
-typedef Point3<int> Point3i;
+inline Vector3f Matrix4x4::operator()(const Vector3f &v) const {
+	Float r[4];
+	simd::Transform4(data, v.x, v.y, v.z, false, r);
+	return Vector3f(r[0], r[1], r[2]);
+}
 
-inline Vector3f Convert(const Point3f& p) {
-	return Vector3f(p.x, p.y, p.z);
+//The rows 0 to 2 of m applied to a point or a vector, with the rounding error of the sums: Gamma(4) for the
+//three products and three additions of a point component, Gamma(3) for a vector. The error the operand
+//already carries goes through |m|, rounded up by the same factor. Shared with AffineTransform.
+inline Point3fi TransformAffine(const Float m[][4], const Point3fi& p) {
+	Point3f c(p), r;
+	Vector3f e = p.Error(), error;
+	for (int i = 0; i < 3; ++i) {
+		r[i] = m[i][0] * c.x + m[i][1] * c.y + m[i][2] * c.z + m[i][3];
+		error[i] = Gamma(4) * (std::abs(m[i][0] * c.x) + std::abs(m[i][1] * c.y) + std::abs(m[i][2] * c.z) + std::abs(m[i][3])) +
+			       (1 + Gamma(4)) * (std::abs(m[i][0]) * e.x + std::abs(m[i][1]) * e.y + std::abs(m[i][2]) * e.z);
+	}
+	return Point3fi(r, error);
 }
 
-Vector3f RandomInUnitSphere() {
-	while (true) {
-		Vector3f v(Random<Float>(-1.0f, 1.0f), Random<Float>(-1.0f, 1.0f), Random<Float>(-1.0f, 1.0f));
-		if (v.LengthSquared() >= 1.0f) continue;
-		return v;
+inline Vector3fi TransformAffine(const Float m[][4], const Vector3fi& v) {
+	Vector3f c(v), r, error;
+	Vector3f e = v.Error();
+	for (int i = 0; i < 3; ++i) {
+		r[i] = m[i][0] * c.x + m[i][1] * c.y + m[i][2] * c.z;
+		error[i] = Gamma(3) * (std::abs(m[i][0] * c.x) + std::abs(m[i][1] * c.y) + std::abs(m[i][2] * c.z)) +
+			       (1 + Gamma(3)) * (std::abs(m[i][0]) * e.x + std::abs(m[i][1]) * e.y + std::abs(m[i][2]) * e.z);
 	}
+	return Vector3fi(r, error);
 }
 
-Vector2f RandomInUnitDisk() {
-	while (true) {
-		Vector2f v(Random<Float>(-1.0f, 1.0f), Random<Float>(-1.0f, 1.0f));
-		if (v.LengthSquared() >= 1.0f) continue;
-		return v;
+//Ray with the transformed origin o and direction d. The origin is moved forward along d past its error,
+//so that it cannot end up behind the surface the ray left, and the range shrinks by the same t.
+inline PrecomputedRay TransformedRay(const Point3fi& o, const Vector3f& d, const PrecomputedRay& r) {
+	Point3f origin(o);
+	Float lengthSquared = d.LengthSquared(), dt = 0;
+	if (lengthSquared > 0) {
+		dt = Dot(d.Abs(), o.Error()) / lengthSquared;
+		origin += d * dt;
 	}
+	return PrecomputedRay(Ray(origin, d, r.time), std::max(r.tMin - dt, (Float)0), r.tMax - dt);
 }
 
-Vector3f RandomInHemisphere(const Vector3f& normal) {
-	Vector3f v = RandomInUnitSphere();
-	if (Dot(v, normal) > 0.0f) return v;
-	return -v;
+//Projective matrices go through interval arithmetic, including the division by w.
+inline Point3fi Matrix4x4::operator()(const Point3<Interval> &p) const {
+	if (data[3][0] == 0 && data[3][1] == 0 && data[3][2] == 0 && data[3][3] == 1)
+		return TransformAffine(data, p);
+	Interval r[4];
+	for (int i = 0; i < 4; ++i)
+		r[i] = data[i][0] * p.x + data[i][1] * p.y + data[i][2] * p.z + data[i][3];
+	return Point3fi(r[0] / r[3], r[1] / r[3], r[2] / r[3]);
 }
 
-inline Vector3f RandomUnitVec() {
-	return RandomInUnitSphere().Normalize();
+inline Vector3fi Matrix4x4::operator()(const Vector3<Interval> &v) const {
+	return TransformAffine(data, v);
 }
 
-inline Vector3f RandomVec(Float min, Float max) {
-	return Vector3f(Random<Float>(min, max), Random<Float>(min, max), Random<Float>(min, max));
+inline Ray Matrix4x4::operator()(const Ray &r) const {
+	Point3f o = (*this)(r.origin);
+	Vector3f d = (*this)(r.direction);
+	return Ray(o, d, r.time);
 }
 
-inline Vector3f RandomVec() {
-	return Vector3f(Random<Float>(), Random<Float>(), Random<Float>());
+//t is not normalized, so apart from the origin offset of TransformedRay the range carries over.
+inline PrecomputedRay Matrix4x4::operator()(const PrecomputedRay &r) const {
+	return TransformedRay((*this)(Point3fi(r.origin)), (*this)(r.direction), r);
 }
 
-inline Point3f RandomPoint(Float min, Float max) {
-	return Point3f(Random<Float>(min, max), Random<Float>(min, max), Random<Float>(min, max));
+static_assert(sizeof(Bounds3f) == 6 * sizeof(Float), "batch bounds transforms expect tightly packed boxes");
+
+//Affine matrices use Arvo's method, projective ones bound the eight transformed corners. Empty boxes stay as they are.
+inline Bounds3f Matrix4x4::operator()(const Bounds3f &b) const {
+	if (b.IsEmpty()) return b;
+	Bounds3f result;
+	if (data[3][0] == 0 && data[3][1] == 0 && data[3][2] == 0 && data[3][3] == 1) {
+		simd::TransformBoundsBatch(data, &b.pMin.x, &result.pMin.x, 1);
+		return result;
+	}
+	for (int i = 0; i < 8; ++i)
+		result = Union(result, (*this)(Point3f(b[i & 1].x, b[(i >> 1) & 1].y, b[(i >> 2) & 1].z)));
+	return result;
 }
 
-inline Point3f RandomPoint() {
-	return Point3f(Random<Float>(), Random<Float>(), Random<Float>());
+static_assert(sizeof(Point3f) == 3 * sizeof(Float) && sizeof(Vector3f) == 3 * sizeof(Float),
+	          "batch transforms expect tightly packed points and vectors");
+static_assert(std::is_trivially_copyable<Point2f>::value && std::is_trivially_copyable<Point3f>::value &&
+	          std::is_trivially_copyable<Vector2f>::value && std::is_trivially_copyable<Vector3f>::value &&
+	          std::is_trivially_copyable<Bounds2f>::value && std::is_trivially_copyable<Bounds3f>::value &&
+	          std::is_trivially_copyable<Matrix4x4>::value, "math types are copied with memcpy");
+
+//Batch transforms, out may be the same array as in.
+//Affine variant, the last row of m is assumed to be (0, 0, 0, 1).
+inline void TransformPoints(const Matrix4x4& m, const Point3f* in, Point3f* out, size_t count) {
+	simd::TransformBatch(m.data, true, false, &in->x, &out->x, count);
 }
 
-inline Vector3f RandomCosineDirection() {
-	auto r1 = Random<Float>();
-	auto r2 = Random<Float>();
-	auto z = sqrt(1 - r2);
-	auto phi = 2 * Pi*r1;
-	auto x = cos(phi)*sqrt(r2);
-	auto y = sin(phi)*sqrt(r2);
+//Projective variant, always divides by w.
+inline void TransformPointsProjective(const Matrix4x4& m, const Point3f* in, Point3f* out, size_t count) {
+	simd::TransformBatch(m.data, true, true, &in->x, &out->x, count);
+}
 
-	return Vector3f(x, y, z);
+inline void TransformVectors(const Matrix4x4& m, const Vector3f* in, Vector3f* out, size_t count) {
+	simd::TransformBatch(m.data, false, false, &in->x, &out->x, count);
 }
 
-inline Vector3f Random2Sphere(double radius, double distanceSquared) {
-	auto r1 = Random<Float>();
-	auto r2 = Random<Float>();
-	auto z = 1 + r2 * (sqrt(1 - radius * radius / distanceSquared) - 1);
+//Normals are transformed by the inverse transpose, so this takes the inverse of the transform.
+inline void TransformNormals(const Matrix4x4& mInverse, const Vector3f* in, Vector3f* out, size_t count) {
+	Matrix4x4 mInverseT = mInverse.Transpose();
+	simd::TransformBatch(mInverseT.data, false, false, &in->x, &out->x, count);
+}
 
-	auto phi = 2 * Pi*r1;
-	auto x = cos(phi)*sqrt(1 - z * z);
-	auto y = sin(phi)*sqrt(1 - z * z);
+//Affine variant, the origin is not divided by w.
+//Origins and directions are read straight from the Ray array, a Ray apart, so both run in packs.
+inline void TransformRays(const Matrix4x4& m, const Ray* in, Ray* out, size_t count) {
+	static_assert(sizeof(Ray) % sizeof(Float) == 0, "rays are walked in Floats");
+	const size_t stride = sizeof(Ray) / sizeof(Float);
+	simd::TransformBatch(m.data, true, false, &in->origin.x, &out->origin.x, count, stride);
+	simd::TransformBatch(m.data, false, false, &in->direction.x, &out->direction.x, count, stride);
+	if (in != out)
+		for (size_t i = 0; i < count; ++i) out[i].time = in[i].time;
+}
 
-	return Vector3f(x, y, z);
+//The last row of m has to be (0, 0, 0, 1).
+inline void TransformBounds(const Matrix4x4& m, const Bounds3f* in, Bounds3f* out, size_t count) {
+	assert(m.data[3][0] == 0 && m.data[3][1] == 0 && m.data[3][2] == 0 && m.data[3][3] == 1);
+	simd::TransformBoundsBatch(m.data, &in->pMin.x, &out->pMin.x, count);
 }
 
-typedef Vector3<Float> Color;
+//Bounds reductions, a single streaming pass over the input. An empty input gives an empty box.
+inline Bounds3f ComputeBounds(const Point3f* points, size_t count) {
+	Float mins[3], maxs[3];
+	simd::MinMaxInterleaved<3>(&points->x, count, mins, maxs);
+	Bounds3f b;
+	b.pMin = Point3f(mins[0], mins[1], mins[2]);
+	b.pMax = Point3f(maxs[0], maxs[1], maxs[2]);
+	return b;
+}
 
-inline Color operator * (const Color& c1, const Color& c2) {
-	return Color(c1.x * c2.x, c1.y * c2.y, c1.z * c2.z);
+inline Bounds3f ComputeBounds(const Bounds3f* boxes, size_t count) {
+	Float mins[6], maxs[6];
+	simd::MinMaxInterleaved<6>(&boxes->pMin.x, count, mins, maxs);
+	Bounds3f b;
+	b.pMin = Point3f(mins[0], mins[1], mins[2]);
+	b.pMax = Point3f(maxs[3], maxs[4], maxs[5]);
+	return b;
 }
 
-template <typename T>
-int MaxDimension(const Vector3<T> &v) {
-	return (v.x > v.y) ? ((v.x > v.z) ? 0 : 2) : ((v.y > v.z) ? 1 : 2);
+//Points and boxes in [begin, end)
+inline Bounds3f ComputeBounds(const Point3SoA& points, size_t begin, size_t end) {
+	assert(begin <= end && end <= points.Size());
+	Bounds3f b;
+	simd::MinMaxInterleaved<1>(&points.x[begin], end - begin, &b.pMin.x, &b.pMax.x);
+	simd::MinMaxInterleaved<1>(&points.y[begin], end - begin, &b.pMin.y, &b.pMax.y);
+	simd::MinMaxInterleaved<1>(&points.z[begin], end - begin, &b.pMin.z, &b.pMax.z);
+	return b;
 }
 
-template <typename T>
-Vector3<T> Permute(const Vector3<T> &v, int x, int y, int z) {
-	return Vector3<T>(v[x], v[y], v[z]);
+inline Bounds3f ComputeBounds(const Point3SoA& points) { return ComputeBounds(points, 0, points.Size()); }
+
+inline Bounds3f ComputeBounds(const Bounds3SoA& boxes, size_t begin, size_t end) {
+	assert(begin <= end && end <= boxes.Size());
+	Bounds3f lower = ComputeBounds(boxes.pMin, begin, end), upper = ComputeBounds(boxes.pMax, begin, end);
+	Bounds3f b;
+	b.pMin = lower.pMin;
+	b.pMax = upper.pMax;
+	return b;
 }
 
-//Bounds2
-template <typename T>
-class Bounds2 {
+inline Bounds3f ComputeBounds(const Bounds3SoA& boxes) { return ComputeBounds(boxes, 0, boxes.Size()); }
+
+//Affine transform
+//3x4 matrix with an implicit (0, 0, 0, 1) last row, a quarter smaller than Matrix4x4 and never divides by w.
+class AffineTransform {
 public:
 	//public methods
-	Bounds2() {
-		T minNum = std::numeric_limits<T>::lowest();
-		T maxNum = std::numeric_limits<T>::max();
-		pMin = Point2<T>(minNum, minNum);
-		pMax = Point2<T>(maxNum, maxNum);
+	constexpr AffineTransform() :
+		data{ { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } } {}
+
+	//Leaves the data uninitialized, for results that are overwritten completely.
+	struct NoInit {};
+	explicit AffineTransform(NoInit) {}
+
+	constexpr AffineTransform(Float d00, Float d01, Float d02, Float d03, Float d10, Float d11, Float d12, Float d13,
+		Float d20, Float d21, Float d22, Float d23) :
+		data{ { d00, d01, d02, d03 }, { d10, d11, d12, d13 }, { d20, d21, d22, d23 } } {}
+
+	//The last row of mat has to be (0, 0, 0, 1).
+	constexpr explicit AffineTransform(const Matrix4x4& mat) :
+		data{ { mat.data[0][0], mat.data[0][1], mat.data[0][2], mat.data[0][3] },
+		      { mat.data[1][0], mat.data[1][1], mat.data[1][2], mat.data[1][3] },
+		      { mat.data[2][0], mat.data[2][1], mat.data[2][2], mat.data[2][3] } } {
+		assert(mat.data[3][0] == 0 && mat.data[3][1] == 0 && mat.data[3][2] == 0 && mat.data[3][3] == 1);
 	}
 
-	Bounds2(const Point2<T> &p1, const Point2<T> &p2) :
-		pMax(std::max(p1.x, p2.x), std::max(p1.y, p2.y)),
-		pMin(std::min(p1.x, p2.x), std::min(p1.y, p2.y)) {}
-
-	inline Vector2<T> Diagonal() const { return pMax - pMin; }
+	constexpr explicit AffineTransform(const Matrix3x4& mat) :
+		data{ { mat.data[0][0], mat.data[0][1], mat.data[0][2], mat.data[0][3] },
+		      { mat.data[1][0], mat.data[1][1], mat.data[1][2], mat.data[1][3] },
+		      { mat.data[2][0], mat.data[2][1], mat.data[2][2], mat.data[2][3] } } {}
 
-	inline T Area() const { return (pMax.x - pMin.x) * (pMax.y - pMin.y); }
-
-	Point2<T>& operator [] (int i) {
-		assert(i == 0 || i == 1);
-		if (i == 0) return pMin;
-		return pMax;
+	constexpr Matrix4x4 ToMatrix4x4() const {
+		return Matrix4x4(data[0][0], data[0][1], data[0][2], data[0][3], data[1][0], data[1][1], data[1][2], data[1][3],
+			             data[2][0], data[2][1], data[2][2], data[2][3], 0.0f, 0.0f, 0.0f, 1.0f);
 	}
 
-	const Point2<T>& operator [] (int i) const {
-		assert(i == 0 || i == 1);
-		if (i == 0) return pMin;
-		return pMax;
+	constexpr Matrix3x4 ToMatrix3x4() const {
+		return Matrix3x4(data[0][0], data[0][1], data[0][2], data[0][3], data[1][0], data[1][1], data[1][2], data[1][3],
+			             data[2][0], data[2][1], data[2][2], data[2][3]);
 	}
 
-	bool operator == (const Bounds2<T>& b) const {
-		return pMin == b.pMin && pMax == b.pMax;
+	constexpr bool operator == (const AffineTransform& t) const {
+		for (int i = 0; i < 3; ++i)
+			for (int j = 0; j < 4; ++j) {
+				Float d = data[i][j] - t.data[i][j];
+				if (d > 1e-6 || d < -1e-6) return false;
+			}
+		return true;
 	}
 
-	bool operator != (const Bounds2<T>& b) const {
-		return pMin != b.pMin || pMax != b.pMax;
+	constexpr bool operator != (const AffineTransform& t) const {
+		return !(*this == t);
 	}
 
-	void BoundingSphere(Point2<T>& center, T& radius) const {
-		Point2<T> c = (pMin + pMax) * 0.5f;
-		center.x = c.x;
-		center.y = c.y;
-		radius = Inside(center, *this) ? center.Distance(pMax) : 0;
+	//Applies t first, then this.
+	constexpr AffineTransform operator * (const AffineTransform& t) const {
+#ifdef HSM_IS_CONSTANT_EVALUATED
+		if (!HSM_IS_CONSTANT_EVALUATED()) {
+			AffineTransform result((NoInit()));
+			simd::MatMulAffine(data, t.data, result.data);
+			return result;
+		}
+#endif
+		//same summation order as the SIMD kernel
+		AffineTransform result;
+		for (int i = 0; i < 3; ++i) {
+			for (int j = 0; j < 4; ++j)
+				result.data[i][j] = data[i][0] * t.data[0][j] + data[i][1] * t.data[1][j] + data[i][2] * t.data[2][j];
+			result.data[i][3] += data[i][3];
+		}
+		return result;
 	}
 
-	//public data
-	Point2<T> pMin, pMax;
-};
-
-template <typename T>
-inline std::ostream& operator << (std::ostream& o, const Bounds2<T>& b) {
-	o << "[ " << b.pMin << " , " << b.pMax << " ]";
-	return o;
-}
-
-//Bounds3
-template <typename T>
-class Bounds3 {
-public:
-	//public methods
-	Bounds3() {
-		T minNum = std::numeric_limits<T>::lowest();
-		T maxNum = std::numeric_limits<T>::max();
-		pMin = Point3<T>(minNum, minNum, minNum);
-		pMax = Point3<T>(maxNum, maxNum, maxNum);
+	//The 3x3 part is inverted through its cofactors, the translation becomes -inverse * t.
+	//Singular matrices are reported like Matrix4x4::Inverse.
+	AffineTransform Inverse(bool* invertible = nullptr) const {
+		Float c00 = data[1][1] * data[2][2] - data[1][2] * data[2][1];
+		Float c01 = data[1][2] * data[2][0] - data[1][0] * data[2][2];
+		Float c02 = data[1][0] * data[2][1] - data[1][1] * data[2][0];
+		Float det = data[0][0] * c00 + data[0][1] * c01 + data[0][2] * c02;
+		assert(det != 0 || invertible);
+		if (invertible) *invertible = det != 0;
+		if (det == 0) {
+			AffineTransform result((NoInit()));
+			std::fill(&result.data[0][0], &result.data[0][0] + 12, std::numeric_limits<Float>::quiet_NaN());
+			return result;
+		}
+		Float invDet = 1 / det;
+		Float i00 = c00 * invDet;
+		Float i01 = (data[0][2] * data[2][1] - data[0][1] * data[2][2]) * invDet;
+		Float i02 = (data[0][1] * data[1][2] - data[0][2] * data[1][1]) * invDet;
+		Float i10 = c01 * invDet;
+		Float i11 = (data[0][0] * data[2][2] - data[0][2] * data[2][0]) * invDet;
+		Float i12 = (data[0][2] * data[1][0] - data[0][0] * data[1][2]) * invDet;
+		Float i20 = c02 * invDet;
+		Float i21 = (data[0][1] * data[2][0] - data[0][0] * data[2][1]) * invDet;
+		Float i22 = (data[0][0] * data[1][1] - data[0][1] * data[1][0]) * invDet;
+		Float tx = data[0][3], ty = data[1][3], tz = data[2][3];
+		return AffineTransform(i00, i01, i02, -(i00 * tx + i01 * ty + i02 * tz),
+			                   i10, i11, i12, -(i10 * tx + i11 * ty + i12 * tz),
+			                   i20, i21, i22, -(i20 * tx + i21 * ty + i22 * tz));
 	}
 
-	Bounds3(const Point3<T> &p1, const Point3<T> &p2) :
-		pMax(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z)),
-		pMin(std::min(p1.x, p2.x), std::min(p1.y, p2.y), std::min(p1.z, p2.z)) {}
-
-	inline Vector3<T> Diagonal() const { return pMax - pMin; }
+	//Only valid for a rotation plus translation, the inverse rotation is the transpose.
+	constexpr AffineTransform InverseRigid() const {
+		Float tx = data[0][3], ty = data[1][3], tz = data[2][3];
+		return AffineTransform(data[0][0], data[1][0], data[2][0], -(data[0][0] * tx + data[1][0] * ty + data[2][0] * tz),
+			                   data[0][1], data[1][1], data[2][1], -(data[0][1] * tx + data[1][1] * ty + data[2][1] * tz),
+			                   data[0][2], data[1][2], data[2][2], -(data[0][2] * tx + data[1][2] * ty + data[2][2] * tz));
+	}
 
-	inline T SurfaceArea() const {
-		Vector3<T> v = Diagonal();
-		return 2 * (v.x * v.y + v.y * v.z + v.x * v.z);
+	constexpr bool SwapsHandedness() const {
+		Float det = data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1]) -
+					data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0]) +
+					data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
+		return det < 0;
 	}
 
-	inline T Volume() const {
-		Vector3<T> v = Diagonal();
-		return v.x * v.y * v.z;
+	constexpr bool IsIdentity() const {
+		return (data[0][0] == 1.f && data[0][1] == 0.f && data[0][2] == 0.f && data[0][3] == 0.f && 
+				data[1][0] == 0.f && data[1][1] == 1.f && data[1][2] == 0.f && data[1][3] == 0.f && 
+				data[2][0] == 0.f && data[2][1] == 0.f && data[2][2] == 1.f && data[2][3] == 0.f);
 	}
 
-	Point3<T>& operator [] (int i) {
-		assert(i == 0 || i == 1);
-		if (i == 0) return pMin;
-		return pMax;
+	constexpr Point3f operator()(const Point3f& p) const {
+		return Point3f(data[0][0] * p.x + data[0][1] * p.y + data[0][2] * p.z + data[0][3],
+			           data[1][0] * p.x + data[1][1] * p.y + data[1][2] * p.z + data[1][3],
+			           data[2][0] * p.x + data[2][1] * p.y + data[2][2] * p.z + data[2][3]);
 	}
 
-	const Point3<T>& operator [] (int i) const {
-		assert(i == 0 || i == 1);
-		if (i == 0) return pMin;
-		return pMax;
+	constexpr Vector3f operator()(const Vector3f& v) const {
+		return Vector3f(data[0][0] * v.x + data[0][1] * v.y + data[0][2] * v.z,
+			            data[1][0] * v.x + data[1][1] * v.y + data[1][2] * v.z,
+			            data[2][0] * v.x + data[2][1] * v.y + data[2][2] * v.z);
 	}
 
-	bool operator == (const Bounds3<T>& b) const {
-		return pMin == b.pMin && pMax == b.pMax;
+	Ray operator()(const Ray& r) const {
+		return Ray((*this)(r.origin), (*this)(r.direction), r.time);
 	}
 
-	bool operator != (const Bounds3<T>& b) const {
-		return pMin != b.pMin || pMax != b.pMax;
+	Point3fi operator()(const Point3fi& p) const { return TransformAffine(data, p); }
+	Vector3fi operator()(const Vector3fi& v) const { return TransformAffine(data, v); }
+
+	PrecomputedRay operator()(const PrecomputedRay& r) const {
+		return TransformedRay((*this)(Point3fi(r.origin)), (*this)(r.direction), r);
 	}
 
-	void BoundingSphere(Point3<T>& center, T& radius) const {
-		Point3<T> c = (pMin + pMax) * 0.5f;
-		center.x = c.x;
-		center.y = c.y;
-		center.z = c.z;
-		radius = Inside(center, *this) ? center.Distance(pMax) : 0;
+	Bounds3f operator()(const Bounds3f& b) const {
+		if (b.IsEmpty()) return b;
+		Bounds3f result;
+		simd::TransformBoundsBatch(data, &b.pMin.x, &result.pMin.x, 1);
+		return result;
 	}
 
 	//public data
-	Point3<T> pMin, pMax;
+	Float data[3][4];
 };
 
-template <typename T>
-inline std::ostream& operator << (std::ostream& o, const Bounds3<T>& b) {
-	o << "[ " << b.pMin << " , " << b.pMax << " ]";
+static_assert(sizeof(AffineTransform) == 12 * sizeof(Float) && std::is_trivially_copyable<AffineTransform>::value,
+	          "affine transforms are stored packed");
+
+inline std::ostream& operator << (std::ostream& o, const AffineTransform& t) {
+	o << t.ToMatrix3x4();
 	return o;
 }
 
-typedef Bounds2<int> Bounds2i;
-typedef Bounds2<Float> Bounds2f;
-typedef Bounds3<int> Bounds3i;
-typedef Bounds3<Float> Bounds3f;
+//Normals are transformed by the inverse transpose, so this takes the inverse of the transform.
+constexpr Vector3f TransformNormal(const AffineTransform& inverse, const Vector3f& n) {
+	return Vector3f(inverse.data[0][0] * n.x + inverse.data[1][0] * n.y + inverse.data[2][0] * n.z,
+		            inverse.data[0][1] * n.x + inverse.data[1][1] * n.y + inverse.data[2][1] * n.z,
+		            inverse.data[0][2] * n.x + inverse.data[1][2] * n.y + inverse.data[2][2] * n.z);
+}
 
-//Ray
-class Ray {
-public:
-	//public methods
-	Ray() {}
-	Ray(const Point3f& o, const Vector3f& d, Float t = 0.0f) : origin(o), direction(d), time(t) {}
+//Batch transforms, out may be the same array as in.
+inline void TransformPoints(const AffineTransform& t, const Point3f* in, Point3f* out, size_t count) {
+	simd::TransformBatch(t.data, true, false, &in->x, &out->x, count);
+}
 
-	Point3f At(Float t) const { return origin + t * direction; }
+inline void TransformVectors(const AffineTransform& t, const Vector3f* in, Vector3f* out, size_t count) {
+	simd::TransformBatch(t.data, false, false, &in->x, &out->x, count);
+}
 
-	bool HasNaN() const {
-		return (origin.HasNaN() || direction.HasNaN());
-	}
+inline void TransformNormals(const AffineTransform& inverse, const Vector3f* in, Vector3f* out, size_t count) {
+	const Float linearT[3][4] = { { inverse.data[0][0], inverse.data[1][0], inverse.data[2][0], 0.0f },
+	                              { inverse.data[0][1], inverse.data[1][1], inverse.data[2][1], 0.0f },
+	                              { inverse.data[0][2], inverse.data[1][2], inverse.data[2][2], 0.0f } };
+	simd::TransformBatch(linearT, false, false, &in->x, &out->x, count);
+}
 
-	//public data
-	Point3f origin;
-	Vector3f direction;
-	Float time;
-};
+inline void TransformRays(const AffineTransform& t, const Ray* in, Ray* out, size_t count) {
+	static_assert(sizeof(Ray) % sizeof(Float) == 0, "rays are walked in Floats");
+	const size_t stride = sizeof(Ray) / sizeof(Float);
+	simd::TransformBatch(t.data, true, false, &in->origin.x, &out->origin.x, count, stride);
+	simd::TransformBatch(t.data, false, false, &in->direction.x, &out->direction.x, count, stride);
+	if (in != out)
+		for (size_t i = 0; i < count; ++i) out[i].time = in[i].time;
+}
 
-inline std::ostream &operator<<(std::ostream &o, const Ray &r) {
-	o << "[ origin:" << r.origin << ", direction:" << r.direction << ", time:" << r.time << "]";
-	return o;
+inline void TransformBounds(const AffineTransform& t, const Bounds3f* in, Bounds3f* out, size_t count) {
+	simd::TransformBoundsBatch(t.data, &in->pMin.x, &out->pMin.x, count);
 }
 
-//Matrix 4x4
-class Matrix4x4 {
+//Transform
+//A matrix together with its inverse. The factories build the inverse analytically and composition
+//multiplies both halves, so nothing is inverted numerically after construction.
+class Transform {
 public:
 	//public methods
-	Matrix4x4() {
-		data[0][0] = data[1][1] = data[2][2] = data[3][3] = 1.0f;
-		data[0][1] = data[0][2] = data[0][3] = data[1][0] =
-		data[1][2] = data[1][3] = data[2][0] = data[2][1] =
-		data[2][3] = data[3][1] = data[3][2] = data[3][0] = 0.0f;
-	}
-
-	Matrix4x4(Float d00, Float d01, Float d02, Float d03, Float d10, Float d11, Float d12, Float d13,
-		Float d20, Float d21, Float d22, Float d23, Float d30, Float d31, Float d32, Float d33) {
-		data[0][0] = d00;
-		data[0][1] = d01;
-		data[0][2] = d02;
-		data[0][3] = d03;
-		data[1][0] = d10;
-		data[1][1] = d11;
-		data[1][2] = d12;
-		data[1][3] = d13;
-		data[2][0] = d20;
-		data[2][1] = d21;
-		data[2][2] = d22;
-		data[2][3] = d23;
-		data[3][0] = d30;
-		data[3][1] = d31;
-		data[3][2] = d32;
-		data[3][3] = d33;
-	}
-
-	Matrix4x4(Float mat[4][4]) {
-		memcpy(data, mat, sizeof(Float) * 16);
+	constexpr Transform() {}
+	explicit Transform(const Matrix4x4& mat) : m(mat), mInv(mat.Inverse()) {}
+	constexpr Transform(const Matrix4x4& mat, const Matrix4x4& matInverse) : m(mat), mInv(matInverse) {}
+
+	static constexpr Transform Translate(const Vector3f& delta) {
+		return Transform(hsm::Translate(delta), hsm::Translate(-delta));
 	}
 
-	bool operator == (const Matrix4x4& mat) const {
-		for (int i = 0; i <= 3; ++i)
-			for (int j = 0; j <= 3; ++j)
-				if (std::abs(data[i][j] - mat.data[i][j]) > 1e-6)
-					return false;
-		return true;
+	static constexpr Transform Scale(const Vector3f& scale) {
+		return Transform(hsm::Scale(scale), hsm::Scale(Vector3f(1 / scale.x, 1 / scale.y, 1 / scale.z)));
 	}
 
-	bool operator != (const Matrix4x4& mat) const {
-		for (int i = 0; i <= 3; ++i)
-			for (int j = 0; j <= 3; ++j)
-				if (std::abs(data[i][j] - mat.data[i][j]) > 1e-6) 
-					return true;
-		return false;
+	//the inverse of a rotation is its transpose
+	static constexpr Transform RotateX(Float degree) {
+		return FromRotation(hsm::RotateX(degree));
 	}
 
-	Matrix4x4 operator * (const Matrix4x4& mat) const {
-		Matrix4x4 result;
-		for (int i = 0; i < 4; ++i)
-			for (int j = 0; j < 4; ++j)
-				result.data[i][j] = data[i][0] * mat.data[0][j] + data[i][1] * mat.data[1][j] +
-					                data[i][2] * mat.data[2][j] + data[i][3] * mat.data[3][j];
-		return result;
+	static constexpr Transform RotateY(Float degree) {
+		return FromRotation(hsm::RotateY(degree));
 	}
 
-	bool HasScale() const {
-#define NOT_ONE(x) ((x) < .999f || (x) > 1.001f)
-		return (NOT_ONE(data[0][0]) || NOT_ONE(data[1][1]) || NOT_ONE(data[2][2]));
-#undef NOT_ONE
+	static constexpr Transform RotateZ(Float degree) {
+		return FromRotation(hsm::RotateZ(degree));
 	}
 
-	Matrix4x4 Transpose() const {
-		return Matrix4x4(data[0][0], data[1][0], data[2][0], data[3][0],
-			             data[0][1], data[1][1], data[2][1], data[3][1],
-			             data[0][2], data[1][2], data[2][2], data[3][2],
-			             data[0][3], data[1][3], data[2][3], data[3][3]);
-	}
-
-	Matrix4x4 Inverse() const {
-		int indexC[4], indexR[4];
-		int ipiv[4] = { 0, 0, 0, 0 };
-		Float inv[4][4];
-		memcpy(inv, data, 4 * 4 * sizeof(Float));
-		for (int i = 0; i < 4; i++) {
-			int irow = 0, icol = 0;
-			Float big = 0.f;
-			for (int j = 0; j < 4; j++) {
-				if (ipiv[j] != 1) {
-					for (int k = 0; k < 4; k++) {
-						if (ipiv[k] == 0) {
-							if (std::abs(inv[j][k]) >= big) {
-								big = Float(std::abs(inv[j][k]));
-								irow = j;
-								icol = k;
-							}
-						}
-						else if (ipiv[k] > 1)
-							std::cout << "Singular matrix!" << std::endl;
-					}
-				}
-			}
-			++ipiv[icol];
-			if (irow != icol) {
-				for (int k = 0; k < 4; ++k) std::swap(inv[irow][k], inv[icol][k]);
-			}
-			indexR[i] = irow;
-			indexC[i] = icol;
-			if (inv[icol][icol] == 0.f) std::cout << "Singular matrix!" << std::endl;
-
-			Float pivinv = 1. / inv[icol][icol];
-			inv[icol][icol] = 1.;
-			for (int j = 0; j < 4; j++) inv[icol][j] *= pivinv;
-
-			for (int j = 0; j < 4; j++) {
-				if (j != icol) {
-					Float save = inv[j][icol];
-					inv[j][icol] = 0;
-					for (int k = 0; k < 4; k++) inv[j][k] -= inv[icol][k] * save;
-				}
-			}
-		}
+	static Transform Rotate(const Vector3f& axis, Float degree) {
+		return FromRotation(hsm::Rotate(axis, degree));
+	}
 
-		for (int j = 3; j >= 0; j--) {
-			if (indexR[j] != indexC[j]) {
-				for (int k = 0; k < 4; k++)
-					std::swap(inv[k][indexR[j]], inv[k][indexC[j]]);
-			}
-		}
-		return Matrix4x4(inv);
+	static Transform LookAt(const Point3f& pos, const Point3f& target, const Vector3f& viewUp) {
+		Matrix4x4 view = GetViewMatrix(pos, target, viewUp);
+		return Transform(view, view.InverseRigid());
 	}
 
-	bool SwapsHandedness() const {
-		Float det = data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1]) -
-					data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0]) +
-					data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
-		return det < 0;
+	static Transform Perspective(Float aspect, Float fov, Float near, Float far) {
+		return Transform(GetPerspectiveMatrix(aspect, fov, near, far));
 	}
 
-	bool IsIdentity() const {
-		return (data[0][0] == 1.f && data[0][1] == 0.f && data[0][2] == 0.f && data[0][3] == 0.f && 
-				data[1][0] == 0.f && data[1][1] == 1.f && data[1][2] == 0.f && data[1][3] == 0.f && 
-				data[2][0] == 0.f && data[2][1] == 0.f && data[2][2] == 1.f && data[2][3] == 0.f &&
-				data[3][0] == 0.f && data[3][1] == 0.f && data[3][2] == 0.f && data[3][3] == 1.f);
+	bool operator == (const Transform& t) const {
+		return m == t.m;
 	}
 
-	template <typename T>
-	inline Point3<T> operator()(const Point3<T> &p) const;
-	template <typename T>
-	inline Vector3<T> operator()(const Vector3<T> &v) const;
-	inline Ray operator()(const Ray &r) const;
+	bool operator != (const Transform& t) const {
+		return m != t.m;
+	}
+
+	//Applies t first, then this.
+	constexpr Transform operator * (const Transform& t) const {
+		return Transform(m * t.m, t.mInv * mInv);
+	}
+
+	constexpr Transform Inverse() const {
+		return Transform(mInv, m);
+	}
+
+	constexpr Transform Transpose() const {
+		return Transform(m.Transpose(), mInv.Transpose());
+	}
+
+	constexpr bool IsIdentity() const { return m.IsIdentity(); }
+	constexpr bool HasScale() const { return m.HasScale(); }
+	constexpr bool SwapsHandedness() const { return m.SwapsHandedness(); }
+
+	inline Point3f operator()(const Point3f& p) const { return m(p); }
+	inline Vector3f operator()(const Vector3f& v) const { return m(v); }
+	inline Point3fi operator()(const Point3fi& p) const { return m(p); }
+	inline Vector3fi operator()(const Vector3fi& v) const { return m(v); }
+	inline Ray operator()(const Ray& r) const { return m(r); }
+	inline PrecomputedRay operator()(const PrecomputedRay& r) const { return m(r); }
+
+	//Normals are transformed by the inverse transpose.
+	constexpr Vector3f ApplyNormal(const Vector3f& n) const {
+		return Vector3f(mInv.data[0][0] * n.x + mInv.data[1][0] * n.y + mInv.data[2][0] * n.z,
+			            mInv.data[0][1] * n.x + mInv.data[1][1] * n.y + mInv.data[2][1] * n.z,
+			            mInv.data[0][2] * n.x + mInv.data[1][2] * n.y + mInv.data[2][2] * n.z);
+	}
+
+	inline Bounds3f operator()(const Bounds3f& b) const { return m(b); }
+
+	//Into the space this transform maps from, e.g. world rays into object space for instancing.
+	inline Point3f ApplyInverse(const Point3f& p) const { return mInv(p); }
+	inline Vector3f ApplyInverse(const Vector3f& v) const { return mInv(v); }
+	inline Point3fi ApplyInverse(const Point3fi& p) const { return mInv(p); }
+	inline Vector3fi ApplyInverse(const Vector3fi& v) const { return mInv(v); }
+	inline Ray ApplyInverse(const Ray& r) const { return mInv(r); }
+	inline PrecomputedRay ApplyInverse(const PrecomputedRay& r) const { return mInv(r); }
 
 	//public data
-	Float data[4][4];
+	Matrix4x4 m, mInv;
+
+private:
+	static constexpr Transform FromRotation(const Matrix4x4& rotation) {
+		return Transform(rotation, rotation.Transpose());
+	}
 };
 
-inline std::ostream& operator << (std::ostream& o, const Matrix4x4& mat) {
-	o << "[ " << mat.data[0][0] << " , " << mat.data[0][1] << " , " << mat.data[0][2] << " , " << mat.data[0][3] << " ]\n" <<
-		 "[ " << mat.data[1][0] << " , " << mat.data[1][1] << " , " << mat.data[1][2] << " , " << mat.data[1][3] << " ]\n" <<
-		 "[ " << mat.data[2][0] << " , " << mat.data[2][1] << " , " << mat.data[2][2] << " , " << mat.data[2][3] << " ]\n" <<
-		 "[ " << mat.data[3][0] << " , " << mat.data[3][1] << " , " << mat.data[3][2] << " , " << mat.data[3][3] << " ]"   <<
-		 std::endl;
+static_assert(std::is_trivially_copyable<Transform>::value, "math types are copied with memcpy");
+
+inline std::ostream& operator << (std::ostream& o, const Transform& t) {
+	o << "[ m:\n" << t.m << "mInv:\n" << t.mInv << "]";
 	return o;
 }
 
-Matrix4x4 Translate(const Vector3f delta) {
-	return Matrix4x4(1.0f, 0.0f, 0.0f, delta.x, 0.0f, 1.0f, 0.0f, delta.y,
-		             0.0f, 0.0f, 1.0f, delta.z, 0.0f, 0.0f, 0.0f, 1.0f);
+inline void TransformNormals(const Transform& t, const Vector3f* in, Vector3f* out, size_t count) {
+	TransformNormals(t.mInv, in, out, count);
 }
 
-Matrix4x4 RotateX(Float degree) {
-	Float sinTheta = std::sin(Radians(degree));
-	Float cosTheta = std::cos(Radians(degree));
-	return Matrix4x4(1.0f, 0.0f, 0.0f, 0.0f, 0.0f, cosTheta, -sinTheta, 0.0f,
-		             0.0f, sinTheta, cosTheta, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+inline void TransformRays(const Transform& t, const Ray* in, Ray* out, size_t count) {
+	TransformRays(t.m, in, out, count);
 }
 
-Matrix4x4 RotateY(Float degree) {
-	Float sinTheta = std::sin(Radians(degree));
-	Float cosTheta = std::cos(Radians(degree));
-	return Matrix4x4(cosTheta, 0.0f, sinTheta, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-		             -sinTheta, 0.0f, cosTheta, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+inline void TransformBounds(const Transform& t, const Bounds3f* in, Bounds3f* out, size_t count) {
+	TransformBounds(t.m, in, out, count);
 }
 
-Matrix4x4 RotateZ(Float degree) {
-	Float sinTheta = std::sin(Radians(degree));
-	Float cosTheta = std::cos(Radians(degree));
-	return Matrix4x4(cosTheta, -sinTheta, 0.0f, 0.0f, sinTheta, cosTheta, 0.0f, 0.0f,
-		             0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
-}
+//Frustum
+enum class Visibility { Outside, Intersecting, Inside };
 
-Matrix4x4 Rotate(const Vector3f& axis, Float degree) {
-	Vector3f normalizedAxis = axis.Normalize();
-	Float sinTheta = std::sin(Radians(degree));
-	Float cosTheta = std::cos(Radians(degree));
-	return Matrix4x4(normalizedAxis.x * normalizedAxis.x + (1 - normalizedAxis.x * normalizedAxis.x) * cosTheta,
-		normalizedAxis.x * normalizedAxis.y * (1 - cosTheta) - normalizedAxis.z * sinTheta,
-		normalizedAxis.x * normalizedAxis.z * (1 - cosTheta) + normalizedAxis.y * sinTheta,
-		0,
-		normalizedAxis.x * normalizedAxis.y * (1 - cosTheta) + normalizedAxis.z * sinTheta,
-		normalizedAxis.y * normalizedAxis.y + (1 - normalizedAxis.y * normalizedAxis.y) * cosTheta,
-		normalizedAxis.y * normalizedAxis.z * (1 - cosTheta) - normalizedAxis.x * sinTheta,
-		0,
-		normalizedAxis.x * normalizedAxis.z * (1 - cosTheta) - normalizedAxis.y * sinTheta,
-		normalizedAxis.y * normalizedAxis.z * (1 - cosTheta) + normalizedAxis.x * sinTheta,
-		normalizedAxis.z * normalizedAxis.z + (1 - normalizedAxis.z * normalizedAxis.z) * cosTheta,
-		0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
-}
+//Six planes (normal, distance) with normals pointing inwards, a point p is inside a plane
+//when Dot(normal, p) + distance >= 0.
+class Frustum {
+public:
+	//public methods
+	enum { Left, Right, Bottom, Top, Near, Far };
 
-Matrix4x4 Scale(const Vector3f& scale) {
-	return Matrix4x4(scale.x, 0.0f, 0.0f, 0.0f, 0.0f, scale.y, 0.0f, 0.0f,
-		             0.0f, 0.0f, scale.z, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
-}
+	Frustum() {}
 
-Matrix4x4 GetViewMatrix(const Point3f& pos, const Point3f& target, const Vector3f& viewUp) {
-	Vector3f forward = (target - pos).Normalize();
-	if (Cross(viewUp.Normalize(), forward).Length() == 0) {
-		std::cout << "hsm error : The up direction and the view direction is the same direction!" << std::endl;
-		return Matrix4x4();
+	//Planes of the clip volume -w <= x, y, z <= w of viewProjection applied to column vectors
+	//(Gribb and Hartmann), normalized so distances are in world units.
+	explicit Frustum(const Matrix4x4& viewProjection) {
+		const Float (*m)[4] = viewProjection.data;
+		for (int i = 0; i < 3; ++i) {
+			planes[2 * i] = Vector4f(m[3][0] + m[i][0], m[3][1] + m[i][1], m[3][2] + m[i][2], m[3][3] + m[i][3]);
+			planes[2 * i + 1] = Vector4f(m[3][0] - m[i][0], m[3][1] - m[i][1], m[3][2] - m[i][2], m[3][3] - m[i][3]);
+		}
+		for (int i = 0; i < 6; ++i) {
+			Float length = std::sqrt(planes[i].x * planes[i].x + planes[i].y * planes[i].y + planes[i].z * planes[i].z);
+			assert(length > 0);
+			planes[i] /= length;
+		}
+	}
+
+	//GetPerspectiveMatrix is laid out for row vectors, its transpose is used with the view matrix.
+	static Frustum FromCamera(const Point3f& pos, const Point3f& target, const Vector3f& viewUp,
+		                      Float aspect, Float fov, Float near, Float far) {
+		return Frustum(GetPerspectiveMatrix(aspect, fov, near, far).Transpose() * GetViewMatrix(pos, target, viewUp));
+	}
+
+	inline Float Distance(int plane, const Point3f& p) const {
+		const Vector4f& pl = planes[plane];
+		return pl.x * p.x + pl.y * p.y + pl.z * p.z + pl.w;
+	}
+
+	bool Contains(const Point3f& p) const {
+		for (int i = 0; i < 6; ++i)
+			if (Distance(i, p) < 0) return false;
+		return true;
+	}
+
+	Visibility Test(const Point3f& center, Float radius) const {
+		Visibility result = Visibility::Inside;
+		for (int i = 0; i < 6; ++i) {
+			Float d = Distance(i, center);
+			if (d < -radius) return Visibility::Outside;
+			if (d < radius) result = Visibility::Intersecting;
+		}
+		return result;
 	}
-	Vector3f right = Cross(viewUp.Normalize(), forward);
-	Vector3f up = Cross(forward, right);
-	Matrix4x4 rotateMat(right.x, right.y, right.z, 0.0f, up.x, up.y, up.z, 0.0f,
-		                forward.x, forward.y, forward.z, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
-	Matrix4x4 translateMat(1.0f, 0.0f, 0.0f, -pos.x, 0.0f, 1.0f, 0.0f, -pos.y,
-		                   0.0f, 0.0f, 1.0f, -pos.z, 0.0f, 0.0f, 0.0f, 1.0f);
-	return rotateMat * translateMat;
-}
 
-Matrix4x4 GetPerspectiveMatrix(Float aspect, Float fov, Float near, Float far) {
-	Float tanHalfFov = std::tan(Radians(fov) * 0.5f);
-	return Matrix4x4(1 / (aspect * tanHalfFov), 0.0f, 0.0f, 0.0f, 0.0f, 1 / tanHalfFov, 0.0f, 0.0f,
-		             0.0f, 0.0f, (near + far) / (far - near), 1.0f, 0.0f, 0.0f, (2 * far * near)/(near - far), 0.0f);
-}
+	//The corner furthest along the normal decides outside, the nearest one inside.
+	Visibility Test(const Bounds3f& b) const {
+		Visibility result = Visibility::Inside;
+		for (int i = 0; i < 6; ++i) {
+			const Vector4f& pl = planes[i];
+			Point3f pos(pl.x >= 0 ? b.pMax.x : b.pMin.x, pl.y >= 0 ? b.pMax.y : b.pMin.y, pl.z >= 0 ? b.pMax.z : b.pMin.z);
+			if (Distance(i, pos) < 0) return Visibility::Outside;
+			Point3f neg(pl.x >= 0 ? b.pMin.x : b.pMax.x, pl.y >= 0 ? b.pMin.y : b.pMax.y, pl.z >= 0 ? b.pMin.z : b.pMax.z);
+			if (Distance(i, neg) < 0) result = Visibility::Intersecting;
+		}
+		return result;
+	}
 
-template <typename T>
-inline Point3<T> Matrix4x4::operator()(const Point3<T> &p) const {
-	T x = p.x, y = p.y, z = p.z;
-	T px = data[0][0] * x + data[0][1] * y + data[0][2] * z + data[0][3];
-	T py = data[1][0] * x + data[1][1] * y + data[1][2] * z + data[1][3];
-	T pz = data[2][0] * x + data[2][1] * y + data[2][2] * z + data[2][3];
-	T pw = data[3][0] * x + data[3][1] * y + data[3][2] * z + data[3][3];
-	assert(pw != 0);
-	if (pw == 1) return Point3<T>(px, py, pz);
-	else return Point3<T>(px, py, pz) / pw;
-}
+	//Sets bit i % 32 of visible[i / 32] for every box that is not outside, visible needs
+	//(Size() + 31) / 32 words. Returns the number of visible boxes.
+	size_t Test(const Bounds3SoA& boxes, uint32_t* visible) const {
+		size_t count = boxes.Size();
+		memset(visible, 0, (count + 31) / 32 * sizeof(uint32_t));
+		//the signs of the normals pick the furthest corner once per plane
+		const Float* px[6];
+		const Float* py[6];
+		const Float* pz[6];
+		for (int k = 0; k < 6; ++k) {
+			px[k] = planes[k].x >= 0 ? boxes.pMax.x.data() : boxes.pMin.x.data();
+			py[k] = planes[k].y >= 0 ? boxes.pMax.y.data() : boxes.pMin.y.data();
+			pz[k] = planes[k].z >= 0 ? boxes.pMax.z.data() : boxes.pMin.z.data();
+		}
+		simd::ForEach(count, [&](size_t i, auto pack) {
+			typedef decltype(pack) P;
+			int inside = -1;
+			for (int k = 0; k < 6; ++k) {
+				P d = P(planes[k].x) * simd::Load<P>(&px[k][i]) + P(planes[k].y) * simd::Load<P>(&py[k][i]) +
+					  P(planes[k].z) * simd::Load<P>(&pz[k][i]) + P(planes[k].w);
+				inside &= simd::MoveMask(d >= P(0));
+			}
+			visible[i / 32] |= (uint32_t)inside << (i % 32);
+		});
+		size_t visibleCount = 0;
+		for (size_t w = 0; w < (count + 31) / 32; ++w) visibleCount += PopCount(visible[w]);
+		return visibleCount;
+	}
 
-template <typename T>
-inline Vector3<T> Matrix4x4::operator()(const Vector3<T> &v) const {
-	T x = v.x, y = v.y, z = v.z;
-	return Vector3<T>(data[0][0] * x + data[0][1] * y + data[0][2] * z,
-					  data[1][0] * x + data[1][1] * y + data[1][2] * z,
-					  data[2][0] * x + data[2][1] * y + data[2][2] * z);
-}
+	//public data
+	Vector4f planes[6];
 
-inline Ray Matrix4x4::operator()(const Ray &r) const {
-	Point3f o = (*this)(r.origin);
-	Vector3f d = (*this)(r.direction);
-	return Ray(o, d, r.time);
-}
+private:
+	static inline int PopCount(uint32_t v) {
+		v = v - ((v >> 1) & 0x55555555u);
+		v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+		return (int)((((v + (v >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+	}
+};
 
 //Quaternion
 class Quaternion {
 public:
 	//public methods
-	Quaternion():w(1), x(0), y(0), z(0) {}
-	Quaternion(Float ww, Float xx, Float yy, Float zz):w(ww), x(xx), y(yy), z(zz) {}
+	constexpr Quaternion():w(1), x(0), y(0), z(0) {}
+	constexpr Quaternion(Float ww, Float xx, Float yy, Float zz):w(ww), x(xx), y(yy), z(zz) {}
 	Quaternion(const Matrix4x4& rotMat) {
 		//trace = 4w^2 - 1 = mat[0][0] + mat[1][1] + mat[2][2]
 		Float trace = rotMat.data[0][0] + rotMat.data[1][1] + rotMat.data[2][2];
@@ -1198,27 +4702,62 @@ public:
 		}
 	}
 
-	Matrix4x4 ToMatrix4x4() const {
+	constexpr Matrix4x4 ToMatrix4x4() const {
 		Float xx = x * x, yy = y * y, zz = z * z ,xy = x * y, xz = x * z, 
 			  yz = y * z ,wx = x * w, wy = y * w, wz = z * w;
 
-		//We use the left-hand coordinate system, so we need to return the inverse matrix of this matrix.
-		//And the transpose matrix of the rotation matrix is ​​equal to its inverse matrix.
-		return Matrix4x4(1 - 2 * (yy + zz), 2 * (xy + wz), 2 * (xz - wy), 0.0f,
-						 2 * (xy - wz), 1 - 2 * (xx + zz), 2 * (yz + wx), 0.0f,
-						 2 * (xz + wy), 2 * (yz - wx), 1 - 2 * (xx + yy), 0.0f,
-						 0.0f, 0.0f, 0.0f, 1.0f).Transpose();
+		//Written directly in column-vector order, the same layout RotateX/Y/Z produce.
+		return Matrix4x4(1 - 2 * (yy + zz), 2 * (xy - wz), 2 * (xz + wy), 0.0f,
+						 2 * (xy + wz), 1 - 2 * (xx + zz), 2 * (yz - wx), 0.0f,
+						 2 * (xz - wy), 2 * (yz + wx), 1 - 2 * (xx + yy), 0.0f,
+						 0.0f, 0.0f, 0.0f, 1.0f);
+	}
+
+	//Hamilton product, q1 * q2 rotates by q2 first and then by q1, matching Matrix4x4 composition.
+	constexpr Quaternion operator * (const Quaternion& q) const {
+		return Quaternion(w * q.w - x * q.x - y * q.y - z * q.z,
+						  w * q.x + x * q.w + y * q.z - z * q.y,
+						  w * q.y - x * q.z + y * q.w + z * q.x,
+						  w * q.z + x * q.y - y * q.x + z * q.w);
+	}
+
+	constexpr Quaternion& operator *= (const Quaternion& q) {
+		*this = *this * q;
+		return *this;
+	}
+
+	constexpr Quaternion Conjugate() const {
+		return Quaternion(w, -x, -y, -z);
+	}
+
+	//For unit quaternions Conjugate() is the same rotation and skips the division.
+	constexpr Quaternion Inverse() const {
+		Float lengthSquared = w * w + x * x + y * y + z * z;
+		assert(lengthSquared != 0);
+		return Conjugate() / lengthSquared;
+	}
+
+	//Rotates by a unit quaternion without building a matrix:
+	//t = 2 * cross(q.xyz, v), v' = v + w * t + cross(q.xyz, t), 15 multiplies.
+	constexpr Vector3f Rotate(const Vector3f& v) const {
+		Float tx = y * v.z - z * v.y, ty = z * v.x - x * v.z, tz = x * v.y - y * v.x;
+		tx += tx;
+		ty += ty;
+		tz += tz;
+		return Vector3f(v.x + w * tx + (y * tz - z * ty),
+						v.y + w * ty + (z * tx - x * tz),
+						v.z + w * tz + (x * ty - y * tx));
 	}
 
-	Quaternion operator - () const {
+	constexpr Quaternion operator - () const {
 		return Quaternion(-w, -x, -y, -z);
 	}
 
-	Quaternion operator + (const Quaternion& q) const {
+	constexpr Quaternion operator + (const Quaternion& q) const {
 		return Quaternion(w + q.w, x + q.x, y + q.y, z + q.z);
 	}
 
-	Quaternion& operator += (const Quaternion& q) {
+	constexpr Quaternion& operator += (const Quaternion& q) {
 		w += q.w;
 		x += q.x;
 		y += q.y;
@@ -1226,11 +4765,11 @@ public:
 		return *this;
 	}
 
-	Quaternion operator - (const Quaternion& q) const {
+	constexpr Quaternion operator - (const Quaternion& q) const {
 		return Quaternion(w - q.w, x - q.x, y - q.y, z - q.z);
 	}
 
-	Quaternion& operator -= (const Quaternion& q) {
+	constexpr Quaternion& operator -= (const Quaternion& q) {
 		w -= q.w;
 		x -= q.x;
 		y -= q.y;
@@ -1238,24 +4777,26 @@ public:
 		return *this;
 	}
 
-	Quaternion &operator*=(Float n) {
+	constexpr Quaternion &operator*=(Float n) {
 		w *= n;
 		x *= n;
 		y *= n;
 		z *= n;
 		return *this;
 	}
-	Quaternion operator*(Float n) const {
+	constexpr Quaternion operator*(Float n) const {
 		return Quaternion(w * n, x * n, y * n, z * n);
 	}
-	Quaternion &operator/=(Float n) {
-		w *= n;
-		x *= n;
-		y *= n;
-		z *= n;
+	constexpr Quaternion &operator/=(Float n) {
+		assert(n != 0);
+		Float inverse = (Float)1 / n;
+		w *= inverse;
+		x *= inverse;
+		y *= inverse;
+		z *= inverse;
 		return *this;
 	}
-	Quaternion operator/(Float n) const {
+	constexpr Quaternion operator/(Float n) const {
 		assert(n != 0);
 		Float inverse = (Float)1 / n;
 		return Quaternion(w * inverse, x * inverse, y * inverse, z * inverse);
@@ -1267,15 +4808,31 @@ public:
 	Float w, x, y, z;
 };
 
-Quaternion CreateQuaternionByVec3(const Vector3f& rotation) {
-	auto rotMat = Matrix4x4();
-	if (rotation.x != 0)rotMat = rotMat * RotateX(rotation.x);
-	if (rotation.y != 0)rotMat = rotMat * RotateY(rotation.y);
-	if (rotation.z != 0)rotMat = rotMat * RotateZ(rotation.z);
-	return Quaternion(rotMat);
+static_assert(std::is_trivially_copyable<Quaternion>::value, "math types are copied with memcpy");
+
+//Euler angles in degrees, the same rotation as RotateX(x) * RotateY(y) * RotateZ(z),
+//expanded from the product of the three half-angle quaternions.
+constexpr Quaternion CreateQuaternionByVec3(const Vector3f& rotation) {
+	Float cx = 0, sx = 0, cy = 0, sy = 0, cz = 0, sz = 0;
+	SinCos(Radians(rotation.x) * 0.5f, sx, cx);
+	SinCos(Radians(rotation.y) * 0.5f, sy, cy);
+	SinCos(Radians(rotation.z) * 0.5f, sz, cz);
+	Float cxcy = cx * cy, sxsy = sx * sy, sxcy = sx * cy, cxsy = cx * sy;
+	return Quaternion(cxcy * cz - sxsy * sz,
+					  sxcy * cz + cxsy * sz,
+					  cxsy * cz - sxcy * sz,
+					  cxcy * sz + sxsy * cz);
+}
+
+//Same rotation as Rotate(axis, degree).
+inline Quaternion CreateQuaternionByAxisAngle(const Vector3f& axis, Float degree) {
+	Vector3f normalizedAxis = axis.Normalize();
+	Float sinHalf, cosHalf;
+	simd::SinCos(Radians(degree) * 0.5f, sinHalf, cosHalf);
+	return Quaternion(cosHalf, normalizedAxis.x * sinHalf, normalizedAxis.y * sinHalf, normalizedAxis.z * sinHalf);
 }
 
-inline Quaternion operator * (Float n, const Quaternion &q) { 
+constexpr Quaternion operator * (Float n, const Quaternion &q) { 
 	return q * n; 
 }
 
@@ -1284,20 +4841,810 @@ inline std::ostream& operator << (std::ostream &o, const Quaternion &q) {
 	return o;
 }
 
-inline Float Dot(const Quaternion& q1, const Quaternion& q2) {
+constexpr Float Dot(const Quaternion& q1, const Quaternion& q2) {
 	return q1.w * q2.w + q1.x * q2.x + q1.y * q2.y + q1.z * q2.z;
 }
 
-Quaternion Slerp(Float n, const Quaternion& q1, const Quaternion& q2) {
+//Bulk Quaternion::Rotate, out may be the same container as v.
+inline void Rotate(const Quaternion& q, const Vector3SoA& v, Vector3SoA& out) {
+	out.Resize(v.Size());
+	simd::ForEach(v.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P qw(q.w), qx(q.x), qy(q.y), qz(q.z);
+		P x = simd::Load<P>(&v.x[i]), y = simd::Load<P>(&v.y[i]), z = simd::Load<P>(&v.z[i]);
+		P tx = qy * z - qz * y, ty = qz * x - qx * z, tz = qx * y - qy * x;
+		tx = tx + tx;
+		ty = ty + ty;
+		tz = tz + tz;
+		simd::Store(&out.x[i], x + qw * tx + (qy * tz - qz * ty));
+		simd::Store(&out.y[i], y + qw * ty + (qz * tx - qx * tz));
+		simd::Store(&out.z[i], z + qw * tz + (qx * ty - qy * tx));
+	});
+}
+
+//q and -q are the same rotation, q2 is flipped onto q1's hemisphere so the blend takes the shorter arc.
+inline Quaternion Slerp(Float n, const Quaternion& q1, const Quaternion& q2) {
 	Float cosTheta = Dot(q1, q2);
-	//If the dot product is negative, slerp won't take the shorter path.
+	Quaternion q2Near = cosTheta < 0 ? -q2 : q2;
+	cosTheta = std::abs(cosTheta);
 	if (cosTheta > .9995f)
-		return ((1 - n) * q1 + n * q2).Normalize();
+		return ((1 - n) * q1 + n * q2Near).Normalize();
 	else {
-		Float theta = std::acos(Clamp(cosTheta, -1, 1));
-		Float thetaN = theta * n;
-		Quaternion q3 = (q2 - q1 * cosTheta).Normalize();
-		return q1 * std::cos(thetaN) + q3 * std::sin(thetaN);
+		Float theta = simd::ACos(Clamp(cosTheta, -1, 1));
+		Float sinThetaN, cosThetaN;
+		simd::SinCos(theta * n, sinThetaN, cosThetaN);
+		Quaternion q3 = (q2Near - q1 * cosTheta).Normalize();
+		return q1 * cosThetaN + q3 * sinThetaN;
+	}
+}
+
+inline Quaternion Nlerp(Float n, const Quaternion& q1, const Quaternion& q2) {
+	Float n2 = Dot(q1, q2) < 0 ? -n : n;
+	return (q1 * (1 - n) + q2 * n2).Normalize();
+}
+
+//Weights w1, w2 with slerp = q1 * w1 + q2 * w2 for cosTheta in [0, 1], without acos or sin.
+//sin(t * theta) / sin(theta) is expanded as a polynomial in cosTheta - 1 (Eberly, "A Fast and Accurate
+//Algorithm for Computing SLERP"), the last term is rescaled to fold in the truncated tail.
+template <typename P>
+inline void SlerpFastWeights(P t, P cosTheta, P& w1, P& w2) {
+	static const Float mu = (Float)1.85298109240830;
+	static const Float u[8] = { (Float)1 / 3, (Float)1 / 10, (Float)1 / 21, (Float)1 / 36,
+								(Float)1 / 55, (Float)1 / 78, (Float)1 / 105, mu / 136 };
+	static const Float v[8] = { (Float)1 / 3, (Float)2 / 5, (Float)3 / 7, (Float)4 / 9,
+								(Float)5 / 11, (Float)6 / 13, (Float)7 / 15, mu * 8 / 17 };
+	P xm1 = cosTheta - P(1), d = P(1) - t, sqrT = t * t, sqrD = d * d;
+	P cT = P(1), cD = P(1);
+	for (int i = 7; i >= 0; --i) {
+		cT = P(1) + (P(u[i]) * sqrT - P(v[i])) * xm1 * cT;
+		cD = P(1) + (P(u[i]) * sqrD - P(v[i])) * xm1 * cD;
+	}
+	w1 = d * cD;
+	w2 = t * cT;
+}
+
+//Polynomial slerp without transcendental calls, components stay within 3e-5 of Slerp for unit inputs.
+//The truncated series dominates the error, the weights are off by up to 1.9e-5 near cosTheta = 0.13.
+inline Quaternion SlerpFast(Float n, const Quaternion& q1, const Quaternion& q2) {
+	Float cosTheta = Dot(q1, q2), w1, w2;
+	SlerpFastWeights(n, std::abs(cosTheta), w1, w2);
+	return q1 * w1 + q2 * (cosTheta < 0 ? -w2 : w2);
+}
+
+//Quaternions as four component arrays, the layout the batched blends stream through.
+class QuaternionSoA {
+public:
+	//public methods
+	QuaternionSoA() {}
+	explicit QuaternionSoA(size_t n) { Resize(n); }
+	QuaternionSoA(const Quaternion* aos, size_t n) { FromAoS(aos, n); }
+
+	inline size_t Size() const { return w.size(); }
+
+	void Resize(size_t n) {
+		w.resize(n);
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+	}
+
+	Quaternion operator [](size_t i) const {
+		assert(i < Size());
+		return Quaternion(w[i], x[i], y[i], z[i]);
+	}
+
+	void Set(size_t i, const Quaternion& q) {
+		assert(i < Size());
+		w[i] = q.w;
+		x[i] = q.x;
+		y[i] = q.y;
+		z[i] = q.z;
+	}
+
+	void FromAoS(const Quaternion* aos, size_t n) {
+		Resize(n);
+		for (size_t i = 0; i < n; ++i) Set(i, aos[i]);
+	}
+
+	void ToAoS(Quaternion* aos) const {
+		for (size_t i = 0; i < Size(); ++i) aos[i] = (*this)[i];
+	}
+
+	//public data
+	AlignedVector<Float> w, x, y, z;
+};
+
+//Bulk blends with one weight n for every pair, out is resized and may be the same container as an input.
+//weights(cosTheta, s1, s2) picks the blend, the shared part writes q1 * s1 + q2 * s2.
+template <typename Weights>
+inline void BlendQuaternions(const QuaternionSoA& q1, const QuaternionSoA& q2, QuaternionSoA& out, bool normalize, Weights weights) {
+	assert(q1.Size() == q2.Size());
+	out.Resize(q1.Size());
+	simd::ForEach(q1.Size(), [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		P w1 = simd::Load<P>(&q1.w[i]), x1 = simd::Load<P>(&q1.x[i]), y1 = simd::Load<P>(&q1.y[i]), z1 = simd::Load<P>(&q1.z[i]);
+		P w2 = simd::Load<P>(&q2.w[i]), x2 = simd::Load<P>(&q2.x[i]), y2 = simd::Load<P>(&q2.y[i]), z2 = simd::Load<P>(&q2.z[i]);
+		P cosTheta = w1 * w2 + x1 * x2 + y1 * y2 + z1 * z2;
+		//Shortest path, the sign goes onto q2's weight
+		P sign = simd::Select(cosTheta < P(0), P(-1), P(1));
+		P s1, s2;
+		weights(cosTheta * sign, s1, s2);
+		s2 = s2 * sign;
+		P w = w1 * s1 + w2 * s2, x = x1 * s1 + x2 * s2, y = y1 * s1 + y2 * s2, z = z1 * s1 + z2 * s2;
+		if (normalize) {
+			P inverse = simd::RSqrt(w * w + x * x + y * y + z * z);
+			w = w * inverse;
+			x = x * inverse;
+			y = y * inverse;
+			z = z * inverse;
+		}
+		simd::Store(&out.w[i], w);
+		simd::Store(&out.x[i], x);
+		simd::Store(&out.y[i], y);
+		simd::Store(&out.z[i], z);
+	});
+}
+
+inline void Slerp(Float n, const QuaternionSoA& q1, const QuaternionSoA& q2, QuaternionSoA& out) {
+	BlendQuaternions(q1, q2, out, true, [n](auto cosTheta, auto& s1, auto& s2) {
+		typedef typename std::decay<decltype(cosTheta)>::type P;
+		//Nearly parallel inputs fall back to the linear weights, sin(theta) would cancel
+		auto linear = cosTheta > P(.9995f);
+		P theta = simd::ACos(simd::Min(cosTheta, P(1)));
+		P sinTheta = simd::Select(linear, P(1), simd::Sin(theta));
+		s1 = simd::Select(linear, P(1 - n), simd::Sin(P(1 - n) * theta) / sinTheta);
+		s2 = simd::Select(linear, P(n), simd::Sin(P(n) * theta) / sinTheta);
+	});
+}
+
+inline void SlerpFast(Float n, const QuaternionSoA& q1, const QuaternionSoA& q2, QuaternionSoA& out) {
+	BlendQuaternions(q1, q2, out, false, [n](auto cosTheta, auto& s1, auto& s2) {
+		typedef typename std::decay<decltype(cosTheta)>::type P;
+		SlerpFastWeights(P(n), cosTheta, s1, s2);
+	});
+}
+
+inline void Nlerp(Float n, const QuaternionSoA& q1, const QuaternionSoA& q2, QuaternionSoA& out) {
+	BlendQuaternions(q1, q2, out, true, [n](auto cosTheta, auto& s1, auto& s2) {
+		typedef typename std::decay<decltype(cosTheta)>::type P;
+		s1 = P(1 - n);
+		s2 = P(n);
+	});
+}
+
+//Dual quaternion
+//real + e * dual for a rigid transform, real is the rotation and dual = 0.5 * t * real with t the translation
+//as a pure quaternion. Blending dual quaternions keeps skinned volumes rigid where blended matrices collapse.
+class DualQuaternion {
+public:
+	//public methods
+	constexpr DualQuaternion():real(), dual(0, 0, 0, 0) {}
+	constexpr DualQuaternion(const Quaternion& r, const Quaternion& d):real(r), dual(d) {}
+	//Rotates first, then translates
+	constexpr DualQuaternion(const Quaternion& rotation, const Vector3f& translation)
+		:real(rotation), dual(Quaternion(0, translation.x, translation.y, translation.z) * rotation * (Float)0.5) {}
+
+	//q1 * q2 applies q2 first, like Matrix4x4 composition
+	constexpr DualQuaternion operator * (const DualQuaternion& q) const {
+		return DualQuaternion(real * q.real, real * q.dual + dual * q.real);
+	}
+
+	constexpr DualQuaternion& operator *= (const DualQuaternion& q) {
+		*this = *this * q;
+		return *this;
+	}
+
+	constexpr DualQuaternion operator + (const DualQuaternion& q) const {
+		return DualQuaternion(real + q.real, dual + q.dual);
+	}
+
+	constexpr DualQuaternion& operator += (const DualQuaternion& q) {
+		real += q.real;
+		dual += q.dual;
+		return *this;
+	}
+
+	constexpr DualQuaternion operator * (Float n) const {
+		return DualQuaternion(real * n, dual * n);
+	}
+
+	constexpr DualQuaternion Conjugate() const {
+		return DualQuaternion(real.Conjugate(), dual.Conjugate());
+	}
+
+	//For unit dual quaternions Conjugate() is the same and skips the divisions.
+	constexpr DualQuaternion Inverse() const {
+		Quaternion realInverse = real.Inverse();
+		return DualQuaternion(realInverse, -(realInverse * dual * realInverse));
+	}
+
+	//Scales real to unit length and removes the part of dual that is not orthogonal to it.
+	inline DualQuaternion Normalize() const {
+		Float length = std::sqrt(Dot(real, real));
+		assert(length != 0);
+		Quaternion r = real / length, d = dual / length;
+		return DualQuaternion(r, d - r * Dot(r, d));
+	}
+
+	constexpr Quaternion GetRotation() const { return real; }
+
+	//2 * dual * conjugate(real), written out for a unit real part
+	constexpr Vector3f GetTranslation() const {
+		return Vector3f(2 * (real.w * dual.x - dual.w * real.x + real.y * dual.z - real.z * dual.y),
+						2 * (real.w * dual.y - dual.w * real.y + real.z * dual.x - real.x * dual.z),
+						2 * (real.w * dual.z - dual.w * real.z + real.x * dual.y - real.y * dual.x));
+	}
+
+	constexpr Matrix4x4 ToMatrix4x4() const {
+		Matrix4x4 m = real.ToMatrix4x4();
+		Vector3f t = GetTranslation();
+		m.data[0][3] = t.x;
+		m.data[1][3] = t.y;
+		m.data[2][3] = t.z;
+		return m;
+	}
+
+	constexpr Point3f operator()(const Point3f& p) const {
+		return Point3f(real.Rotate(Vector3f(p.x, p.y, p.z))) + GetTranslation();
+	}
+
+	constexpr Vector3f operator()(const Vector3f& v) const {
+		return real.Rotate(v);
+	}
+
+	//public data
+	Quaternion real, dual;
+};
+
+static_assert(std::is_trivially_copyable<DualQuaternion>::value, "math types are copied with memcpy");
+static_assert(sizeof(DualQuaternion) == 8 * sizeof(Float), "skinning gathers bone components with a fixed stride");
+
+constexpr DualQuaternion operator * (Float n, const DualQuaternion& q) {
+	return q * n;
+}
+
+inline std::ostream& operator << (std::ostream &o, const DualQuaternion &q) {
+	o << '[' << q.real << ',' << q.dual << ']';
+	return o;
+}
+
+//Linear blend dual quaternion skinning of the vertices [begin, end), up to four bones per vertex.
+//boneIndices and boneWeights hold four entries per vertex, unused slots have weight 0. Each bone is blended
+//on the hemisphere of the vertex's first bone so antipodal rotations don't cancel out.
+//out and outNormals have to be sized like positions already, disjoint spans can then run on different threads
+//(see ParallelFor).
+inline void SkinDualQuaternions(const DualQuaternion* bones, const uint32_t* boneIndices, const Float* boneWeights,
+								const Point3SoA& positions, Point3SoA& out, size_t begin, size_t end,
+								const Vector3SoA* normals = nullptr, Vector3SoA* outNormals = nullptr) {
+	assert(begin <= end && end <= positions.Size() && out.Size() == positions.Size());
+	assert(!normals || (outNormals && normals->Size() == positions.Size() && outNormals->Size() == positions.Size()));
+	const Float* base = &bones[0].real.w;
+	simd::ForEach(end - begin, [&](size_t i, auto pack) {
+		typedef decltype(pack) P;
+		size_t v = begin + i;
+		//Blended real (rw, rx, ry, rz) and dual (dw, dx, dy, dz) parts
+		P rw(0), rx(0), ry(0), rz(0), dw(0), dx(0), dy(0), dz(0);
+		P w0(0), x0(0), y0(0), z0(0);
+		for (int k = 0; k < 4; ++k) {
+			const uint32_t* index = &boneIndices[4 * v + k];
+			P weight = simd::LoadStrided<P>(&boneWeights[4 * v + k], 4);
+			P bw = simd::Gather<P>(base + 0, 8, index, 4), bx = simd::Gather<P>(base + 1, 8, index, 4);
+			P by = simd::Gather<P>(base + 2, 8, index, 4), bz = simd::Gather<P>(base + 3, 8, index, 4);
+			if (k == 0) {
+				w0 = bw;
+				x0 = bx;
+				y0 = by;
+				z0 = bz;
+			}
+			else weight = simd::Select(bw * w0 + bx * x0 + by * y0 + bz * z0 < P(0), P(0) - weight, weight);
+			rw = rw + bw * weight;
+			rx = rx + bx * weight;
+			ry = ry + by * weight;
+			rz = rz + bz * weight;
+			dw = dw + simd::Gather<P>(base + 4, 8, index, 4) * weight;
+			dx = dx + simd::Gather<P>(base + 5, 8, index, 4) * weight;
+			dy = dy + simd::Gather<P>(base + 6, 8, index, 4) * weight;
+			dz = dz + simd::Gather<P>(base + 7, 8, index, 4) * weight;
+		}
+		//Dividing both parts by |real| gives the unit dual quaternion, its translation and rotation follow directly
+		P inverse = simd::RSqrt(rw * rw + rx * rx + ry * ry + rz * rz);
+		rw = rw * inverse;
+		rx = rx * inverse;
+		ry = ry * inverse;
+		rz = rz * inverse;
+		dw = dw * inverse;
+		dx = dx * inverse;
+		dy = dy * inverse;
+		dz = dz * inverse;
+		P tx = rw * dx - dw * rx + ry * dz - rz * dy;
+		P ty = rw * dy - dw * ry + rz * dx - rx * dz;
+		P tz = rw * dz - dw * rz + rx * dy - ry * dx;
+		//Quaternion::Rotate plus 2 * t
+		auto rotate = [&](P x, P y, P z, P& ox, P& oy, P& oz) {
+			P cx = ry * z - rz * y, cy = rz * x - rx * z, cz = rx * y - ry * x;
+			cx = cx + cx;
+			cy = cy + cy;
+			cz = cz + cz;
+			ox = x + rw * cx + (ry * cz - rz * cy);
+			oy = y + rw * cy + (rz * cx - rx * cz);
+			oz = z + rw * cz + (rx * cy - ry * cx);
+		};
+		P ox, oy, oz;
+		rotate(simd::Load<P>(&positions.x[v]), simd::Load<P>(&positions.y[v]), simd::Load<P>(&positions.z[v]), ox, oy, oz);
+		simd::Store(&out.x[v], ox + tx + tx);
+		simd::Store(&out.y[v], oy + ty + ty);
+		simd::Store(&out.z[v], oz + tz + tz);
+		if (normals) {
+			rotate(simd::Load<P>(&normals->x[v]), simd::Load<P>(&normals->y[v]), simd::Load<P>(&normals->z[v]), ox, oy, oz);
+			simd::Store(&outNormals->x[v], ox);
+			simd::Store(&outNormals->y[v], oy);
+			simd::Store(&outNormals->z[v], oz);
+		}
+	});
+}
+
+//Thread pool
+//Tasks go to one shared queue. A thread that waits on a TaskGroup runs queued tasks in the meantime,
+//so nested fork-join work never blocks on itself.
+class ThreadPool {
+public:
+	//public methods
+	//threadCount includes the calling thread, 0 uses every hardware thread
+	explicit ThreadPool(int threadCount = 0) {
+		if (threadCount <= 0) threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 1; i < threadCount; ++i) workers.emplace_back([this] { WorkerLoop(); });
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		condition.notify_all();
+		for (std::thread& worker : workers) worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+
+	inline int ThreadCount() const { return (int)workers.size() + 1; }
+
+	void Enqueue(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push_back(std::move(task));
+		}
+		condition.notify_one();
+	}
+
+	//Runs one queued task on the calling thread, returns false when the queue is empty.
+	bool RunOne() {
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tasks.empty()) return false;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+		return true;
+	}
+
+private:
+	void WorkerLoop() {
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [this] { return stop || !tasks.empty(); });
+				if (stop && tasks.empty()) return;
+				task = std::move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
 	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stop = false;
+};
+
+//Fork-join group of tasks on a ThreadPool
+class TaskGroup {
+public:
+	//public methods
+	explicit TaskGroup(ThreadPool& p) : pool(p), pending(0) {}
+	~TaskGroup() { Wait(); }
+
+	void Run(std::function<void()> task) {
+		++pending;
+		pool.Enqueue([this, task] {
+			task();
+			--pending;
+		});
+	}
+
+	void Wait() {
+		while (pending > 0)
+			if (!pool.RunOne()) std::this_thread::yield();
+	}
+
+private:
+	ThreadPool& pool;
+	std::atomic<int> pending;
+};
+
+//Splits [start, end) into chunkCount ranges and runs f(chunk, begin, end) for each of them on the pool.
+template <typename F>
+inline void ParallelFor(ThreadPool& pool, int start, int end, int chunkCount, F f) {
+	TaskGroup group(pool);
+	for (int c = 0; c < chunkCount; ++c) {
+		int begin = start + (int)((long long)(end - start) * c / chunkCount);
+		int last = start + (int)((long long)(end - start) * (c + 1) / chunkCount);
+		group.Run([&f, c, begin, last] { f(c, begin, last); });
+	}
+	group.Wait();
+}
+
+//Multithreaded bounds reductions, each thread reduces a chunk with the SIMD kernel. Min and max are exact,
+//so merging the partial boxes gives the serial result.
+template <typename Reduce>
+inline Bounds3f ComputeBoundsParallel(ThreadPool& pool, size_t count, Reduce reduce) {
+	//below this a chunk costs less than waking a worker
+	const size_t ParallelThreshold = 1 << 16;
+	if (pool.ThreadCount() <= 1 || count < ParallelThreshold) return reduce(0, count);
+	assert(count <= (size_t)std::numeric_limits<int>::max());
+	int chunks = pool.ThreadCount();
+	std::vector<Bounds3f> partial(chunks);
+	ParallelFor(pool, 0, (int)count, chunks, [&](int c, int begin, int end) { partial[c] = reduce(begin, end); });
+	Bounds3f b;
+	for (const Bounds3f& p : partial) b = Union(b, p);
+	return b;
+}
+
+inline Bounds3f ComputeBounds(ThreadPool& pool, const Point3f* points, size_t count) {
+	return ComputeBoundsParallel(pool, count, [=](size_t begin, size_t end) { return ComputeBounds(points + begin, end - begin); });
 }
+
+inline Bounds3f ComputeBounds(ThreadPool& pool, const Bounds3f* boxes, size_t count) {
+	return ComputeBoundsParallel(pool, count, [=](size_t begin, size_t end) { return ComputeBounds(boxes + begin, end - begin); });
+}
+
+inline Bounds3f ComputeBounds(ThreadPool& pool, const Point3SoA& points) {
+	return ComputeBoundsParallel(pool, points.Size(), [&](size_t begin, size_t end) { return ComputeBounds(points, begin, end); });
+}
+
+inline Bounds3f ComputeBounds(ThreadPool& pool, const Bounds3SoA& boxes) {
+	return ComputeBoundsParallel(pool, boxes.Size(), [&](size_t begin, size_t end) { return ComputeBounds(boxes, begin, end); });
+}
+
+//BVH
+//Node of the linearized tree, 32 bytes in float. The first child of an interior node directly follows it.
+struct BVHNode {
+	Bounds3f bounds;
+	union {
+		int primitivesOffset;   //leaf
+		int secondChildOffset;  //interior
+	};
+	uint16_t primitiveCount;    //0 for interior nodes
+	uint8_t axis;               //split axis of interior nodes
+	uint8_t pad;
+};
+
+#if !defined(USE_DOUBLE)
+static_assert(sizeof(BVHNode) == 32, "BVHNode should fill half a cache line");
+#endif
+
+//Bounding volume hierarchy over user primitives, built with binned SAH.
+//The primitives are only seen through their index, the bounds and centroid callbacks of Build
+//and the intersection callback of Intersect.
+class BVH {
+public:
+	//public methods
+	BVH() {}
+
+	template <typename BoundsFunc, typename CentroidFunc>
+	BVH(int count, BoundsFunc bounds, CentroidFunc centroid, int maxPrimitivesInNode = 4) {
+		Build(count, bounds, centroid, maxPrimitivesInNode);
+	}
+
+	//bounds(i) returns the Bounds3f of primitive i, centroid(i) its Point3f centroid
+	template <typename BoundsFunc, typename CentroidFunc>
+	void Build(int count, BoundsFunc bounds, CentroidFunc centroid, int maxPrimitivesInNode = 4) {
+		std::vector<BuildPrimitive> primitives(count);
+		for (int i = 0; i < count; ++i) {
+			primitives[i].bounds = bounds(i);
+			primitives[i].centroid = centroid(i);
+			primitives[i].index = i;
+		}
+		Finish(primitives, maxPrimitivesInNode, nullptr);
+	}
+
+	//Builds the same tree as Build on threadCount threads (0 uses every hardware thread).
+	//The callbacks are called concurrently.
+	template <typename BoundsFunc, typename CentroidFunc>
+	void BuildParallel(int count, BoundsFunc bounds, CentroidFunc centroid, int threadCount = 0, int maxPrimitivesInNode = 4) {
+		ThreadPool pool(threadCount);
+		std::vector<BuildPrimitive> primitives(count);
+		ParallelFor(pool, 0, count, pool.ThreadCount() * 4, [&](int, int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				primitives[i].bounds = bounds(i);
+				primitives[i].centroid = centroid(i);
+				primitives[i].index = i;
+			}
+		});
+		Finish(primitives, maxPrimitivesInNode, pool.ThreadCount() > 1 ? &pool : nullptr);
+	}
+
+	//intersect(i, ray, tMax) tests primitive i and shrinks tMax on a closer hit, returning true.
+	//Returns the closest primitive hit before tMax, or -1, tMax receives its distance.
+	template <typename IntersectFunc>
+	int Intersect(const Ray& ray, Float& tMax, IntersectFunc intersect) const {
+		return Traverse(PrecomputedRay(ray, 0, tMax), tMax, intersect, false);
+	}
+
+	//Stops at the first primitive hit before tMax.
+	template <typename IntersectFunc>
+	bool IntersectP(const Ray& ray, Float tMax, IntersectFunc intersect) const {
+		return Traverse(PrecomputedRay(ray, 0, tMax), tMax, intersect, true) >= 0;
+	}
+
+	//Same within [ray.tMin, ray.tMax], the callback gets ray.tMax to shrink and ray itself, which is a Ray.
+	//Reusing one PrecomputedRay saves its setup when a ray is traced against several trees.
+	template <typename IntersectFunc>
+	int Intersect(PrecomputedRay& ray, IntersectFunc intersect) const {
+		return Traverse(ray, ray.tMax, intersect, false);
+	}
+
+	template <typename IntersectFunc>
+	bool IntersectP(const PrecomputedRay& ray, IntersectFunc intersect) const {
+		Float tMax = ray.tMax;
+		return Traverse(ray, tMax, intersect, true) >= 0;
+	}
+
+	inline Bounds3f Bounds() const { return nodes.empty() ? Bounds3f() : nodes[0].bounds; }
+
+	//public data
+	std::vector<BVHNode> nodes;
+	//primitive indices in leaf order, leaves refer to ranges of this array
+	std::vector<int> primitiveIndices;
+
+private:
+	struct BuildPrimitive {
+		Bounds3f bounds;
+		Point3f centroid;
+		int index;
+	};
+
+	static const int BinCount = 12;
+	//ranges smaller than this are reduced and built on a single thread
+	static const int ParallelThreshold = 4096;
+
+	struct Bins {
+		int counts[BinCount];
+		Bounds3f bounds[BinCount];
+	};
+
+	void Finish(std::vector<BuildPrimitive>& primitives, int maxPrimitivesInNode, ThreadPool* pool) {
+		int count = (int)primitives.size();
+		maxPrimitives = Clamp(maxPrimitivesInNode, 1, 0xFFFF);
+		nodes.clear();
+		nodes.reserve(count > 0 ? 2 * count - 1 : 0);
+		if (count > 0) BuildRecursive(primitives.data(), 0, count, nodes, pool);
+		primitiveIndices.resize(count);
+		for (int i = 0; i < count; ++i) primitiveIndices[i] = primitives[i].index;
+	}
+
+	static int MakeLeaf(std::vector<BVHNode>& out, const Bounds3f& bounds, int start, int end) {
+		BVHNode node;
+		node.bounds = bounds;
+		node.primitivesOffset = start;
+		node.primitiveCount = (uint16_t)(end - start);
+		node.axis = 0;
+		node.pad = 0;
+		out.push_back(node);
+		return (int)out.size() - 1;
+	}
+
+	//Appends a subtree built into its own array, returns the index of its root in out.
+	static int Splice(std::vector<BVHNode>& out, const std::vector<BVHNode>& subtree) {
+		int base = (int)out.size();
+		for (BVHNode node : subtree) {
+			if (node.primitiveCount == 0) node.secondChildOffset += base;
+			out.push_back(node);
+		}
+		return base;
+	}
+
+	static void ComputeBounds(const BuildPrimitive* primitives, int start, int end,
+		                      Bounds3f& bounds, Bounds3f& centroidBounds, ThreadPool* pool) {
+		bounds = centroidBounds = Bounds3f();
+		if (!pool || end - start < ParallelThreshold) {
+			for (int i = start; i < end; ++i) {
+				bounds = Union(bounds, primitives[i].bounds);
+				centroidBounds = Union(centroidBounds, primitives[i].centroid);
+			}
+			return;
+		}
+		//min and max are exact, so merging the partial bounds gives the serial result
+		int chunks = pool->ThreadCount();
+		std::vector<Bounds3f> partial(2 * chunks);
+		ParallelFor(*pool, start, end, chunks, [&](int c, int begin, int last) {
+			ComputeBounds(primitives, begin, last, partial[2 * c], partial[2 * c + 1], nullptr);
+		});
+		for (int c = 0; c < chunks; ++c) {
+			bounds = Union(bounds, partial[2 * c]);
+			centroidBounds = Union(centroidBounds, partial[2 * c + 1]);
+		}
+	}
+
+	//Clamped before the cast, a NaN centroid falls into the first bin instead of an int overflow.
+	static int BinIndex(const BuildPrimitive& p, int axis, Float cMin, Float binScale) {
+		Float b = (p.centroid[axis] - cMin) * binScale;
+		if (!(b > 0)) return 0;
+		return b < BinCount - 1 ? (int)b : BinCount - 1;
+	}
+
+	static void SplitEqualCounts(BuildPrimitive* primitives, int start, int mid, int end, int axis) {
+		std::nth_element(primitives + start, primitives + mid, primitives + end,
+			[=](const BuildPrimitive& a, const BuildPrimitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	static void ComputeBins(const BuildPrimitive* primitives, int start, int end, int axis, Float cMin, Float binScale,
+		                    Bins& bins, ThreadPool* pool) {
+		for (int b = 0; b < BinCount; ++b) {
+			bins.counts[b] = 0;
+			bins.bounds[b] = Bounds3f();
+		}
+		if (!pool || end - start < ParallelThreshold) {
+			for (int i = start; i < end; ++i) {
+				int b = BinIndex(primitives[i], axis, cMin, binScale);
+				++bins.counts[b];
+				bins.bounds[b] = Union(bins.bounds[b], primitives[i].bounds);
+			}
+			return;
+		}
+		int chunks = pool->ThreadCount();
+		std::vector<Bins> partial(chunks);
+		ParallelFor(*pool, start, end, chunks, [&](int c, int begin, int last) {
+			ComputeBins(primitives, begin, last, axis, cMin, binScale, partial[c], nullptr);
+		});
+		for (int c = 0; c < chunks; ++c) {
+			for (int b = 0; b < BinCount; ++b) {
+				bins.counts[b] += partial[c].counts[b];
+				bins.bounds[b] = Union(bins.bounds[b], partial[c].bounds[b]);
+			}
+		}
+	}
+
+	int BuildRecursive(BuildPrimitive* primitives, int start, int end, std::vector<BVHNode>& out, ThreadPool* pool) const {
+		Bounds3f bounds, centroidBounds;
+		ComputeBounds(primitives, start, end, bounds, centroidBounds, pool);
+		int count = end - start;
+		if (count == 1) return MakeLeaf(out, bounds, start, end);
+
+		int axis = MaxDimension(centroidBounds.Diagonal());
+		Float cMin = centroidBounds.pMin[axis], cMax = centroidBounds.pMax[axis];
+		int mid = (start + end) / 2;
+		Float binScale = BinCount / (cMax - cMin);
+		if (cMin == cMax) {
+			//all centroids coincide, no split can separate them
+			if (count <= maxPrimitives) return MakeLeaf(out, bounds, start, end);
+		}
+		else if (!std::isfinite(binScale)) {
+			//a denormal or NaN centroid extent has no usable bins
+			SplitEqualCounts(primitives, start, mid, end, axis);
+		}
+		else {
+			//binned SAH, the cost of a split is relative to one primitive intersection
+			Bins bins;
+			ComputeBins(primitives, start, end, axis, cMin, binScale, bins, pool);
+
+			//sweep from the right to get the area and count above each split
+			Float areaAbove[BinCount - 1];
+			int countAbove[BinCount - 1];
+			Bounds3f above;
+			int aboveCount = 0;
+			for (int b = BinCount - 1; b > 0; --b) {
+				above = Union(above, bins.bounds[b]);
+				aboveCount += bins.counts[b];
+				areaAbove[b - 1] = aboveCount ? above.SurfaceArea() : 0;
+				countAbove[b - 1] = aboveCount;
+			}
+			Bounds3f below;
+			int belowCount = 0, bestSplit = -1;
+			Float bestCost = Infinity;
+			for (int b = 0; b < BinCount - 1; ++b) {
+				below = Union(below, bins.bounds[b]);
+				belowCount += bins.counts[b];
+				Float areaBelow = belowCount ? below.SurfaceArea() : 0;
+				Float cost = belowCount * areaBelow + countAbove[b] * areaAbove[b];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestSplit = b;
+				}
+			}
+			Float splitCost = 1 + bestCost / bounds.SurfaceArea();
+			if (count <= maxPrimitives && splitCost >= count) return MakeLeaf(out, bounds, start, end);
+
+			BuildPrimitive* pmid = std::partition(primitives + start, primitives + end, [=](const BuildPrimitive& p) {
+				return BinIndex(p, axis, cMin, binScale) <= bestSplit;
+			});
+			mid = (int)(pmid - primitives);
+			//every centroid fell into one side, fall back to an equal count split
+			if (mid == start || mid == end) {
+				mid = (start + end) / 2;
+				SplitEqualCounts(primitives, start, mid, end, axis);
+			}
+		}
+
+		int nodeIndex = (int)out.size();
+		out.push_back(BVHNode());
+		int second;
+		if (pool && count >= ParallelThreshold) {
+			//the children are built into their own arrays and spliced in depth-first order
+			std::vector<BVHNode> left, right;
+			TaskGroup group(*pool);
+			group.Run([&] { BuildRecursive(primitives, start, mid, left, pool); });
+			BuildRecursive(primitives, mid, end, right, pool);
+			group.Wait();
+			Splice(out, left);
+			second = Splice(out, right);
+		}
+		else {
+			BuildRecursive(primitives, start, mid, out, pool);
+			second = BuildRecursive(primitives, mid, end, out, pool);
+		}
+		BVHNode& node = out[nodeIndex];
+		node.bounds = bounds;
+		node.secondChildOffset = second;
+		node.primitiveCount = 0;
+		node.axis = (uint8_t)axis;
+		node.pad = 0;
+		return nodeIndex;
+	}
+
+	template <typename IntersectFunc>
+	int Traverse(const PrecomputedRay& ray, Float& tMax, IntersectFunc& intersect, bool anyHit) const {
+		if (nodes.empty()) return -1;
+		int hit = -1;
+		int stack[64];
+		int stackSize = 0, current = 0;
+		while (true) {
+			const BVHNode& node = nodes[current];
+			if (hsm::IntersectP(ray, node.bounds, tMax)) {
+				if (node.primitiveCount > 0) {
+					for (int i = 0; i < node.primitiveCount; ++i) {
+						int index = primitiveIndices[node.primitivesOffset + i];
+						if (intersect(index, ray, tMax)) {
+							hit = index;
+							if (anyHit) return hit;
+						}
+					}
+					if (stackSize == 0) break;
+					current = stack[--stackSize];
+				}
+				else if (ray.sign[node.axis]) {
+					//visit the child on the near side of the split first
+					stack[stackSize++] = current + 1;
+					current = node.secondChildOffset;
+				}
+				else {
+					stack[stackSize++] = node.secondChildOffset;
+					current = current + 1;
+				}
+			}
+			else {
+				if (stackSize == 0) break;
+				current = stack[--stackSize];
+			}
+		}
+		return hit;
+	}
+
+	int maxPrimitives = 4;
+};
 }
\ No newline at end of file
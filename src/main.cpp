@@ -82,6 +82,11 @@ int main() {
 	std::cout << bounds.SurfaceArea() << std::endl;
 	std::cout << bounds.Volume() << std::endl;
 	std::cout << bounds << std::endl;
+	hsm::Matrix4x4 moved = hsm::Translate(hsm::Vector3f(1.0f, 2.0f, 3.0f)) * rotMat;
+	hsm::Bounds3f empty, boxes[2] = { empty, bounds }, movedBoxes[2];
+	hsm::TransformBounds(moved, boxes, movedBoxes, 2);
+	if (moved(empty).IsEmpty() && hsm::AffineTransform(moved)(empty).IsEmpty() && hsm::Transform(moved)(empty).IsEmpty() &&
+		viewMat(empty).IsEmpty() && movedBoxes[0].IsEmpty() && !movedBoxes[1].IsEmpty()) std::cout << "yess4!!!" << std::endl;
 
 	std::cout << "***********************" << std::endl;
 	hsm::Bounds2f bounds2(hsm::Point2f(0.0f, 0.0f), hsm::Point2f(5.0f, 6.5f));